@@ -61,6 +61,9 @@
  *  0: fallback that hardcodes each flag to its default "safe" value
  *  1: dynamic flag implementation that only needs extended inline asm
  *  2: dynamic flag implementation that takes advantages of asm goto
+ *  3: asm goto implementation with a 5-byte NOP on the fast path,
+ *     flipped with a breakpoint-based multi-byte patching protocol;
+ *     never selected by default.
  */
 #ifndef DYNAMIC_FLAG_IMPLEMENTATION_STYLE
 # if !defined(__GNUC__)
@@ -81,10 +84,11 @@
 # endif
 #endif
 
-#if DYNAMIC_FLAG_IMPLEMENTATION_STYLE < 0 || DYNAMIC_FLAG_IMPLEMENTATION_STYLE > 2
+#if DYNAMIC_FLAG_IMPLEMENTATION_STYLE < 0 || DYNAMIC_FLAG_IMPLEMENTATION_STYLE > 3
 # error "Invalid DYNAMIC_FLAG_IMPLEMENTATION_STYLE value.  " \
 	"Must be 0 (static flag), 1 (non-asm-goto fallback), "	\
-	"or 2 (preferred asm-goto implementation)."
+	"2 (preferred asm-goto implementation), "		\
+	"or 3 (asm-goto with NOP fast path)."
 #endif
 
 /*
@@ -95,6 +99,23 @@
 #define DYNAMIC_FLAG_CTL_INTERFACE 1
 #endif
 
+/*
+ * Flag names embed the source file that defines them.  Define
+ * DYNAMIC_FLAG_FILE to a string literal (e.g., a short per-file
+ * identifier) to override the default, `__FILE__`.  With
+ * DYNAMIC_FLAG_SHORT_FILE_NAMES=1, compilers that support it
+ * (GCC 12, clang 9) use the file's basename, `__FILE_NAME__`, which
+ * shrinks the strings and keeps them independent of build paths.
+ */
+#ifndef DYNAMIC_FLAG_FILE
+# if defined(DYNAMIC_FLAG_SHORT_FILE_NAMES) && DYNAMIC_FLAG_SHORT_FILE_NAMES && \
+    defined(__FILE_NAME__)
+#  define DYNAMIC_FLAG_FILE __FILE_NAME__
+# else
+#  define DYNAMIC_FLAG_FILE __FILE__
+# endif
+#endif
+
 /**
  * DF_FEATURE defines a dynamic boolean flag that defaults to false,
  * and is always false when the dynamic_flag library does not run.
@@ -106,7 +127,7 @@
 #define DF_FEATURE(KIND, NAME, ...)					\
 	__builtin_expect(DYNAMIC_FLAG_IMPL(				\
 	    DYNAMIC_FLAG_VALUE_INACTIVE, DYNAMIC_FLAG_VALUE_INACTIVE, 0, \
-	    KIND, NAME, __FILE__, __LINE__, "" __VA_ARGS__),		\
+	    KIND, NAME, DYNAMIC_FLAG_FILE, __LINE__, "" __VA_ARGS__),	\
         0)
 
 /**
@@ -120,7 +141,7 @@
 #define DF_DEFAULT(KIND, NAME, ...)					\
 	__builtin_expect(!DYNAMIC_FLAG_IMPL(				\
 	    DYNAMIC_FLAG_VALUE_INACTIVE, DYNAMIC_FLAG_VALUE_INACTIVE, 1, \
-	    KIND, NAME, __FILE__, __LINE__, "" __VA_ARGS__),		\
+	    KIND, NAME, DYNAMIC_FLAG_FILE, __LINE__, "" __VA_ARGS__),	\
 	1)
 
 /**
@@ -135,7 +156,7 @@
 #define DF_DEFAULT_SLOW(KIND, NAME, ...)				\
 	__builtin_expect(DYNAMIC_FLAG_IMPL(				\
 	    DYNAMIC_FLAG_VALUE_ACTIVE, DYNAMIC_FLAG_VALUE_ACTIVE, 0,	\
-	    KIND, NAME, __FILE__, __LINE__, "" __VA_ARGS__),		\
+	    KIND, NAME, DYNAMIC_FLAG_FILE, __LINE__, "" __VA_ARGS__),	\
 	0)
 
 /**
@@ -151,7 +172,7 @@
 #define DF_OPT(KIND, NAME, ...)						\
 	__builtin_expect(DYNAMIC_FLAG_IMPL(				\
 	    DYNAMIC_FLAG_VALUE_ACTIVE, DYNAMIC_FLAG_VALUE_INACTIVE, 0,	\
-	    KIND, NAME, __FILE__, __LINE__, "" __VA_ARGS__),		\
+	    KIND, NAME, DYNAMIC_FLAG_FILE, __LINE__, "" __VA_ARGS__),	\
 	0)
 
 /**
@@ -176,11 +197,81 @@
 # define DF_DEBUG(NAME, ...) DF_FEATURE(debug, NAME, ##__VA_ARGS__)
 #endif
 
+/**
+ * DF_SWITCH defines a dynamic N-way switch, and evaluates to the
+ * index of the currently selected case, from 0 to N - 1 (N must be
+ * an integer literal from 2 to 8).  Case 0 is selected initially,
+ * and is the fast path: the hook falls through to case 0, and
+ * otherwise executes a direct jump to the selected case, without
+ * any compare chain.
+ *
+ *   switch (DF_SWITCH(hash, impl, 3, "Hash function")) {
+ *   case 0: ...
+ *   case 1: ...
+ *   case 2: ...
+ *   }
+ *
+ * Cases are selected with `dynamic_flag_select` or
+ * `dynamic_flag_select_kind`.  DF_SWITCH always evaluates to 0
+ * unless the implementation style uses asm goto (style >= 2).
+ *
+ * The fourth argument is an optional docstring.
+ */
+#define DF_SWITCH(KIND, NAME, N, ...)					\
+	DYNAMIC_FLAG_SWITCH_IMPL(N, KIND, NAME, DYNAMIC_FLAG_FILE, __LINE__, \
+	    "" __VA_ARGS__)
+
+/**
+ * DF_CALL calls FN with the remaining arguments through a direct
+ * call, whose target may be retargeted at runtime to any function
+ * with the same signature, without any indirect branch.
+ *
+ *   uint64_t h = DF_CALL(hash, impl, hash_default, buf, len);
+ *
+ * All DF_CALL sites with the same kind and name call a shared
+ * trampoline (`jmp rel32`), which the library patches; they must
+ * agree on FN.  Targets are set with `dynamic_flag_set_call` or
+ * `dynamic_flag_set_call_kind`.  DF_CALL always calls FN unless the
+ * implementation style uses asm goto (style >= 2).
+ */
+#define DF_CALL(KIND, NAME, FN, ...)					\
+	DYNAMIC_FLAG_CALL_IMPL(KIND, NAME, DYNAMIC_FLAG_FILE, __LINE__, FN, \
+	    ##__VA_ARGS__)
+
 #if DYNAMIC_FLAG_CTL_INTERFACE
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
 
+/**
+ * Patch backends implement writes to the machine code.
+ *
+ * `DYNAMIC_FLAG_BACKEND_MPROTECT` temporarily makes code pages
+ * writable around each batch of writes.
+ *
+ * `DYNAMIC_FLAG_BACKEND_ALIAS` remaps the code pages that contain
+ * flags to a shared memory file, once, and writes hook instructions
+ * through a second, writable, view of that file.  Code pages stay
+ * read-only and executable, and flipping flags doesn't need any
+ * system call.  However, the remapped code pages are no longer
+ * backed by the executable file, and the backend is only available
+ * when a single module (executable or shared object) has flags.
+ *
+ * `DYNAMIC_FLAG_BACKEND_PROC_MEM` writes hook instructions with
+ * `pwrite` on `/proc/self/mem`, one `pwrite` per batch of writes to
+ * the same page.  It works when security policies deny writable
+ * mappings of code pages.
+ *
+ * `dynamic_flag_init_lib` picks the mprotect backend if it works, and
+ * the proc_mem backend otherwise.  When neither works, the backend
+ * is "none", and all attempts to flip flags fail.
+ */
+enum dynamic_flag_backend {
+	DYNAMIC_FLAG_BACKEND_MPROTECT = 0,
+	DYNAMIC_FLAG_BACKEND_ALIAS = 1,
+	DYNAMIC_FLAG_BACKEND_PROC_MEM = 2,
+};
+
 #if DYNAMIC_FLAG_IMPLEMENTATION_STYLE != 0
 /**
  * @brief (de)activate all flags of kind @a KIND; if @a PATTERN is
@@ -189,10 +280,11 @@
  */
 #define dynamic_flag_activate_kind(KIND, PATTERN)			\
 	do {								\
-		ssize_t dynamic_flag_activate_kind_inner(const void **start,\
-		    const void **end, const char *regex);		\
-		extern const void *__start_dynamic_flag_##KIND##_list[];\
-		extern const void *__stop_dynamic_flag_##KIND##_list[]; \
+		ssize_t dynamic_flag_activate_kind_inner(		\
+		    const int32_t *start, const int32_t *end,		\
+		    const char *regex);					\
+		extern const int32_t __start_dynamic_flag_##KIND##_list[]; \
+		extern const int32_t __stop_dynamic_flag_##KIND##_list[]; \
 									\
 		dynamic_flag_activate_kind_inner(			\
 		    __start_dynamic_flag_##KIND##_list,			\
@@ -202,10 +294,11 @@
 
 #define dynamic_flag_deactivate_kind(KIND, PATTERN)			\
 	do {								\
-		ssize_t dynamic_flag_deactivate_kind_inner(const void **start,\
-		    const void **end, const char *regex);		\
-		extern const void *__start_dynamic_flag_##KIND##_list[];\
-		extern const void *__stop_dynamic_flag_##KIND##_list[]; \
+		ssize_t dynamic_flag_deactivate_kind_inner(		\
+		    const int32_t *start, const int32_t *end,		\
+		    const char *regex);					\
+		extern const int32_t __start_dynamic_flag_##KIND##_list[]; \
+		extern const int32_t __stop_dynamic_flag_##KIND##_list[]; \
 									\
 		dynamic_flag_deactivate_kind_inner(			\
 		    __start_dynamic_flag_##KIND##_list,			\
@@ -213,6 +306,83 @@
 		    (PATTERN));						\
 	} while (0)
 
+/**
+ * @brief sets the deactivation grace period of all flags of kind
+ *  @a KIND to @a GRACE_NS nanoseconds (0 to disable).
+ *
+ * See `dynamic_flag_set_adaptive_grace`.
+ */
+#define dynamic_flag_set_grace_period_kind(KIND, GRACE_NS)		\
+	({								\
+		int dynamic_flag_set_grace_period_kind_inner(		\
+		    const int32_t *start, const int32_t *end,		\
+		    uint64_t grace_ns);					\
+		extern const int32_t __start_dynamic_flag_##KIND##_list[]; \
+		extern const int32_t __stop_dynamic_flag_##KIND##_list[]; \
+									\
+		dynamic_flag_set_grace_period_kind_inner(		\
+		    __start_dynamic_flag_##KIND##_list,			\
+		    __stop_dynamic_flag_##KIND##_list,			\
+		    (GRACE_NS));					\
+	})
+
+/**
+ * @brief selects case @a CASE for all DF_SWITCH sites of kind @a KIND;
+ *  if @a PATTERN is non-NULL, the switch names must match @a PATTERN
+ *  as a regex.
+ */
+#define dynamic_flag_select_kind(KIND, PATTERN, CASE)			\
+	do {								\
+		ssize_t dynamic_flag_select_kind_inner(			\
+		    const int32_t *start, const int32_t *end,		\
+		    const char *regex, unsigned int which);		\
+		extern const int32_t __start_dynamic_flag_##KIND##_list[]; \
+		extern const int32_t __stop_dynamic_flag_##KIND##_list[]; \
+									\
+		dynamic_flag_select_kind_inner(				\
+		    __start_dynamic_flag_##KIND##_list,			\
+		    __stop_dynamic_flag_##KIND##_list,			\
+		    (PATTERN), (CASE));					\
+	} while (0)
+
+/**
+ * @brief retargets all DF_CALL sites of kind @a KIND to @a FN (a
+ *  `void *`), or back to their default if NULL; if @a PATTERN is
+ *  non-NULL, the call names must match @a PATTERN as a regex.
+ */
+#define dynamic_flag_set_call_kind(KIND, PATTERN, FN)			\
+	do {								\
+		ssize_t dynamic_flag_set_call_kind_inner(		\
+		    const int32_t *start, const int32_t *end,		\
+		    const char *regex, void *fn);			\
+		extern const int32_t __start_dynamic_flag_##KIND##_list[]; \
+		extern const int32_t __stop_dynamic_flag_##KIND##_list[]; \
+									\
+		dynamic_flag_set_call_kind_inner(			\
+		    __start_dynamic_flag_##KIND##_list,			\
+		    __stop_dynamic_flag_##KIND##_list,			\
+		    (PATTERN), (FN));					\
+	} while (0)
+
+/**
+ * @brief creates a group with all flags of kind @a KIND; if @a PATTERN
+ *  is non-NULL, the flag names must match @a PATTERN as a regex.
+ */
+#define dynamic_flag_group_create_kind(KIND, PATTERN)			\
+	({								\
+		struct dynamic_flag_group *				\
+		dynamic_flag_group_create_kind_inner( \
+		    const int32_t *start, const int32_t *end,		\
+		    const char *regex);					\
+		extern const int32_t __start_dynamic_flag_##KIND##_list[]; \
+		extern const int32_t __stop_dynamic_flag_##KIND##_list[]; \
+									\
+		dynamic_flag_group_create_kind_inner(			\
+		    __start_dynamic_flag_##KIND##_list,			\
+		    __stop_dynamic_flag_##KIND##_list,			\
+		    (PATTERN));						\
+	})
+
 /**
  * @brief activate all flags that match @a regex, regardless of the kind.
  * @return the number of matched flags on success, negative on failure.
@@ -240,6 +410,186 @@ ssize_t dynamic_flag_unhook(const char *regex);
  */
 ssize_t dynamic_flag_rehook(const char *regex);
 
+/**
+ * @brief activate all flags named @a name, either a full flag name
+ *  (`kind:name@file:line`) or a `kind:name` prefix.
+ * @return the number of matched flags on success, negative on failure.
+ *
+ * Unlike `dynamic_flag_activate`, this looks @a name up in a hash
+ * table, in time proportional to the number of matched flags.
+ */
+ssize_t dynamic_flag_activate_exact(const char *name);
+
+/**
+ * @brief deactivate all flags named @a name, like
+ *  `dynamic_flag_activate_exact`.
+ * @return the number of matched flags on success, negative on failure.
+ */
+ssize_t dynamic_flag_deactivate_exact(const char *name);
+
+/**
+ * @brief checks whether any flag named @a name (a full flag name or a
+ *  `kind:name` prefix) is active, without taking any lock.
+ * @return 1 if at least one is active, 0 if none is, -1 if no flag
+ *  has that name.
+ *
+ * The result may be stale by the time the function returns if other
+ * threads flip the flag concurrently.
+ */
+int dynamic_flag_is_active(const char *name);
+
+/**
+ * @brief selects case @a which for all DF_SWITCH sites that match
+ *  @a regex, regardless of the kind.
+ * @return the number of switch sites with at least @a which + 1
+ *  cases that match @a regex, negative on failure.
+ *
+ * Selecting a case other than 0 is a no-op for unhooked switches;
+ * selecting case 0 always goes through.  Boolean flags are never
+ * affected.
+ */
+ssize_t dynamic_flag_select(const char *regex, unsigned int which);
+
+/**
+ * @brief retargets all DF_CALL sites that match @a regex to @a fn, or
+ *  back to their default if @a fn is NULL.
+ * @return the number of call sites that match @a regex, negative on
+ *  failure (e.g., if @a fn is out of `call rel32` range for some).
+ *
+ * Retargeting to a non-default function is a no-op for unhooked call
+ * sites.  @a fn must have the same signature as the sites' default.
+ */
+ssize_t dynamic_flag_set_call(const char *regex, void *fn);
+
+/**
+ * A set of flags resolved once, for programs that repeatedly flip
+ * the same flags (e.g., per request).
+ */
+struct dynamic_flag_group;
+
+/**
+ * @brief creates a group with all flags that match @a regex,
+ *  regardless of the kind.
+ * @return the new group, or NULL on failure.
+ *
+ * The group's flags are resolved once, so flipping them costs time
+ * proportional to the size of the group, without any regex matching
+ * or allocation.
+ */
+struct dynamic_flag_group *dynamic_flag_group_create(const char *regex);
+
+/**
+ * @brief activates all flags in @a group, like `dynamic_flag_activate`.
+ * @return the number of flags in @a group on success, negative on
+ *  failure.
+ */
+ssize_t dynamic_flag_group_activate(struct dynamic_flag_group *group);
+
+/**
+ * @brief deactivates all flags in @a group, like
+ *  `dynamic_flag_deactivate`.
+ * @return the number of flags in @a group on success, negative on
+ *  failure.
+ */
+ssize_t dynamic_flag_group_deactivate(struct dynamic_flag_group *group);
+
+/**
+ * @brief sets the deactivation grace period of all flags in @a group
+ *  to @a grace_ns nanoseconds (0 to disable).
+ *
+ * See `dynamic_flag_set_adaptive_grace`.
+ */
+int dynamic_flag_group_set_grace_period(struct dynamic_flag_group *group,
+    uint64_t grace_ns);
+
+/**
+ * @brief releases @a group.  Does not change the state of its flags.
+ */
+void dynamic_flag_group_destroy(struct dynamic_flag_group *group);
+
+/**
+ * @brief configures adaptive deactivation grace periods.
+ *
+ * When the activation count of a flag with a grace period (see
+ * `dynamic_flag_set_grace_period_kind`) drops to zero, its code stays
+ * active until the grace period expires, so bursts of activations
+ * and deactivations don't keep rewriting code.  Expired flags are
+ * deactivated by the next flag operation that patches code, or by
+ * `dynamic_flag_sweep`.
+ *
+ * With a non-zero @a threshold, a kind or group whose flags are
+ * deactivated more than @a threshold times in a second doubles its
+ * grace period, up to @a max_grace_ns, and halves it back once per
+ * calmer second.  0 (the default) disables adaptation.
+ */
+void dynamic_flag_set_adaptive_grace(uint64_t threshold,
+    uint64_t max_grace_ns);
+
+/**
+ * @brief deactivates flags whose grace period expired.
+ * @return the number of deactivated flags, negative on failure.
+ *
+ * Programs that rarely flip flags should call this function
+ * periodically (e.g., from a timer) to bound the grace period.
+ */
+ssize_t dynamic_flag_sweep(void);
+
+/**
+ * @brief queues the activation of all flags that match @a regex, for
+ *  a background patcher thread.
+ * @return 0 if the request was queued, negative on failure.
+ *
+ * The first asynchronous request starts the patcher thread.  The
+ * patcher applies all queued requests at once, in the order they were
+ * queued and with the same saturating counts as synchronous calls, so
+ * opposing requests for the same flag cancel out without patching
+ * code.  Use `dynamic_flag_flush` to wait for the requests to take
+ * effect.
+ */
+int dynamic_flag_activate_async(const char *regex);
+
+/**
+ * @brief queues the deactivation of all flags that match @a regex,
+ *  like `dynamic_flag_activate_async`.
+ */
+int dynamic_flag_deactivate_async(const char *regex);
+
+/**
+ * @brief waits until every asynchronous request queued before the
+ *  call has been applied.
+ * @return 0 on success, negative if any request applied since the
+ *  last flush failed (e.g., because of an invalid regex).
+ *
+ * Must not be called in a transaction.
+ */
+int dynamic_flag_flush(void);
+
+/**
+ * @brief opens a transaction on the calling thread.
+ *
+ * Until the matching `dynamic_flag_txn_commit`, flag operations
+ * issued by the calling thread (activations, deactivations, unhooks
+ * and rehooks, by regex or by kind) only update activation and unhook
+ * counts, in order, with the usual saturating semantics.  The machine
+ * code for all flags whose activation count crossed zero is then
+ * updated in one pass at commit time.
+ *
+ * Transactions nest; only the outermost commit patches code.  Control
+ * calls from other threads block until the outermost commit.
+ */
+void dynamic_flag_txn_begin(void);
+
+/**
+ * @brief closes the calling thread's current transaction.
+ * @return the number of flags whose machine code was updated, 0 for
+ *  nested commits, or -1 if patching failed.
+ *
+ * Flags whose activation count crossed zero and came back during the
+ * transaction already have the right code, and are neither patched
+ * nor counted.
+ */
+ssize_t dynamic_flag_txn_commit(void);
+
 /**
  * Description for a given dynamic flag's state.
  *
@@ -256,11 +606,24 @@ struct dynamic_flag_state {
 	const void *hook;  /* Address of the hook instruction */
 
 	/*
-	 * This field is only useful if DYNAMIC_FLAG_IMPLEMENTATION_STYLE == 2;
+	 * This field is only useful if DYNAMIC_FLAG_IMPLEMENTATION_STYLE >= 2;
 	 * otherwise it's always 0.
 	 */
 	const void *destination;  /* Address of the slow path code. */
 	bool duplicate;
+
+	/*
+	 * Number of cases for DF_SWITCH sites (`activation` is then the
+	 * selected case, and `destination` the case table), 0 for
+	 * boolean flags.
+	 */
+	unsigned int cases;
+
+	/*
+	 * Current callee for retargeted DF_CALL sites, NULL otherwise
+	 * (`destination` is then the default callee).
+	 */
+	const void *target;
 };
 
 /**
@@ -268,10 +631,25 @@ struct dynamic_flag_state {
  *   @a cb returns a non-zero value.
  * @return -1 if we failed to compile the regex, the first non-zero value
  *   returned by @a cb if any, or the number of flags listed otherwise.
+ *
+ * The states come from a consistent snapshot of all flags, taken
+ * without blocking flag operations.  Only the counts of flags that
+ * stay active may change concurrently.
  */
 ssize_t dynamic_flag_list_state(const char *regex,
     ssize_t (*cb)(void *ctx, const struct dynamic_flag_state *), void *ctx);
 
+/**
+ * @brief returns a number that changes after each operation that may
+ *  have changed the state of a flag.
+ *
+ * The generation covers every field `dynamic_flag_list_state`
+ * reports, including the activation counts of flags that stay active.
+ * Pollers can read the generation before `dynamic_flag_list_state`,
+ * and skip the next snapshot if the generation is then unchanged.
+ */
+uint64_t dynamic_flag_generation(void);
+
 /**
  * @brief Prints all non-duplicate entries to the `FILE *` ctx, or to `stderr` if
  *   NULL.
@@ -286,6 +664,24 @@ ssize_t dynamic_flag_list_fprintf_cb(void *ctx, const struct dynamic_flag_state
  */
 void dynamic_flag_init_lib(void);
 
+/**
+ * @brief Registers the flags of modules loaded with `dlopen`, and
+ *   forgets those of modules unloaded with `dlclose`, since the last
+ *   call.
+ *
+ * Flag operations don't look for new modules on their own: call this
+ * after `dlopen` for its flags to be visible, and after `dlclose`,
+ * before any other flag operation (in any thread).  New modules start
+ * with the net effect of all earlier `dynamic_flag_activate`,
+ * `dynamic_flag_deactivate`, `dynamic_flag_unhook` and
+ * `dynamic_flag_rehook` calls (including their kind and async
+ * variants), as if they had been loaded before those calls.
+ *
+ * Waits for concurrent flag operations to finish, and cheap when no
+ * module was loaded or unloaded.  No-op in a transaction.
+ */
+void dynamic_flag_poll_modules(void);
+
 /**
  * @brief Updates the "minimal write" flag (false by default).
  *
@@ -297,6 +693,59 @@ void dynamic_flag_init_lib(void);
  * It is safe to call this function multiple times.
  */
 void dynamic_flag_set_minimal_write_mode(bool is_minimal);
+
+/**
+ * @brief Updates the "sync core" flag (false by default).
+ *
+ * When the "sync core" flag is true, the dynamic_flag library issues
+ * a core-serialising `membarrier` after each batch of writes to
+ * machine code (at most one per flag operation), so that operations
+ * only return once every thread is guaranteed to execute the new
+ * code.  Otherwise, other threads will observe the new code
+ * eventually, but without any ordering guarantee.
+ *
+ * @return 0 on success, -1 if the kernel does not support
+ *  `MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE` (the flag is then
+ *  unchanged).
+ */
+int dynamic_flag_set_sync_core_mode(bool sync_core);
+
+/**
+ * @brief switches to patch backend @a which, after setting it up if
+ *  necessary.
+ * @return 0 on success, -1 if the backend is unavailable (and the
+ *  current backend is unchanged).
+ */
+int dynamic_flag_set_backend(enum dynamic_flag_backend which);
+
+/**
+ * @brief returns the name of the current patch backend: "mprotect",
+ *  "alias", "proc_mem", or "none".
+ */
+const char *dynamic_flag_backend_name(void);
+
+/**
+ * @brief sets the number of untouched pages that may separate two
+ *  hooks patched in the same window (64 by default).
+ *
+ * Each window costs one pair of `mprotect` calls (and one round of
+ * core synchronisation), and each page in a window adds a small
+ * per-page cost, so bridging short gaps saves time.  0 only merges
+ * adjacent pages; `SIZE_MAX` always patches the whole span between
+ * the lowest and highest hook in one window.  Gaps are only bridged
+ * when the pages in between are known to be executable.
+ */
+void dynamic_flag_set_coalesce_gap(size_t pages);
+
+/**
+ * @brief reads the hit and miss counts of the pattern cache.
+ *
+ * The library caches the set of flags that match the last 64 regexes
+ * (per kind for `dynamic_flag_*_kind` calls), so repeated flips with
+ * the same pattern skip regex compilation and matching.  Only
+ * patterns that match at most 1024 flags are cached.
+ */
+void dynamic_flag_pattern_cache_stats(uint64_t *hits, uint64_t *misses);
 #else
 
 #define dynamic_flag_activate_kind(KIND, PATTERN) dynamic_flag_dummy((PATTERN))
@@ -306,8 +755,36 @@ void dynamic_flag_set_minimal_write_mode(bool is_minimal);
 #define dynamic_flag_deactivate dynamic_flag_dummy
 #define dynamic_flag_unhook dynamic_flag_dummy
 #define dynamic_flag_rehook dynamic_flag_dummy
+#define dynamic_flag_group_create(REGEX) ((struct dynamic_flag_group *)NULL)
+#define dynamic_flag_group_create_kind(KIND, PATTERN) ((struct dynamic_flag_group *)NULL)
+#define dynamic_flag_group_activate(GROUP) dynamic_flag_dummy(NULL)
+#define dynamic_flag_group_deactivate(GROUP) dynamic_flag_dummy(NULL)
+#define dynamic_flag_group_destroy(GROUP) ((void)(GROUP))
+#define dynamic_flag_group_set_grace_period(GROUP, GRACE_NS) dynamic_flag_dummy(NULL)
+#define dynamic_flag_set_grace_period_kind(KIND, GRACE_NS) dynamic_flag_dummy(NULL)
+#define dynamic_flag_set_adaptive_grace(THRESHOLD, MAX_NS) dynamic_flag_dummy(NULL)
+#define dynamic_flag_sweep() dynamic_flag_dummy(NULL)
+#define dynamic_flag_activate_async dynamic_flag_dummy
+#define dynamic_flag_deactivate_async dynamic_flag_dummy
+#define dynamic_flag_flush() dynamic_flag_dummy(NULL)
+#define dynamic_flag_generation() ((uint64_t)0)
+#define dynamic_flag_activate_exact dynamic_flag_dummy
+#define dynamic_flag_deactivate_exact dynamic_flag_dummy
+#define dynamic_flag_is_active dynamic_flag_dummy
+#define dynamic_flag_select(REGEX, CASE) dynamic_flag_dummy((REGEX))
+#define dynamic_flag_select_kind(KIND, PATTERN, CASE) dynamic_flag_dummy((PATTERN))
+#define dynamic_flag_set_call(REGEX, FN) dynamic_flag_dummy((REGEX))
+#define dynamic_flag_set_call_kind(KIND, PATTERN, FN) dynamic_flag_dummy((PATTERN))
+#define dynamic_flag_txn_begin dynamic_flag_init_lib_dummy
+#define dynamic_flag_txn_commit() dynamic_flag_dummy(NULL)
 #define dynamic_flag_set_minimal_write_mode(MODE) ((MODE) ? dynamic_flag_init_lib_dummy() : (void)0)
+#define dynamic_flag_set_backend(BACKEND) dynamic_flag_dummy(NULL)
+#define dynamic_flag_set_sync_core_mode(MODE) dynamic_flag_dummy(NULL)
+#define dynamic_flag_backend_name() "none"
+#define dynamic_flag_set_coalesce_gap(PAGES) dynamic_flag_dummy(NULL)
+#define dynamic_flag_pattern_cache_stats(HITS, MISSES) (*(HITS) = 0, *(MISSES) = 0)
 #define dynamic_flag_init_lib dynamic_flag_init_lib_dummy
+#define dynamic_flag_poll_modules dynamic_flag_init_lib_dummy
 #define dynamic_flag_list dynamic_flag_list_state_dummy
 
 #endif  /* DYNAMIC_FLAG_IMPLEMENTATION_STYLE */
@@ -339,14 +816,54 @@ dynamic_flag_list_state_dummy(const char *regex,
 }
 #endif  /* DYNAMIC_FLAG_CTL_INTERFACE */
 
+/*
+ * Patch records (`dynamic_flag_list`) and the lists of records
+ * (`dynamic_flag_*_list`) only hold 32-bit offsets relative to each
+ * field (`.long X - .`), like the kernel's relative jump tables: flag
+ * metadata needs no dynamic relocation in position-independent
+ * executables, and each record is 20 bytes.
+ */
+
+/*
+ * Hooks are assembled in their DEFAULT state.  Flags whose INITIAL
+ * state differs (e.g., DF_OPT) also get a reference in
+ * `dynamic_flag_init`, the only hooks the library must patch
+ * at startup.  The section name stays out of the kind lists'
+ * namespace (`dynamic_flag_${KIND}_list`), so any kind name is safe.
+ */
+#define DYNAMIC_FLAG_INIT_ENTRY(DEFAULT, INITIAL)			\
+	".if "#DEFAULT" != "#INITIAL"\n\t"				\
+	".pushsection dynamic_flag_init,\"a\",@progbits\n\t"		\
+	".balign 4\n\t"							\
+	".long 3b - .\n\t"						\
+	".popsection\n\t"						\
+	".endif"
+
+/*
+ * Flag names and docstrings go in the same mergeable string section
+ * as the compiler's string literals, so the linker stores identical
+ * strings (e.g., for flags in inline functions defined in headers)
+ * once.  Merged strings may be shared by several records, and a
+ * docstring does not necessarily follow its name, so patch records
+ * point to each separately.
+ */
+#define DYNAMIC_FLAG_STRINGS_SECTION					\
+	".pushsection .rodata.str1.1,\"aMS\",@progbits,1\n\t"
+
 #if DYNAMIC_FLAG_IMPLEMENTATION_STYLE == 0
 
 #define DYNAMIC_FLAG_VALUE_ACTIVE 1
 #define DYNAMIC_FLAG_VALUE_INACTIVE 0
 #define DYNAMIC_FLAG_IMPL_(DEFAULT, ...) DEFAULT
+#define DYNAMIC_FLAG_SWITCH_IMPL(N, ...) 0
+#define DYNAMIC_FLAG_CALL_IMPL(KIND, NAME, FILE, LINE, FN, ...) (FN)(__VA_ARGS__)
 
 #elif DYNAMIC_FLAG_IMPLEMENTATION_STYLE == 1
 
+/* Switches and calls need asm goto; always pick the default. */
+#define DYNAMIC_FLAG_SWITCH_IMPL(N, ...) 0
+#define DYNAMIC_FLAG_CALL_IMPL(KIND, NAME, FILE, LINE, FN, ...) (FN)(__VA_ARGS__)
+
 /*
  * Fallback implementation: mov a constant into a variable, and let
  * the compiler test on the resulting value.  We flip a dynamic flag
@@ -376,24 +893,29 @@ dynamic_flag_list_state_dummy(const char *regex,
 		asm("1:\n\t"						\
 		    "movb $"#DEFAULT", %0\n\t"				\
 									\
-		    ".pushsection .rodata\n\t"				\
+		    DYNAMIC_FLAG_STRINGS_SECTION			\
 		    "2: .asciz \"" #KIND ":" #NAME "@" FILE ":" #LINE "\"\n\t" \
-		    ".asciz \"" DOC "\"\n\t"				\
+		    "5: .asciz \"" DOC "\"\n\t"				\
 		    ".popsection\n\t"					\
 									\
 		    ".pushsection dynamic_flag_list,\"a\",@progbits\n\t" \
+		    ".balign 4\n\t"					\
 		    "3:\n\t"						\
-		    ".quad 1b\n\t"					\
-		    ".quad 0\n\t"					\
-		    ".quad 2b\n\t"					\
+		    ".long 1b - .\n\t"					\
+		    ".long 0\n\t"					\
+		    ".long 2b - .\n\t"					\
+		    ".long 5b - .\n\t"					\
 		    ".byte "#INITIAL"\n\t"				\
 		    ".byte "#FLIPPED"\n\t"				\
-		    ".fill 6\n\t"					\
+		    ".fill 2\n\t"					\
 		    ".popsection\n\t"					\
 									\
 		    ".pushsection dynamic_flag_"#KIND"_list,\"a\",@progbits\n\t" \
-		    ".quad 3b\n\t"					\
-		    ".popsection"					\
+		    ".balign 4\n\t"					\
+		    ".long 3b - .\n\t"					\
+		    ".popsection\n\t"					\
+									\
+		    DYNAMIC_FLAG_INIT_ENTRY(DEFAULT, INITIAL)		\
 		    :"=r"(r));						\
 		!!r;							\
 	})
@@ -443,6 +965,10 @@ dynamic_flag_list_state_dummy(const char *regex,
 #define DYNAMIC_FLAG_VALUE_ACTIVE 0xe9 /* jmp rel 32 */
 #define DYNAMIC_FLAG_VALUE_INACTIVE 0xa9 /* testl $, %eax */
 
+/* Case 0 of a DF_SWITCH is a `testl $0, %eax`. */
+#define DYNAMIC_FLAG_SWITCH_FAST_PATH ".byte 0xa9\n\t.long 0\n\t"
+#define DYNAMIC_FLAG_SWITCH_CLOBBER "cc"
+
 #if defined(__GNUC__) && !defined(__clang__)
 #define DYNAMIC_FLAG_IMPL_COLD __attribute__((__cold__))
 #else
@@ -459,24 +985,29 @@ dynamic_flag_list_state_dummy(const char *regex,
 			 ".byte "#DEFAULT"\n\t"				\
 			 ".long %l[DYNAMIC_FLAG_IMPL_label] - (1b + 5)\n\t" \
 									\
-			 ".pushsection .rodata\n\t"			\
+			 DYNAMIC_FLAG_STRINGS_SECTION			\
 			 "2: .asciz \"" #KIND ":" #NAME "@" FILE ":" #LINE "\"\n\t" \
-			 ".asciz \"" DOC "\"\n\t"			\
+			 "5: .asciz \"" DOC "\"\n\t"			\
 			 ".popsection\n\t"				\
 									\
 			 ".pushsection dynamic_flag_list,\"a\",@progbits\n\t" \
+			 ".balign 4\n\t"				\
 			 "3:\n\t"					\
-			 ".quad 1b\n\t"					\
-			 ".quad %l[DYNAMIC_FLAG_IMPL_label]\n\t" 	\
-			 ".quad 2b\n\t"					\
+			 ".long 1b - .\n\t"				\
+			 ".long %l[DYNAMIC_FLAG_IMPL_label] - .\n\t"	\
+			 ".long 2b - .\n\t"				\
+			 ".long 5b - .\n\t"				\
 			 ".byte "#INITIAL"\n\t"				\
 			 ".byte "#FLIPPED"\n\t"				\
-			 ".fill 6\n\t"					\
+			 ".fill 2\n\t"					\
 			 ".popsection\n\t"				\
 									\
 			 ".pushsection dynamic_flag_"#KIND"_list,\"a\",@progbits\n\t" \
-			 ".quad 3b\n\t"					\
-			 ".popsection"					\
+			 ".balign 4\n\t"				\
+			 ".long 3b - .\n\t"				\
+			 ".popsection\n\t"				\
+									\
+			 DYNAMIC_FLAG_INIT_ENTRY(DEFAULT, INITIAL)	\
 			 ::: "cc" : DYNAMIC_FLAG_IMPL_label);		\
 		/* Emulate Linux's `asm_volatile_goto`. */		\
 		asm("");						\
@@ -488,6 +1019,245 @@ dynamic_flag_list_state_dummy(const char *regex,
 									\
 		r;							\
 	})
+#elif DYNAMIC_FLAG_IMPLEMENTATION_STYLE == 3
+
+/*
+ * Same idea as the asm goto implementation, except that the fast
+ * path is a 5-byte `nopl 0x0(%rax,%rax,1)` instead of a `testl`, so
+ * the fast path doesn't clobber EFLAGS.
+ *
+ * The NOP doesn't encode the jump offset, so flipping a flag must
+ * rewrite all 5 bytes while other threads may execute them.  The
+ * dynamic_flag library does that with a breakpoint: write an `int3`
+ * over the first byte, synchronise all cores, write the 4 tail bytes,
+ * synchronise again, and finally write the new first byte.  A
+ * SIGTRAP handler redirects threads that hit the transient `int3` to
+ * the old or new instruction's successor.
+ */
+
+#define DYNAMIC_FLAG_VALUE_ACTIVE 0xe9 /* jmp rel 32 */
+#define DYNAMIC_FLAG_VALUE_INACTIVE 0x0f /* first byte of nopl 0(%rax,%rax,1) */
+
+#define DYNAMIC_FLAG_SWITCH_FAST_PATH ".byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+#define DYNAMIC_FLAG_SWITCH_CLOBBER
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define DYNAMIC_FLAG_IMPL_COLD __attribute__((__cold__))
+#else
+#define DYNAMIC_FLAG_IMPL_COLD
+#endif
+
+#define DYNAMIC_FLAG_IMPL_(DEFAULT, INITIAL, FLIPPED,			\
+    KIND, NAME, FILE, LINE, DOC)					\
+	({								\
+		__label__ DYNAMIC_FLAG_IMPL_label;			\
+		unsigned char r = 0;					\
+									\
+		asm goto("1:\n\t"					\
+			 ".if "#DEFAULT" == 0xe9\n\t"			\
+			 ".byte 0xe9\n\t"				\
+			 ".long %l[DYNAMIC_FLAG_IMPL_label] - (1b + 5)\n\t" \
+			 ".else\n\t"					\
+			 ".byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"	\
+			 ".endif\n\t"					\
+									\
+			 DYNAMIC_FLAG_STRINGS_SECTION			\
+			 "2: .asciz \"" #KIND ":" #NAME "@" FILE ":" #LINE "\"\n\t" \
+			 "5: .asciz \"" DOC "\"\n\t"			\
+			 ".popsection\n\t"				\
+									\
+			 ".pushsection dynamic_flag_list,\"a\",@progbits\n\t" \
+			 ".balign 4\n\t"				\
+			 "3:\n\t"					\
+			 ".long 1b - .\n\t"				\
+			 ".long %l[DYNAMIC_FLAG_IMPL_label] - .\n\t"	\
+			 ".long 2b - .\n\t"				\
+			 ".long 5b - .\n\t"				\
+			 ".byte "#INITIAL"\n\t"				\
+			 ".byte "#FLIPPED"\n\t"				\
+			 ".fill 2\n\t"					\
+			 ".popsection\n\t"				\
+									\
+			 ".pushsection dynamic_flag_"#KIND"_list,\"a\",@progbits\n\t" \
+			 ".balign 4\n\t"				\
+			 ".long 3b - .\n\t"				\
+			 ".popsection\n\t"				\
+									\
+			 DYNAMIC_FLAG_INIT_ENTRY(DEFAULT, INITIAL)	\
+			 ::: : DYNAMIC_FLAG_IMPL_label);		\
+		/* Emulate Linux's `asm_volatile_goto`. */		\
+		asm("");						\
+									\
+		if (0) {						\
+		DYNAMIC_FLAG_IMPL_label: DYNAMIC_FLAG_IMPL_COLD;	\
+			r = 1;						\
+		}							\
+									\
+		r;							\
+	})
+#endif
+
+#if DYNAMIC_FLAG_IMPLEMENTATION_STYLE >= 2
+/*
+ * DF_SWITCH sites are hooks that fall through to case 0, like a
+ * disabled flag, and are otherwise rewritten to a `jmp rel32` to the
+ * selected case's label.
+ *
+ * The patch record's destination points to a table of the labels
+ * for cases 1 to N - 1, and the record's type byte (1) and case
+ * count tell the library it's looking at a switch.
+ *
+ * Each label sets the result to its case index, and the compiler
+ * can thread the jumps from these labels to the caller's `switch`
+ * on that result.
+ */
+#define DYNAMIC_FLAG_SWITCH_DECL_2 __label__ DYNAMIC_FLAG_SWITCH_1;
+#define DYNAMIC_FLAG_SWITCH_DECL_3 DYNAMIC_FLAG_SWITCH_DECL_2 __label__ DYNAMIC_FLAG_SWITCH_2;
+#define DYNAMIC_FLAG_SWITCH_DECL_4 DYNAMIC_FLAG_SWITCH_DECL_3 __label__ DYNAMIC_FLAG_SWITCH_3;
+#define DYNAMIC_FLAG_SWITCH_DECL_5 DYNAMIC_FLAG_SWITCH_DECL_4 __label__ DYNAMIC_FLAG_SWITCH_4;
+#define DYNAMIC_FLAG_SWITCH_DECL_6 DYNAMIC_FLAG_SWITCH_DECL_5 __label__ DYNAMIC_FLAG_SWITCH_5;
+#define DYNAMIC_FLAG_SWITCH_DECL_7 DYNAMIC_FLAG_SWITCH_DECL_6 __label__ DYNAMIC_FLAG_SWITCH_6;
+#define DYNAMIC_FLAG_SWITCH_DECL_8 DYNAMIC_FLAG_SWITCH_DECL_7 __label__ DYNAMIC_FLAG_SWITCH_7;
+
+#define DYNAMIC_FLAG_SWITCH_TABLE_2 ".long %l[DYNAMIC_FLAG_SWITCH_1] - .\n\t"
+#define DYNAMIC_FLAG_SWITCH_TABLE_3 DYNAMIC_FLAG_SWITCH_TABLE_2 ".long %l[DYNAMIC_FLAG_SWITCH_2] - .\n\t"
+#define DYNAMIC_FLAG_SWITCH_TABLE_4 DYNAMIC_FLAG_SWITCH_TABLE_3 ".long %l[DYNAMIC_FLAG_SWITCH_3] - .\n\t"
+#define DYNAMIC_FLAG_SWITCH_TABLE_5 DYNAMIC_FLAG_SWITCH_TABLE_4 ".long %l[DYNAMIC_FLAG_SWITCH_4] - .\n\t"
+#define DYNAMIC_FLAG_SWITCH_TABLE_6 DYNAMIC_FLAG_SWITCH_TABLE_5 ".long %l[DYNAMIC_FLAG_SWITCH_5] - .\n\t"
+#define DYNAMIC_FLAG_SWITCH_TABLE_7 DYNAMIC_FLAG_SWITCH_TABLE_6 ".long %l[DYNAMIC_FLAG_SWITCH_6] - .\n\t"
+#define DYNAMIC_FLAG_SWITCH_TABLE_8 DYNAMIC_FLAG_SWITCH_TABLE_7 ".long %l[DYNAMIC_FLAG_SWITCH_7] - .\n\t"
+
+#define DYNAMIC_FLAG_SWITCH_LABELS_2 DYNAMIC_FLAG_SWITCH_1
+#define DYNAMIC_FLAG_SWITCH_LABELS_3 DYNAMIC_FLAG_SWITCH_LABELS_2, DYNAMIC_FLAG_SWITCH_2
+#define DYNAMIC_FLAG_SWITCH_LABELS_4 DYNAMIC_FLAG_SWITCH_LABELS_3, DYNAMIC_FLAG_SWITCH_3
+#define DYNAMIC_FLAG_SWITCH_LABELS_5 DYNAMIC_FLAG_SWITCH_LABELS_4, DYNAMIC_FLAG_SWITCH_4
+#define DYNAMIC_FLAG_SWITCH_LABELS_6 DYNAMIC_FLAG_SWITCH_LABELS_5, DYNAMIC_FLAG_SWITCH_5
+#define DYNAMIC_FLAG_SWITCH_LABELS_7 DYNAMIC_FLAG_SWITCH_LABELS_6, DYNAMIC_FLAG_SWITCH_6
+#define DYNAMIC_FLAG_SWITCH_LABELS_8 DYNAMIC_FLAG_SWITCH_LABELS_7, DYNAMIC_FLAG_SWITCH_7
+
+#define DYNAMIC_FLAG_SWITCH_CASES_2 if (0) { DYNAMIC_FLAG_SWITCH_1: r = 1; }
+#define DYNAMIC_FLAG_SWITCH_CASES_3 DYNAMIC_FLAG_SWITCH_CASES_2 if (0) { DYNAMIC_FLAG_SWITCH_2: r = 2; }
+#define DYNAMIC_FLAG_SWITCH_CASES_4 DYNAMIC_FLAG_SWITCH_CASES_3 if (0) { DYNAMIC_FLAG_SWITCH_3: r = 3; }
+#define DYNAMIC_FLAG_SWITCH_CASES_5 DYNAMIC_FLAG_SWITCH_CASES_4 if (0) { DYNAMIC_FLAG_SWITCH_4: r = 4; }
+#define DYNAMIC_FLAG_SWITCH_CASES_6 DYNAMIC_FLAG_SWITCH_CASES_5 if (0) { DYNAMIC_FLAG_SWITCH_5: r = 5; }
+#define DYNAMIC_FLAG_SWITCH_CASES_7 DYNAMIC_FLAG_SWITCH_CASES_6 if (0) { DYNAMIC_FLAG_SWITCH_6: r = 6; }
+#define DYNAMIC_FLAG_SWITCH_CASES_8 DYNAMIC_FLAG_SWITCH_CASES_7 if (0) { DYNAMIC_FLAG_SWITCH_7: r = 7; }
+
+#define DYNAMIC_FLAG_SWITCH_IMPL(N, KIND, NAME, FILE, LINE, DOC)	\
+	DYNAMIC_FLAG_SWITCH_IMPL_(N, KIND, NAME, FILE, LINE, DOC)
+
+#define DYNAMIC_FLAG_SWITCH_IMPL_(N, KIND, NAME, FILE, LINE, DOC)	\
+	({								\
+		DYNAMIC_FLAG_SWITCH_DECL_##N				\
+		unsigned int r = 0;					\
+									\
+		asm goto("1:\n\t"					\
+			 DYNAMIC_FLAG_SWITCH_FAST_PATH			\
+									\
+			 DYNAMIC_FLAG_STRINGS_SECTION			\
+			 "2: .asciz \"" #KIND ":" #NAME "@" FILE ":" #LINE "\"\n\t" \
+			 "5: .asciz \"" DOC "\"\n\t"			\
+			 ".popsection\n\t"				\
+									\
+			 ".pushsection .rodata\n\t"			\
+			 ".balign 4\n\t"				\
+			 "4:\n\t"					\
+			 DYNAMIC_FLAG_SWITCH_TABLE_##N			\
+			 ".popsection\n\t"				\
+									\
+			 ".pushsection dynamic_flag_list,\"a\",@progbits\n\t" \
+			 ".balign 4\n\t"				\
+			 "3:\n\t"					\
+			 ".long 1b - .\n\t"				\
+			 ".long 4b - .\n\t"				\
+			 ".long 2b - .\n\t"				\
+			 ".long 5b - .\n\t"				\
+			 ".byte " DYNAMIC_FLAG_STRINGIFY(DYNAMIC_FLAG_VALUE_INACTIVE) "\n\t" \
+			 ".byte 0\n\t"					\
+			 ".byte 1\n\t"					\
+			 ".byte " #N "\n\t"				\
+			 ".popsection\n\t"				\
+									\
+			 ".pushsection dynamic_flag_"#KIND"_list,\"a\",@progbits\n\t" \
+			 ".balign 4\n\t"				\
+			 ".long 3b - .\n\t"				\
+			 ".popsection"					\
+			 ::: DYNAMIC_FLAG_SWITCH_CLOBBER		\
+			 : DYNAMIC_FLAG_SWITCH_LABELS_##N);		\
+		/* Emulate Linux's `asm_volatile_goto`. */		\
+		asm("");						\
+									\
+		DYNAMIC_FLAG_SWITCH_CASES_##N				\
+		r;							\
+	})
+
+/*
+ * DF_CALL sites are compiler-emitted direct calls to a hidden
+ * per-(kind, name) trampoline, `dynamic_flag_call.KIND.NAME`, that
+ * consists of a `jmp rel32` to the current callee.  The trampoline,
+ * its patch record (type byte 2) and its kind list entry are emitted
+ * once per translation unit (`.ifndef`) in a COMDAT group, so the
+ * linker keeps one copy.  The record's destination is a second,
+ * never executed, copy of the original `jmp`, from which the library
+ * decodes the default callee: FN goes through an `X` operand, so
+ * that position-independent code may reach it through the PLT.
+ *
+ * The trampoline costs an extra direct jump compared to patching
+ * each call site, but lets the compiler allocate registers around
+ * an ordinary call.
+ */
+#define DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) "dynamic_flag_call." #KIND "." #NAME
+
+#define DYNAMIC_FLAG_CALL_IMPL(KIND, NAME, FILE, LINE, FN, ...)		\
+	DYNAMIC_FLAG_CALL_IMPL_(KIND, NAME, FILE, LINE, FN, ##__VA_ARGS__)
+
+#define DYNAMIC_FLAG_CALL_IMPL_(KIND, NAME, FILE, LINE, FN, ...)	\
+	({								\
+		extern __typeof__(FN) dynamic_flag_call_##KIND##_##NAME	\
+		    __asm__(DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME));	\
+									\
+		asm volatile(".ifndef " DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) "\n\t" \
+			 ".pushsection .text." DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) ",\"axG\",@progbits," DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) ",comdat\n\t" \
+			 ".balign 8\n\t"				\
+			 ".globl " DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) "\n\t" \
+			 ".hidden " DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) "\n\t" \
+			 ".type " DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) ",@function\n\t" \
+			 DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) ":\n\t"	\
+			 "jmp %P0\n\t"				\
+			 ".size " DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) ", 5\n\t" \
+			 "6: jmp %P0\n\t"				\
+			 ".popsection\n\t"				\
+									\
+			 DYNAMIC_FLAG_STRINGS_SECTION			\
+			 "2: .asciz \"" #KIND ":" #NAME "@" FILE ":" #LINE "\"\n\t" \
+			 "5: .asciz \"\"\n\t"				\
+			 ".popsection\n\t"				\
+									\
+			 ".pushsection dynamic_flag_list,\"aG\",@progbits," DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) ",comdat\n\t" \
+			 ".balign 4\n\t"				\
+			 "3:\n\t"					\
+			 ".long " DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) " - .\n\t" \
+			 ".long 6b - .\n\t"				\
+			 ".long 2b - .\n\t"				\
+			 ".long 5b - .\n\t"				\
+			 ".byte " DYNAMIC_FLAG_STRINGIFY(DYNAMIC_FLAG_VALUE_ACTIVE) "\n\t" \
+			 ".byte 0\n\t"					\
+			 ".byte 2\n\t"					\
+			 ".byte 0\n\t"					\
+			 ".popsection\n\t"				\
+									\
+			 ".pushsection dynamic_flag_"#KIND"_list,\"aG\",@progbits," DYNAMIC_FLAG_CALL_SYMBOL(KIND, NAME) ",comdat\n\t" \
+			 ".balign 4\n\t"				\
+			 ".long 3b - .\n\t"				\
+			 ".popsection\n\t"				\
+			 ".endif"					\
+			 :: "X"(FN));					\
+									\
+		dynamic_flag_call_##KIND##_##NAME(__VA_ARGS__);	\
+	})
+
+#define DYNAMIC_FLAG_STRINGIFY(X) DYNAMIC_FLAG_STRINGIFY_(X)
+#define DYNAMIC_FLAG_STRINGIFY_(X) #X
 #endif
 
 #define DYNAMIC_FLAG_IMPL(DEFAULT, INITIAL, FLIPPED, KIND, NAME, FILE, LINE, DOC) \
@@ -15,25 +15,34 @@
  * limitations under the License.
  */
 
-#include "dynamic_flag.h"
-
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
 
+#include "dynamic_flag.h"
+
 #include <assert.h>
 #include <dlfcn.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <link.h>
 #include <pthread.h>
 #include <regex.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <linux/membarrier.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
+#include <ucontext.h>
 #include <unistd.h>
 
 /* dummy stubs */
@@ -48,11 +57,15 @@ extern long long dynamic_flag_list_state_dummy(const char *regex,
  * Patch records are defined by inline assembly blocks in the
  * `dynamic_flag_list` section.
  *
- * There is also a pointer to each record in the kind-specific
+ * There is also a reference to each record in the kind-specific
  * `dynamic_flag_${KIND}_list` section.
  *
  * When a function with flags is inlined, each instantiation will have
  * its own record.
+ *
+ * Pointer fields are 32-bit offsets from the field's own address
+ * (see `relative_pointer`), so records don't need dynamic
+ * relocations; use the `record_*` accessors to decode them.
  */
 struct patch_record {
 	/*
@@ -63,20 +76,31 @@ struct patch_record {
 	 * byte is at the end of the instruction, so we have to scan
 	 * forward by one or two bytes.
 	 */
-	void *hook;
+	int32_t hook;
 
 	/*
 	 * The destination instruction when the hook instruction is a
-	 * `jmp` (for the asm goto implementation style), 0 otherwise.
+	 * `jmp` (for the asm goto implementation style), NULL otherwise.
+	 *
+	 * For DF_SWITCH records, this is instead the address of an
+	 * array of `cases - 1` relative offsets to the destinations for
+	 * cases 1 to `cases - 1`, and, for DF_CALL records, the default
+	 * callee.
+	 */
+	int32_t destination;
+
+	/*
+	 * The flag name as a C string, "KIND:NAME@FILE:LINE".  Names
+	 * live in a mergeable string section, so records for the same
+	 * flag (e.g., in an inline function) may share a name.
 	 */
-	void *destination;
+	int32_t name;
 
 	/*
-	 * The flag name as a C string, followed by a docstring; a
-	 * missing docstring is represented as an empty C string
-	 * (i.e., there's always a second NUL terminator).
+	 * The docstring; a missing docstring is represented as an
+	 * empty C string.
 	 */
-	const char *name_doc;
+	int32_t doc;
 
 	/*
 	 * The value to patch at the hook when the library is
@@ -94,8 +118,61 @@ struct patch_record {
 	 * enabled.
 	 */
 	uint8_t flipped;
-	uint8_t padding[6];
-} __attribute__((__packed__));
+
+	/* A `enum patch_record_type`. */
+	uint8_t type;
+
+	/* Number of cases for DF_SWITCH records, 0 otherwise. */
+	uint8_t cases;
+};
+
+enum patch_record_type {
+	/* Boolean flags, from DF_FEATURE, DF_OPT, etc. */
+	PATCH_RECORD_FLAG = 0,
+	/* N-way switches, from DF_SWITCH. */
+	PATCH_RECORD_SWITCH = 1,
+	/* Call trampolines, from DF_CALL. */
+	PATCH_RECORD_CALL = 2,
+};
+
+/**
+ * Decodes the 32-bit offset at `field`, relative to `field` itself;
+ * a null offset stands for NULL.
+ */
+static void *
+relative_pointer(const int32_t *field)
+{
+
+	return (*field == 0) ? NULL : (void *)((uintptr_t)field + *field);
+}
+
+static void *
+record_hook(const struct patch_record *record)
+{
+
+	return relative_pointer(&record->hook);
+}
+
+static void *
+record_destination(const struct patch_record *record)
+{
+
+	return relative_pointer(&record->destination);
+}
+
+static const char *
+record_name(const struct patch_record *record)
+{
+
+	return relative_pointer(&record->name);
+}
+
+static const char *
+record_doc(const struct patch_record *record)
+{
+
+	return relative_pointer(&record->doc);
+}
 
 /**
  * Internal metadata for each patch record: current activation and
@@ -103,13 +180,99 @@ struct patch_record {
  *
  * If `activation > 0`, the flag is enabled.  If `unhook > 0`, the
  * flag is unhooked and `activation` should not be incremented.
+ *
+ * For DF_SWITCH records, `activation` is the selected case instead.
+ * For DF_CALL records, it's 0 when the trampoline jumps to the
+ * default callee, and the address of the current callee otherwise.
  */
 struct patch_count {
-	/* If a hook is unhook, do not increment its activation count. */
+	/*
+	 * If a hook is unhook, do not increment its activation count.
+	 *
+	 * Flag activation counts may be updated with atomics outside
+	 * the patch lock, but only between positive values: counts only
+	 * cross zero with the patch lock held (see `activate_fast`).
+	 */
 	uint64_t activation;
 	uint64_t unhook;
+	/* The engaged kind that holds one activation, if any. */
+	struct kind_state *kind;
+	/* Deactivation grace period, if any. */
+	struct grace_policy *grace;
+	/*
+	 * Non-zero while the flag's count is zero but its code is still
+	 * active, until the grace period expires at `deadline`.
+	 */
+	uint64_t deadline;
+	/* Set when the record is in `linger.records`. */
+	bool lingering;
+	/*
+	 * Set when the record is in `txn.pending`: its machine code
+	 * may not match `activation` until the transaction commits.
+	 */
+	bool pending;
+};
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/**
+ * Deactivation grace period for the flags of a kind or of a group.
+ * When the count of such a flag drops to zero, its code stays active
+ * for `current` nanoseconds; reactivating the flag in the meantime
+ * doesn't patch anything.  Expired flags are deactivated by the next
+ * flag operation that takes the patch lock, or by
+ * `dynamic_flag_sweep`.
+ *
+ * With adaptive grace periods, `current` doubles (up to
+ * `adaptive_grace.max`) whenever the policy's flags are deactivated
+ * more than `adaptive_grace.threshold` times in a second, and halves
+ * back towards `base` once per calmer second, including seconds
+ * without any deactivation.
+ *
+ * Protected by the patch lock.
+ */
+struct grace_policy {
+	uint64_t base;
+	uint64_t current;
+	uint64_t window_start;
+	uint64_t window_flips;
+	/* The `linger.generation` of the last counted deactivation. */
+	uint64_t generation;
+};
+
+static struct {
+	/* Deactivations per second, or 0 to disable adaptation. */
+	uint64_t threshold;
+	uint64_t max;
+} adaptive_grace = { 0, 0 };
+
+/**
+ * Whole-kind activations (`dynamic_flag_activate_kind` with a NULL
+ * pattern) are also counted per kind.  While a kind is engaged (its
+ * count is positive), each of its flags holds a single activation for
+ * the kind and points back to the kind; repeated whole-kind
+ * activations and deactivations then only update the kind's count.
+ *
+ * Before unhooking a flag, or dropping its count to zero, we fold the
+ * kind's other activations into each flag's count and disengage the
+ * kind, so per-flag counts are what individual updates would yield.
+ *
+ * Kind states are never freed, and only pushed to `kinds` with the
+ * patch lock held.
+ */
+struct kind_state {
+	/* The "KIND:" prefix of the kind's flag names. */
+	const char *prefix;
+	size_t length;
+	/* The kind's records, in all modules. */
+	struct patch_list *records;
+	uint64_t count;
+	struct grace_policy grace;
+	struct kind_state *next;
 };
 
+static struct kind_state *kinds = NULL;
+
 /**
  * We store pointers to patch records that match a given criterion in
  * these patch lists.  There can never be more pointers than the total
@@ -118,6 +281,8 @@ struct patch_count {
 struct patch_list {
 	size_t size;
 	size_t capacity;
+	/* Whether `data` is already sorted by hook address. */
+	bool sorted;
 	const struct patch_record *data[];
 };
 
@@ -128,40 +293,451 @@ struct patch_list {
 static pthread_mutex_t patch_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * Hook records are in an array. For each hook record, count # of
- * activations and disable calls.
- *
- * This array is initialized on demand in `lock()`.
+ * A loaded object (the main executable or a shared object) with
+ * patch records in its `dynamic_flag_list` section.  For each hook
+ * record, `counts` holds the # of activations and disable calls.
+ */
+struct module {
+	const struct patch_record *start;
+	const struct patch_record *end;
+	/* The module's `dynamic_flag_init`, possibly empty. */
+	const int32_t *init_start;
+	const int32_t *init_end;
+	struct patch_count *counts;
+	/* Index of `start` among the records of all modules. */
+	size_t base;
+	/* Whether `dynamic_flag_sort` sorted the module's records. */
+	bool sorted;
+	/*
+	 * Page numbers of the module's lowest and highest hook, if all
+	 * pages in between are executable (and thus safe to bridge);
+	 * `text_first > text_last` otherwise.
+	 */
+	uintptr_t text_first;
+	uintptr_t text_last;
+};
+
+/**
+ * Modules are discovered with `dl_iterate_phdr` in `lock()`, the
+ * first time the library is used, and again when
+ * `dynamic_flag_poll_modules` notices that objects were loaded or
+ * unloaded since.  The table, and everything derived from it, only
+ * changes while no thread is between `modules_enter` and
+ * `modules_exit`, so code in between may look up the module of a
+ * record without the patch lock.
  */
 static struct {
-	struct patch_count *data;
+	/* Sorted by address. */
+	struct module *data;
 	size_t size;
-} counts = { NULL };
+	/* Total number of records, in all modules. */
+	size_t records;
+	/* `dlpi_adds` and `dlpi_subs` when we last looked for modules. */
+	unsigned long long adds;
+	unsigned long long subs;
+} modules = { NULL };
+
+/**
+ * Flag operations mark their thread as `reading` the modules from
+ * before they look up records until they're done with them (see
+ * `modules_enter`).  `dynamic_flag_poll_modules` holds `lock`, sets
+ * `pending` so that new operations wait for it, and waits for
+ * readers to drain before it updates `modules`.  Readers never write
+ * shared memory, so they don't contend with one another.
+ *
+ * Once the process is registered for `MEMBARRIER_CMD_PRIVATE_EXPEDITED`
+ * (`light` is then true), the poller's membarrier orders readers'
+ * `reading` stores before their `pending` loads, and readers only
+ * need a compiler barrier.
+ *
+ * `modules_depth` counts nested `modules_enter` calls on this thread
+ * (e.g., operations in a transaction), which only mark it once.
+ */
+static struct {
+	pthread_mutex_t lock;
+	bool pending;
+	bool light;
+} modules_poll = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static __thread size_t modules_depth = 0;
 
 extern const struct patch_record __start_dynamic_flag_list[], __stop_dynamic_flag_list[];
 
+/* "dfsorted", in little endian. */
+#define DYNAMIC_FLAG_SORTED_MAGIC 0x646574726f736664ULL
+
+/*
+ * `tools/dynamic_flag_sort` sets this marker to
+ * `DYNAMIC_FLAG_SORTED_MAGIC` after sorting `dynamic_flag_list` by
+ * hook address and all `dynamic_flag_*_list` sections by record
+ * address.  Lists of records built by walking these sections are then
+ * already sorted.
+ */
+static const volatile uint64_t sorted_marker
+    __attribute__((__section__("dynamic_flag_meta"), __used__)) = 0;
+
+/*
+ * Whether the records of all modules are sorted, cached at
+ * initialisation.  Modules don't overlap, so walking sorted modules
+ * in order yields records sorted by hook.
+ */
+static bool presorted = false;
+
+/*
+ * Records (in this library's module) whose hook must be patched at
+ * startup.  The section only exists if at least one flag needs it,
+ * hence the weak references.
+ */
+extern const int32_t __start_dynamic_flag_init[]
+    __attribute__((__weak__));
+extern const int32_t __stop_dynamic_flag_init[]
+    __attribute__((__weak__));
+
+/**
+ * Returns the module that holds `record`.
+ */
+static struct module *
+record_module(const struct patch_record *record)
+{
+	uintptr_t address = (uintptr_t)record;
+	size_t lo = 0, hi = modules.size;
+
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (address < (uintptr_t)modules.data[mid].start) {
+			hi = mid;
+		} else {
+			lo = mid;
+		}
+	}
+
+	assert(modules.size > 0 &&
+	    address < (uintptr_t)modules.data[lo].end &&
+	    "Record out of bounds?!");
+	return &modules.data[lo];
+}
+
+static struct patch_count *
+record_count(const struct patch_record *record)
+{
+	struct module *module = record_module(record);
+
+	return &module->counts[record - module->start];
+}
+
+/**
+ * Returns the index of `record` among the records of all modules.
+ */
+static size_t
+record_index(const struct patch_record *record)
+{
+	const struct module *module = record_module(record);
+
+	return module->base + (record - module->start);
+}
+
+/**
+ * A transaction holds `patch_lock` from `dynamic_flag_txn_begin` to
+ * the outermost `dynamic_flag_txn_commit`.  In the meantime,
+ * `lock()` and `unlock()` no-op on the owning thread, and records
+ * that cross zero are accumulated in `pending` instead of being
+ * patched immediately.
+ *
+ * `owner_depth` is thread-local: it's only non-zero on the thread
+ * that owns the transaction.  `pending` is protected by `patch_lock`.
+ */
+static __thread size_t txn_owner_depth = 0;
+static struct {
+	struct patch_list *pending;
+} txn = { NULL };
+
+/**
+ * Sequence lock for `counts`: odd while a flag operation holds the
+ * patch lock (in a transaction, while the owner runs an operation),
+ * so readers can snapshot counts without taking the lock.
+ *
+ * Lock-free updates between positive activation counts (see
+ * `activate_fast` and `kind_activate_fast`) never change which flags
+ * are active, and bypass the sequence: snapshots may see them or not.
+ * They're counted in each thread's `fast_updates` instead.
+ */
+static uint64_t counts_seq = 0;
+
+/**
+ * State of each thread that called into the library, registered in
+ * `threads` on its first flag operation.
+ *
+ * Each thread counts its lock-free count updates in its own
+ * `fast_updates`, so that they don't contend on a shared cache line.
+ * `dynamic_flag_generation` adds up the counters of all registered
+ * threads, and `retired`, the total of threads that exited.  The
+ * pattern cache's `cache_hits` and `cache_misses` work the same way.
+ *
+ * `reading` is true between `modules_enter` and `modules_exit`.
+ *
+ * `list` and the `retired*` totals are protected by `lock`.
+ */
+struct thread_state {
+	uint64_t fast_updates;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	/* Pattern cache entry this thread is reading, if any. */
+	const struct pattern_cache_entry *cache_entry;
+	bool reading;
+	bool registered;
+	struct thread_state *next;
+};
+
+static __thread struct thread_state thread_state;
+static struct {
+	pthread_mutex_t lock;
+	pthread_once_t once;
+	pthread_key_t key;
+	struct thread_state *list;
+	uint64_t retired;
+	uint64_t retired_hits;
+	uint64_t retired_misses;
+} threads = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT,
+};
+
+/**
+ * Flags that are still patched in their grace period.  `records` may
+ * also hold records that were reactivated since (with a zero
+ * `deadline`); `expired` is scratch space for `linger_sweep`.
+ *
+ * Protected by `patch_lock`.
+ */
+static struct {
+	struct patch_list *records;
+	struct patch_list *expired;
+	/* UINT64_MAX if nothing may expire. */
+	uint64_t next_deadline;
+	/* Incremented by each call to `deactivate_locked`. */
+	uint64_t generation;
+} linger = { NULL, NULL, UINT64_MAX, 0 };
+
 /**
  * If true (non-zero), we try to avoid no-op stores (and hopefully
  * reduce copy-on-write traffic).
  */
 static int minimal_write_mode = 0;
 
+/**
+ * If true (non-zero), `amortize` issues a core-serialising
+ * membarrier after patching a batch of records, so that every thread
+ * executes the new code before the flag operation returns.
+ *
+ * Only set once the process is registered for
+ * `MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE`.
+ */
+static int sync_core_mode = 0;
+
+/**
+ * Maximum number of untouched pages between two hooks that `amortize`
+ * patches in the same window.  An mprotect pair costs about as much
+ * as changing the protection of 64 pages, so that's the break-even
+ * point.
+ */
+static size_t coalesce_gap = 64;
+
+/**
+ * Bitset of the membarrier commands the process is registered for:
+ * `MEMBARRIER_CMD_PRIVATE_EXPEDITED` and/or
+ * `MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE`.  Protected by
+ * `patch_lock`.
+ */
+static int membarrier_registered = 0;
+
+/**
+ * A patch backend implements the actual writes to machine code.
+ *
+ * `amortize` calls `open` on a page-aligned range before writing to
+ * hook instructions in that range with `write`, and `close` once
+ * it's done with that range.  Writes may be buffered until `flush`
+ * or `close`.  `open`, `flush` and `close` return 0 on success, -1
+ * on failure.
+ */
+struct patch_backend {
+	const char *name;
+	int (*open)(void *begin, size_t size);
+	void (*write)(volatile uint8_t *dst, uint8_t value);
+	int (*flush)(void);
+	int (*close)(void *begin, size_t size);
+};
+
+static const struct patch_backend mprotect_backend;
+
+/**
+ * The current patch backend.  Protected by `patch_lock`.
+ *
+ * `lock()` probes for a backend that works when it initialises the
+ * library.
+ */
+static const struct patch_backend *backend = &mprotect_backend;
+
+/**
+ * The alias backend remaps the text pages that contain hook
+ * instructions to a shared memory file, and writes through a second,
+ * writable, mapping of the same file.  The text pages are always
+ * read-only and executable.
+ *
+ * `text` is the page-aligned range of hook pages, and `alias` the
+ * writable view of `text`, or NULL if the alias mapping hasn't been
+ * set up yet.  Protected by `patch_lock`.
+ */
+static struct {
+	uint8_t *text;
+	uint8_t *alias;
+	size_t size;
+} alias_map = { NULL };
+
+/**
+ * The proc_mem backend writes to hook instructions with `pwrite` on
+ * `/proc/self/mem`, which doesn't need write permissions on the
+ * pages.  It buffers all writes to the same page, and flushes them
+ * with one `pwrite` for the dirty span `[lo, hi)` when the next
+ * write hits a different page, or when the range is closed.
+ *
+ * `fd` is -1 until the backend is initialised.  `error` is set when
+ * a `pwrite` fails, and reset when a range is opened.  Protected by
+ * `patch_lock`.
+ */
+static struct {
+	int fd;
+	int error;
+	uintptr_t page;
+	size_t lo;
+	size_t hi;
+	uint8_t *buf;
+} proc_mem = { .fd = -1 };
+
+static void detect_backend(void);
+static void poke_init(void);
+static void modules_init(void);
+static void modules_enter(void);
+static void modules_exit(void);
+static void text_span_init(void);
+static bool text_span_covers(uintptr_t first, uintptr_t last);
+static void names_init(void);
+static size_t names_lower_bound(const char *prefix, size_t length);
+static size_t names_prefix_end(size_t begin, const char *prefix,
+    size_t length);
+static int cmp_patches(const void *x, const void *y);
 static void init_all(void);
 
 /**
- * Returns a new patch list that's correctly sized for the patch
- * records the library is aware of.
+ * Regex operations that modules loaded later should see.
+ */
+enum rule_op {
+	RULE_ACTIVATE,
+	RULE_DEACTIVATE,
+	RULE_UNHOOK,
+	RULE_REHOOK,
+};
+
+/* The target of an operation to log: see `rules_push`. */
+struct rule_log {
+	const char *kind;
+	const char *pattern;
+};
+
+static void rules_push(enum rule_op op, uint64_t n, const char *kind,
+    const char *pattern);
+static void rules_note(bool up, const char *kind, const char *pattern);
+
+/**
+ * Each thread keeps a few full-sized patch lists around, so flag
+ * operations (which need at most three lists at once) only allocate
+ * the first time a thread calls into the library.  A thread-specific
+ * key frees cached lists when the thread exits.
  */
+#define PATCH_LIST_CACHE_SIZE 4
+
+static __thread struct {
+	struct patch_list *lists[PATCH_LIST_CACHE_SIZE];
+	size_t count;
+	bool registered;
+} patch_list_cache;
+
+static pthread_key_t patch_list_cache_key;
+static pthread_once_t patch_list_cache_once = PTHREAD_ONCE_INIT;
+
+static void
+patch_list_cache_release(void *arg)
+{
+
+	(void)arg;
+	for (size_t i = 0; i < patch_list_cache.count; i++) {
+		free(patch_list_cache.lists[i]);
+	}
+
+	patch_list_cache.count = 0;
+	return;
+}
+
+static void
+patch_list_cache_init(void)
+{
+	int r;
+
+	r = pthread_key_create(&patch_list_cache_key, patch_list_cache_release);
+	assert(r == 0);
+	return;
+}
+
 static struct patch_list *
-patch_list_create(void)
+patch_list_create_capacity(size_t capacity)
 {
 	struct patch_list *list;
 
-	assert(counts.size > 0 && "Must initialize dynamic_flag first");
-	list = calloc(1, sizeof(*list) + counts.size * sizeof(list->data[0]));
+	list = calloc(1, sizeof(*list) + capacity * sizeof(list->data[0]));
 	assert(list != NULL);
 	list->size = 0;
-	list->capacity = counts.size;
+	list->capacity = capacity;
+	return list;
+}
+
+/**
+ * Returns a patch list that's correctly sized for the patch records
+ * the library is aware of.
+ */
+static struct patch_list *
+patch_list_create(void)
+{
+	struct patch_list *list;
+
+	assert(modules.records > 0 && "Must initialize dynamic_flag first");
+	if (patch_list_cache.count == 0) {
+		return patch_list_create_capacity(modules.records);
+	}
+
+	list = patch_list_cache.lists[--patch_list_cache.count];
+	/* Cached before modules were loaded or unloaded. */
+	if (list->capacity != modules.records) {
+		free(list);
+		return patch_list_create_capacity(modules.records);
+	}
+
+	list->size = 0;
+	list->sorted = false;
+	return list;
+}
+
+/**
+ * Reallocates `list` for the current number of records.  `list` must
+ * not hold more records than that.
+ */
+static struct patch_list *
+patch_list_refit(struct patch_list *list)
+{
+
+	assert(list->size <= modules.records);
+	list = realloc(list,
+	    sizeof(*list) + modules.records * sizeof(list->data[0]));
+	assert(list != NULL);
+	list->capacity = modules.records;
 	return list;
 }
 
@@ -173,7 +749,20 @@ patch_list_destroy(struct patch_list *list)
 		return;
 	}
 
-	free(list);
+	if (list->capacity != modules.records ||
+	    patch_list_cache.count >= PATCH_LIST_CACHE_SIZE) {
+		free(list);
+		return;
+	}
+
+	if (patch_list_cache.registered == false) {
+		/* Make sure the cache is released when the thread exits. */
+		pthread_once(&patch_list_cache_once, patch_list_cache_init);
+		pthread_setspecific(patch_list_cache_key, &patch_list_cache);
+		patch_list_cache.registered = true;
+	}
+
+	patch_list_cache.lists[patch_list_cache.count++] = list;
 	return;
 }
 
@@ -187,611 +776,5761 @@ patch_list_push(struct patch_list *list, const struct patch_record *record)
 }
 
 /**
- * Acquires the patch lock.  Initialises the `patch_count` array if
- * necessary and the initial hook states.
+ * A slot in the name index's open-addressing hash table: a full flag
+ * name (`kind:name@file:line`) or a `kind:name` prefix, and the range
+ * of records with that name in `names.by_name`.  Empty slots have a
+ * NULL `key`.
  */
-static void
-lock(void)
-{
-	int mutex_ret;
-
-	mutex_ret = pthread_mutex_lock(&patch_lock);
-	assert(mutex_ret == 0);
+struct name_slot {
+	uint64_t hash;
+	const char *key;
+	size_t length;
+	size_t begin;
+	size_t end;
+};
 
-	if (__builtin_expect((counts.data == NULL), 0)) {
-		size_t n = __stop_dynamic_flag_list - __start_dynamic_flag_list;
+/**
+ * The name index is built at initialisation, and rebuilt by
+ * `modules_reindex` when `dynamic_flag_poll_modules` finds modules
+ * were loaded or unloaded.  Rebuilds only happen while no flag
+ * operation is between `modules_enter` and `modules_exit`, so
+ * operations see an immutable index and only need to check that
+ * `ready` is set.
+ */
+static struct {
+	/* All records, sorted by name with strcmp. */
+	const struct patch_record **by_name;
+	/*
+	 * For each index `i` that starts a run of identical names in
+	 * `by_name`, the end of that run.
+	 */
+	size_t *run_end;
+	struct name_slot *slots;
+	/* Power of two. */
+	size_t capacity;
+	bool ready;
+} names;
 
-		counts.data = calloc(n, sizeof(*counts.data));
-		counts.size = n;
-		assert(counts.data != NULL);
-		init_all();
-	}
+/* Marks the start of an update to `counts`, under the patch lock. */
+static void
+counts_write_begin(void)
+{
 
+	__atomic_store_n(&counts_seq, counts_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
 	return;
 }
 
+/* Marks the end of an update to `counts`, under the patch lock. */
 static void
-unlock(void)
+counts_write_end(void)
 {
-	int mutex_ret;
-
-	mutex_ret = pthread_mutex_unlock(&patch_lock);
-	assert(mutex_ret == 0);
 
+	__atomic_store_n(&counts_seq, counts_seq + 1, __ATOMIC_RELEASE);
 	return;
 }
 
-/* Make sure there's at least one hook point. */
-__attribute__((__used__)) static void
-dummy(void)
+/**
+ * Returns the sequence number to pass to `counts_read_retry` after
+ * reading counts.
+ */
+static uint64_t
+counts_read_begin(void)
 {
+	uint64_t seq;
 
-	DYNAMIC_FLAG_DUMMY(none,
-	    "This dummy flag does nothing. It lets the dynamic_flag library "
-	    "compile even when no other flag is defined.");
-	return;
+	while ((seq = __atomic_load_n(&counts_seq, __ATOMIC_ACQUIRE)) & 1) {
+		sched_yield();
+	}
+
+	return seq;
 }
 
 /**
- * Ensures `*dst == value` on exit.  If `minimal_write_mode != 0`,
- * only writes when necessary (when `*dst != value` on entry).
- *
- * We use a pointer to volatile for `dst` to clearly foil fancy
- * optimisations where the compiler might decide to assign
- * `*dst = value` unconditionally.
+ * Returns true if counts may have changed since `counts_read_begin`
+ * returned `seq`.
  */
-static void
-update_byte(volatile uint8_t *dst, uint8_t value)
+static bool
+counts_read_retry(uint64_t seq)
+{
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&counts_seq, __ATOMIC_RELAXED) != seq;
+}
+
+static void
+thread_state_release(void *arg)
+{
+	struct thread_state *self = arg;
+	struct thread_state **link;
+
+	pthread_mutex_lock(&threads.lock);
+	for (link = &threads.list; *link != self; link = &(*link)->next) {
+		continue;
+	}
+
+	*link = self->next;
+	threads.retired += self->fast_updates;
+	threads.retired_hits += self->cache_hits;
+	threads.retired_misses += self->cache_misses;
+	pthread_mutex_unlock(&threads.lock);
+	return;
+}
+
+static void
+threads_init(void)
+{
+	int r;
+
+	r = pthread_key_create(&threads.key, thread_state_release);
+	assert(r == 0);
+	return;
+}
+
+static __attribute__((__noinline__)) void
+thread_state_register(void)
+{
+
+	pthread_once(&threads.once, threads_init);
+	pthread_setspecific(threads.key, &thread_state);
+	pthread_mutex_lock(&threads.lock);
+	thread_state.next = threads.list;
+	threads.list = &thread_state;
+	thread_state.registered = true;
+	pthread_mutex_unlock(&threads.lock);
+	return;
+}
+
+/**
+ * Counts a lock-free count update, once it's visible.
+ *
+ * Must be called between `modules_enter` and `modules_exit`.
+ */
+static void
+fast_updates_note(void)
+{
+
+	assert(thread_state.registered);
+	__atomic_store_n(&thread_state.fast_updates,
+	    thread_state.fast_updates + 1, __ATOMIC_RELEASE);
+	return;
+}
+
+/**
+ * Acquires the patch lock.  Initialises the `patch_count` array if
+ * necessary and the initial hook states.
+ */
+static void
+lock(void)
+{
+	int mutex_ret;
+
+	if (txn_owner_depth > 0) {
+		counts_write_begin();
+		return;
+	}
+
+	mutex_ret = pthread_mutex_lock(&patch_lock);
+	assert(mutex_ret == 0);
+	counts_write_begin();
+
+	if (__builtin_expect((modules.data == NULL), 0)) {
+		modules_init();
+		detect_backend();
+		text_span_init();
+		names_init();
+		poke_init();
+		init_all();
+	}
+
+	return;
+}
+
+static void
+unlock(void)
+{
+	int mutex_ret;
+
+	counts_write_end();
+	if (txn_owner_depth > 0) {
+		return;
+	}
+
+	mutex_ret = pthread_mutex_unlock(&patch_lock);
+	assert(mutex_ret == 0);
+
+	return;
+}
+
+/* Make sure there's at least one hook point. */
+__attribute__((__used__)) static void
+dummy(void)
+{
+
+	DYNAMIC_FLAG_DUMMY(none,
+	    "This dummy flag does nothing. It lets the dynamic_flag library "
+	    "compile even when no other flag is defined.");
+	return;
+}
+
+static int
+mprotect_backend_open(void *begin, size_t size)
+{
+
+	return mprotect(begin, size, PROT_READ | PROT_WRITE | PROT_EXEC);
+}
+
+static void
+mprotect_backend_write(volatile uint8_t *dst, uint8_t value)
+{
+
+	*dst = value;
+	return;
+}
+
+static int
+mprotect_backend_close(void *begin, size_t size)
+{
+
+	return mprotect(begin, size, PROT_READ | PROT_EXEC);
+}
+
+static int
+backend_flush_nop(void)
+{
+
+	return 0;
+}
+
+static const struct patch_backend mprotect_backend = {
+	.name = "mprotect",
+	.open = mprotect_backend_open,
+	.write = mprotect_backend_write,
+	.flush = backend_flush_nop,
+	.close = mprotect_backend_close,
+};
+
+static int
+alias_backend_nop(void *begin, size_t size)
+{
+
+	(void)begin;
+	(void)size;
+	return 0;
+}
+
+static void
+alias_backend_write(volatile uint8_t *dst, uint8_t value)
+{
+	size_t offset = (const uint8_t *)dst - alias_map.text;
+
+	assert(offset < alias_map.size && "Hook outside the alias mapping?!");
+	((volatile uint8_t *)alias_map.alias)[offset] = value;
+	return;
+}
+
+static const struct patch_backend alias_backend = {
+	.name = "alias",
+	.open = alias_backend_nop,
+	.write = alias_backend_write,
+	.flush = backend_flush_nop,
+	.close = alias_backend_nop,
+};
+
+static void
+proc_mem_flush(void)
+{
+	uintptr_t page = proc_mem.page;
+
+	proc_mem.page = 0;
+	if (page == 0 || proc_mem.lo >= proc_mem.hi) {
+		return;
+	}
+
+	for (size_t lo = proc_mem.lo; lo < proc_mem.hi; ) {
+		ssize_t r;
+
+		r = pwrite(proc_mem.fd, proc_mem.buf + lo, proc_mem.hi - lo,
+		    (off_t)(page + lo));
+		if (r <= 0) {
+			proc_mem.error = -1;
+			return;
+		}
+
+		lo += r;
+	}
+
+	return;
+}
+
+static int
+proc_mem_backend_open(void *begin, size_t size)
+{
+
+	(void)begin;
+	(void)size;
+	proc_mem.error = 0;
+	return 0;
+}
+
+static void
+proc_mem_backend_write(volatile uint8_t *dst, uint8_t value)
+{
+	uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t page = (uintptr_t)dst & -page_size;
+	size_t offset = (uintptr_t)dst - page;
+
+	if (page != proc_mem.page) {
+		proc_mem_flush();
+		/* Text pages are readable: start from their current contents. */
+		memcpy(proc_mem.buf, (const void *)page, page_size);
+		proc_mem.page = page;
+		proc_mem.lo = page_size;
+		proc_mem.hi = 0;
+	}
+
+	proc_mem.buf[offset] = value;
+	if (offset < proc_mem.lo) {
+		proc_mem.lo = offset;
+	}
+
+	if (offset + 1 > proc_mem.hi) {
+		proc_mem.hi = offset + 1;
+	}
+
+	return;
+}
+
+static int
+proc_mem_backend_flush(void)
+{
+
+	proc_mem_flush();
+	return proc_mem.error;
+}
+
+static int
+proc_mem_backend_close(void *begin, size_t size)
+{
+
+	(void)begin;
+	(void)size;
+	return proc_mem_backend_flush();
+}
+
+static const struct patch_backend proc_mem_backend = {
+	.name = "proc_mem",
+	.open = proc_mem_backend_open,
+	.write = proc_mem_backend_write,
+	.flush = proc_mem_backend_flush,
+	.close = proc_mem_backend_close,
+};
+
+static int
+none_backend_fail(void *begin, size_t size)
+{
+
+	(void)begin;
+	(void)size;
+	return -1;
+}
+
+static int
+none_backend_flush(void)
+{
+
+	return -1;
+}
+
+static void
+none_backend_write(volatile uint8_t *dst, uint8_t value)
+{
+
+	(void)dst;
+	(void)value;
+	assert(0 && "The none backend can't open a range for writes.");
+	return;
+}
+
+/**
+ * The none backend is what we're left with when no other backend
+ * works: every attempt to patch code fails.
+ */
+static const struct patch_backend none_backend = {
+	.name = "none",
+	.open = none_backend_fail,
+	.write = none_backend_write,
+	.flush = none_backend_flush,
+	.close = none_backend_fail,
+};
+
+/**
+ * Registers the process for membarrier command `cmd`, with the
+ * corresponding `register_cmd`.
+ *
+ * Must be called with the patch lock held.
+ */
+static int
+register_membarrier(int cmd, int register_cmd)
+{
+
+	if ((membarrier_registered & cmd) != 0) {
+		return 0;
+	}
+
+	if (syscall(__NR_membarrier, register_cmd, 0, 0) != 0) {
+		return -1;
+	}
+
+	membarrier_registered |= cmd;
+	return 0;
+}
+
+/**
+ * Forces every other thread through a core-serialising instruction,
+ * with the strongest membarrier command we're registered for.  The
+ * interrupt return on the `MEMBARRIER_CMD_PRIVATE_EXPEDITED` path is
+ * serialising on x86, but `_SYNC_CORE` also covers threads that are
+ * not currently running.
+ *
+ * No-ops if we're not registered for any membarrier command.
+ */
+static void
+sync_cores(void)
+{
+
+	if ((membarrier_registered &
+	    MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE) != 0) {
+		syscall(__NR_membarrier,
+		    MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0);
+	} else if ((membarrier_registered &
+	    MEMBARRIER_CMD_PRIVATE_EXPEDITED) != 0) {
+		syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+	}
+
+	return;
+}
+
+#if DYNAMIC_FLAG_IMPLEMENTATION_STYLE < 3
+/**
+ * Ensures `*dst == value` on exit.  If `minimal_write_mode != 0`,
+ * only writes when necessary (when `*dst != value` on entry).
+ *
+ * We use a pointer to volatile for `dst` to clearly foil fancy
+ * optimisations where the compiler might decide to assign
+ * `*dst = value` unconditionally.
+ */
+static void
+update_byte(volatile uint8_t *dst, uint8_t value)
 {
 	if (minimal_write_mode != 0 && *dst == value)
 		return;
 
-	*dst = value;
+	backend->write(dst, value);
+	return;
+}
+#endif
+
+#if DYNAMIC_FLAG_IMPLEMENTATION_STYLE >= 2
+#define POKE_SIZE 5  /* jmp rel32 and the instructions it replaces. */
+
+/**
+ * A staged rewrite of the hook instruction at `hook` to `bytes`.
+ */
+struct poke {
+	uint8_t *hook;
+	uint8_t bytes[POKE_SIZE];
+};
+
+/**
+ * We can't atomically rewrite a 5-byte instruction, so multi-byte
+ * updates (all flips with the NOP implementation, and DF_SWITCH
+ * retargeting) are staged in `pokes.data`, sorted by hook address,
+ * and `amortize` applies them with `poke_commit` before closing each
+ * range.
+ *
+ * `live` is the number of staged pokes the SIGTRAP handler may
+ * consult: non-zero while `poke_commit` has `int3` instructions in
+ * flight.  `handlers` counts SIGTRAP handlers that may be looking at
+ * `data` or `hooks`; like the kernel's `text_poke_bp`, we wait for it
+ * to drop to zero before reusing either.  `hooks` is the sorted set
+ * of all hook addresses, so that a late handler can tell a retired
+ * `int3` of ours from someone else's.  Everything else is protected
+ * by `patch_lock`.
+ *
+ * The SIGTRAP handler is only installed (and the process registered
+ * for membarriers) when we first commit pokes: programs that never
+ * need multi-byte updates don't have to give up SIGTRAP.
+ */
+struct poke_hooks {
+	size_t size;
+	const uint8_t *data[];
+};
+
+static struct {
+	struct poke *data;
+	size_t size;
+	size_t capacity;
+	size_t live;
+	size_t handlers;
+	struct poke_hooks *hooks;
+	bool installed;
+	struct sigaction old_action;
+} pokes = { NULL };
+
+static void
+stage_poke(uint8_t *hook, const uint8_t bytes[POKE_SIZE])
+{
+	struct poke *poke;
+
+	/* Never put an identical instruction through the int3 dance. */
+	if (memcmp(hook, bytes, POKE_SIZE) == 0) {
+		return;
+	}
+
+	assert(pokes.size < pokes.capacity);
+	assert((pokes.size == 0 || pokes.data[pokes.size - 1].hook < hook) &&
+	    "Pokes must be staged in address order.");
+	poke = &pokes.data[pokes.size++];
+	poke->hook = hook;
+	memcpy(poke->bytes, bytes, POKE_SIZE);
+	return;
+}
+
+/**
+ * Returns the live poke for `hook`, or NULL if there is none.
+ *
+ * Async-signal-safe.
+ */
+static const struct poke *
+find_live_poke(const uint8_t *hook)
+{
+	/* Sequentially consistent with `poke_drain`, see `poke_trap`. */
+	size_t n = __atomic_load_n(&pokes.live, __ATOMIC_SEQ_CST);
+	size_t lo = 0;
+
+	while (n > 0) {
+		size_t half = n / 2;
+		const struct poke *mid = &pokes.data[lo + half];
+
+		if (mid->hook == hook) {
+			return mid;
+		}
+
+		if (mid->hook < hook) {
+			lo += half + 1;
+			n -= half + 1;
+		} else {
+			n = half;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns whether `hook` is the hook instruction of a record.
+ *
+ * Async-signal-safe.
+ */
+static bool
+is_known_hook(const uint8_t *hook)
+{
+	const struct poke_hooks *hooks =
+	    __atomic_load_n(&pokes.hooks, __ATOMIC_SEQ_CST);
+	size_t lo = 0, n;
+
+	if (hooks == NULL) {
+		return false;
+	}
+
+	n = hooks->size;
+	while (n > 0) {
+		size_t half = n / 2;
+		const uint8_t *mid = hooks->data[lo + half];
+
+		if (mid == hook) {
+			return true;
+		}
+
+		if (mid < hook) {
+			lo += half + 1;
+			n -= half + 1;
+		} else {
+			n = half;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Handles a thread that hit the `int3` at `hook`: redirects it to
+ * where the new instruction would take it if `poke_commit` has a poke
+ * in flight there, or re-executes the instruction if the `int3` was
+ * one of ours and is already gone.
+ *
+ * Returns false if the breakpoint isn't ours.  Async-signal-safe.
+ */
+static bool
+poke_trap(ucontext_t *ctx, uint8_t *hook)
+{
+	bool handled = false;
+
+	/*
+	 * Register before looking at `pokes`: `poke_drain` either sees
+	 * us, or we see the state it published before draining.
+	 */
+	__atomic_add_fetch(&pokes.handlers, 1, __ATOMIC_SEQ_CST);
+
+	/*
+	 * Try twice: a new batch may have published its pokes
+	 * between our lookup and the check for a stale `int3`.
+	 */
+	for (size_t attempt = 0; attempt < 2; attempt++) {
+		const struct poke *poke = find_live_poke(hook);
+
+		if (poke != NULL) {
+			uint8_t *next = hook + POKE_SIZE;
+
+			if (poke->bytes[0] == 0xe9) {
+				int32_t rel;
+
+				memcpy(&rel, &poke->bytes[1], sizeof(rel));
+				next += rel;
+			}
+
+			ctx->uc_mcontext.gregs[REG_RIP] = (greg_t)next;
+			handled = true;
+			break;
+		}
+
+		if (!is_known_hook(hook)) {
+			break;
+		}
+
+		if (*(volatile uint8_t *)hook != 0xcc) {
+			ctx->uc_mcontext.gregs[REG_RIP] = (greg_t)hook;
+			handled = true;
+			break;
+		}
+	}
+
+	__atomic_sub_fetch(&pokes.handlers, 1, __ATOMIC_RELEASE);
+	return handled;
+}
+
+/**
+ * Handles the `int3` traps of `poke_commit` with `poke_trap`, and
+ * chains to the previous handler for all other SIGTRAPs (someone
+ * else's breakpoints, `raise`, `kill`, single-stepping, ...), without
+ * touching their context.
+ */
+static void
+poke_trap_handler(int signo, siginfo_t *info, void *vctx)
+{
+	ucontext_t *ctx = vctx;
+	uint8_t *hook = (uint8_t *)ctx->uc_mcontext.gregs[REG_RIP] - 1;
+	const struct sigaction *old = &pokes.old_action;
+
+	/* The kernel reports `int3` traps as SI_KERNEL. */
+	if (info->si_code == SI_KERNEL && poke_trap(ctx, hook)) {
+		return;
+	}
+
+	if ((old->sa_flags & SA_SIGINFO) != 0) {
+		old->sa_sigaction(signo, info, vctx);
+	} else if (old->sa_handler == SIG_DFL) {
+		signal(signo, SIG_DFL);
+		raise(signo);
+	} else if (old->sa_handler != SIG_IGN) {
+		old->sa_handler(signo);
+	}
+
+	return;
+}
+
+/**
+ * Waits until no SIGTRAP handler may be looking at the pokes or hooks
+ * that were published before the call.
+ */
+static void
+poke_drain(void)
+{
+
+	while (__atomic_load_n(&pokes.handlers, __ATOMIC_SEQ_CST) != 0) {
+		sched_yield();
+	}
+
+	return;
+}
+
+static int
+cmp_hooks(const void *x, const void *y)
+{
+	const uint8_t *const *a = x;
+	const uint8_t *const *b = y;
+
+	if (*a == *b) {
+		return 0;
+	}
+
+	return (*a < *b) ? -1 : 1;
+}
+
+/**
+ * Allocates the poke staging area, and publishes the set of hooks,
+ * for the current modules.
+ *
+ * Must be called with the patch lock held, and no poke staged.
+ */
+static void
+poke_init(void)
+{
+	struct poke_hooks *hooks, *old;
+
+	hooks = malloc(sizeof(*hooks) +
+	    modules.records * sizeof(hooks->data[0]));
+	assert(hooks != NULL);
+	hooks->size = 0;
+	for (size_t i = 0; i < modules.size; i++) {
+		const struct module *module = &modules.data[i];
+
+		for (const struct patch_record *record = module->start;
+		     record < module->end; record++) {
+			hooks->data[hooks->size++] = record_hook(record);
+		}
+	}
+
+	qsort(hooks->data, hooks->size, sizeof(hooks->data[0]), cmp_hooks);
+	old = pokes.hooks;
+	__atomic_store_n(&pokes.hooks, hooks, __ATOMIC_SEQ_CST);
+	poke_drain();
+	free(old);
+
+	/* `poke_commit` drained the handlers that could see `data`. */
+	free(pokes.data);
+	pokes.capacity = modules.records;
+	pokes.data = calloc(pokes.capacity, sizeof(*pokes.data));
+	assert(pokes.data != NULL);
+	return;
+}
+
+/**
+ * Installs the SIGTRAP handler, and registers for the strongest
+ * membarrier the kernel supports.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+poke_install(void)
+{
+	struct sigaction action = {
+		.sa_sigaction = poke_trap_handler,
+		.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER,
+	};
+	int r;
+
+	if (pokes.installed) {
+		return;
+	}
+
+	sigemptyset(&action.sa_mask);
+	r = sigaction(SIGTRAP, &action, &pokes.old_action);
+	assert(r == 0 && "Failed to install SIGTRAP handler.");
+	(void)r;
+
+	if (register_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE,
+	    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE) != 0) {
+		register_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED,
+		    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED);
+	}
+
+	pokes.installed = true;
+	return;
+}
+
+/**
+ * Applies staged pokes with a text_poke_bp-style protocol: publish
+ * the pokes to the SIGTRAP handler, write `int3` over each first
+ * byte, sync cores, write the tail bytes, sync cores, write the new
+ * first bytes, sync cores, and retire the pokes.
+ *
+ * Must be called with the patch lock held, and with all staged
+ * hooks in a range opened with the current backend.
+ */
+static int
+poke_commit(void)
+{
+	int r = 0;
+
+	if (pokes.size == 0) {
+		return 0;
+	}
+
+	poke_install();
+	__atomic_store_n(&pokes.live, pokes.size, __ATOMIC_RELEASE);
+	for (size_t i = 0; i < pokes.size; i++) {
+		backend->write(pokes.data[i].hook, 0xcc);
+	}
+
+	r |= backend->flush();
+	sync_cores();
+
+	for (size_t i = 0; i < pokes.size; i++) {
+		for (size_t j = 1; j < POKE_SIZE; j++) {
+			backend->write(pokes.data[i].hook + j,
+			    pokes.data[i].bytes[j]);
+		}
+	}
+
+	r |= backend->flush();
+	sync_cores();
+
+	for (size_t i = 0; i < pokes.size; i++) {
+		backend->write(pokes.data[i].hook, pokes.data[i].bytes[0]);
+	}
+
+	r |= backend->flush();
+	sync_cores();
+
+	/* Late handlers may still read `data`: drain before reusing it. */
+	__atomic_store_n(&pokes.live, 0, __ATOMIC_SEQ_CST);
+	poke_drain();
+	pokes.size = 0;
+	return (r == 0) ? 0 : -1;
+}
+#endif
+
+#if DYNAMIC_FLAG_IMPLEMENTATION_STYLE == 1
+#define HOOK_SIZE 3 /* REX byte + mov imm8 */
+
+/**
+ * Returns the address of the `MOV` instruction's immediate field.
+ */
+static uint8_t *
+hook_field(const struct patch_record *record)
+{
+	uint8_t *address = record_hook(record);
+	/* +1 to get the immediate field after the MOV opcode. */
+	uint8_t *field = address + 1;
+
+	/*
+	 * F4 is HLT, 0x0 is ADD [AL], AL.  Neither is a MOV opcode.
+	 * Any mismatch must mean we have a 3-byte REX MOV, and we
+	 * have to go forward one more byte.
+	 */
+	if (field[0] != DYNAMIC_FLAG_VALUE_ACTIVE &&
+	    field[0] != DYNAMIC_FLAG_VALUE_INACTIVE) {
+		field++;
+	}
+
+	assert((field[0] == DYNAMIC_FLAG_VALUE_ACTIVE) ||
+	    (field[0] == DYNAMIC_FLAG_VALUE_INACTIVE));
+	return field;
+}
+
+/**
+ * Switches to the flag's slow path by updating a non-zero value in
+ * the `MOV` instruction's immediate field.
+ */
+static __attribute__((noinline)) void
+patch(const struct patch_record *record)
+{
+
+	update_byte(hook_field(record), DYNAMIC_FLAG_VALUE_ACTIVE);
+	return;
+}
+
+/**
+ * Switches to the flag's fast path by updating a zero value in the
+ * `MOV` instruction's immediate field.
+ */
+static __attribute__((noinline))  void
+unpatch(const struct patch_record *record)
+{
+
+	update_byte(hook_field(record), DYNAMIC_FLAG_VALUE_INACTIVE);
+	return;
+}
+#elif DYNAMIC_FLAG_IMPLEMENTATION_STYLE == 2
+#define HOOK_SIZE 5  /* jmp rel32 or testl %eax, imm. */
+
+/**
+ * Returns the address of the opcode byte.
+ */
+static uint8_t *
+hook_field(const struct patch_record *record)
+{
+
+	return record_hook(record);
+}
+
+/**
+ * Switches to the flag's slow path by setting the opcode to `jmp rel`.
+ */
+static __attribute__((noinline))  void
+patch(const struct patch_record *record)
+{
+	uint8_t *address = record_hook(record);
+	void *dst = record_destination(record);
+	int32_t *target = (int32_t *)(address + 1);
+	intptr_t offset = (uint8_t *)dst - (address + 5); /* IP offset from end of instruction. */
+
+	assert((*address == 0xe9 || *address == 0xa9) &&
+	    "Target should be a jmp rel or a testl $..., %eax");
+	assert((offset == (intptr_t)*target) &&
+	    "Target's offset should match with the hook destination.");
+
+	update_byte(address, 0xe9); /* jmp rel */
+	return;
+}
+
+/**
+ * Switches to the flag's fast path by setting the opcode to `test`.
+ */
+static __attribute__((noinline)) void
+unpatch(const struct patch_record *record)
+{
+	uint8_t *address = record_hook(record);
+	void *dst = record_destination(record);
+	int32_t *target = (int32_t *)(address + 1);
+	intptr_t offset = (uint8_t *)dst - (address + 5);
+
+	assert((*address == 0xe9 || *address == 0xa9) &&
+	    "Target should be a jmp rel or a testl $..., %eax");
+	assert((offset == (intptr_t)*target) &&
+	    "Target's offset should match with the hook destination.");
+
+	update_byte(address, 0xa9); /* testl $..., %eax */
+	return;
+}
+#elif DYNAMIC_FLAG_IMPLEMENTATION_STYLE == 3
+#define HOOK_SIZE 5  /* jmp rel32 or nopl 0x0(%rax,%rax,1). */
+
+static const uint8_t nop5[HOOK_SIZE] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+/**
+ * Returns the address of the opcode byte.
+ */
+static uint8_t *
+hook_field(const struct patch_record *record)
+{
+
+	return record_hook(record);
+}
+
+/**
+ * Switches to the flag's slow path by rewriting the hook to `jmp rel`.
+ */
+static __attribute__((noinline)) void
+patch(const struct patch_record *record)
+{
+	uint8_t *address = record_hook(record);
+	intptr_t offset = (uint8_t *)record_destination(record) - (address + HOOK_SIZE);
+	int32_t rel = (int32_t)offset;
+	uint8_t bytes[HOOK_SIZE] = { 0xe9 };
+
+	assert((memcmp(address, nop5, HOOK_SIZE) == 0 || *address == 0xe9) &&
+	    "Target should be a jmp rel or a nopl");
+	assert(offset == (intptr_t)rel && "Destination out of jmp rel32 range.");
+
+	memcpy(&bytes[1], &rel, sizeof(rel));
+	stage_poke(address, bytes);
+	return;
+}
+
+/**
+ * Switches to the flag's fast path by rewriting the hook to `nopl`.
+ */
+static __attribute__((noinline)) void
+unpatch(const struct patch_record *record)
+{
+	uint8_t *address = record_hook(record);
+
+	assert((memcmp(address, nop5, HOOK_SIZE) == 0 || *address == 0xe9) &&
+	    "Target should be a jmp rel or a nopl");
+
+	stage_poke(address, nop5);
+	return;
+}
+
+#endif
+
+#if DYNAMIC_FLAG_IMPLEMENTATION_STYLE < 2
+/*
+ * Without asm goto, there is no multi-byte update: `patch` and
+ * `unpatch` write directly, and there is nothing left to commit.
+ */
+static void
+poke_init(void)
+{
+
+	return;
+}
+
+static int
+poke_commit(void)
+{
+
+	return 0;
+}
+#endif
+
+#if DYNAMIC_FLAG_IMPLEMENTATION_STYLE >= 2
+/**
+ * Returns the destination for case `which` of a DF_SWITCH record,
+ * or NULL for case 0 (the fall-through).
+ */
+static void *
+switch_target(const struct patch_record *record, size_t which)
+{
+	const int32_t *table = record_destination(record);
+
+	assert(which < record->cases);
+	return (which == 0) ? NULL : relative_pointer(&table[which - 1]);
+}
+
+/**
+ * Rewrites a DF_SWITCH hook to jump to the case in its
+ * `activation` count, or to fall through for case 0.
+ */
+static void
+switch_apply(const struct patch_record *record)
+{
+	struct patch_count *count = record_count(record);
+	uint8_t *address = record_hook(record);
+	void *dst = switch_target(record, count->activation);
+	uint8_t bytes[POKE_SIZE];
+
+	if (dst == NULL) {
+#if DYNAMIC_FLAG_IMPLEMENTATION_STYLE == 3
+		memcpy(bytes, nop5, sizeof(bytes));
+#else
+		/* The testl's immediate doesn't matter: keep it. */
+		memcpy(bytes, address, sizeof(bytes));
+		bytes[0] = DYNAMIC_FLAG_VALUE_INACTIVE;
+#endif
+	} else {
+		intptr_t offset = (uint8_t *)dst - (address + POKE_SIZE);
+		int32_t rel = (int32_t)offset;
+
+		assert(offset == (intptr_t)rel && "Case out of jmp rel32 range.");
+		bytes[0] = DYNAMIC_FLAG_VALUE_ACTIVE;
+		memcpy(&bytes[1], &rel, sizeof(rel));
+	}
+
+	stage_poke(address, bytes);
+	return;
+}
+
+/**
+ * Returns whether `fn` is in `jmp rel32` range of a DF_CALL record's
+ * trampoline.
+ */
+static bool
+call_in_range(const struct patch_record *record, const void *fn)
+{
+	intptr_t offset = (const uint8_t *)fn -
+	    ((const uint8_t *)record_hook(record) + POKE_SIZE);
+
+	return offset == (intptr_t)(int32_t)offset;
+}
+
+/**
+ * Returns a DF_CALL record's default callee.  The record's
+ * destination is a copy of the trampoline's original `jmp`, which the
+ * linker resolved like the trampoline (directly, or to a PLT entry).
+ */
+static void *
+call_default(const struct patch_record *record)
+{
+	const uint8_t *copy = record_destination(record);
+	int32_t rel;
+
+	memcpy(&rel, copy + 1, sizeof(rel));
+	return (void *)(copy + POKE_SIZE + rel);
+}
+
+/**
+ * Rewrites a DF_CALL trampoline to jump to the callee in its
+ * `activation` count, or to its default callee if 0.
+ */
+static void
+call_apply(const struct patch_record *record)
+{
+	struct patch_count *count = record_count(record);
+	uint8_t *address = record_hook(record);
+	void *dst = call_default(record);
+	uint8_t bytes[POKE_SIZE];
+	int32_t rel;
+
+	if (count->activation != 0) {
+		dst = (void *)(uintptr_t)count->activation;
+	}
+
+	assert(call_in_range(record, dst));
+	rel = (int32_t)((uint8_t *)dst - (address + POKE_SIZE));
+	bytes[0] = DYNAMIC_FLAG_VALUE_ACTIVE;
+	memcpy(&bytes[1], &rel, sizeof(rel));
+	stage_poke(address, bytes);
+	return;
+}
+
+/**
+ * Decodes a DF_CALL trampoline's callee into an activation value.
+ */
+static uint64_t
+call_current(const struct patch_record *record)
+{
+	uint8_t *address = record_hook(record);
+	uint8_t *dst;
+	int32_t rel;
+
+	memcpy(&rel, address + 1, sizeof(rel));
+	dst = address + POKE_SIZE + rel;
+	return (dst == call_default(record)) ? 0 : (uintptr_t)dst;
+}
+
+/**
+ * Decodes the case a DF_SWITCH hook currently jumps to.
+ */
+static size_t
+switch_current(const struct patch_record *record)
+{
+	uint8_t *address = record_hook(record);
+	int32_t rel;
+
+	if (address[0] != DYNAMIC_FLAG_VALUE_ACTIVE) {
+		return 0;
+	}
+
+	memcpy(&rel, address + 1, sizeof(rel));
+	for (size_t i = 1; i < record->cases; i++) {
+		if (switch_target(record, i) == address + POKE_SIZE + rel) {
+			return i;
+		}
+	}
+
+	assert(0 && "DF_SWITCH jumps to an unknown case.");
+	return 0;
+}
+#else
+static void
+switch_apply(const struct patch_record *record)
+{
+
+	(void)record;
+	assert(0 && "DF_SWITCH records need asm goto.");
+	return;
+}
+
+static size_t
+switch_current(const struct patch_record *record)
+{
+
+	(void)record;
+	return 0;
+}
+
+static bool
+call_in_range(const struct patch_record *record, const void *fn)
+{
+
+	(void)record;
+	(void)fn;
+	return true;
+}
+
+static void *
+call_default(const struct patch_record *record)
+{
+
+	return record_destination(record);
+}
+
+static void
+call_apply(const struct patch_record *record)
+{
+
+	(void)record;
+	assert(0 && "DF_CALL records need asm goto.");
+	return;
+}
+
+static uint64_t
+call_current(const struct patch_record *record)
+{
+
+	(void)record;
+	return 0;
+}
+#endif
+
+/**
+ * Returns whether the flag's machine code currently implements the
+ * active state.
+ */
+static bool
+code_is_active(const struct patch_record *record)
+{
+	bool patched = *hook_field(record) == DYNAMIC_FLAG_VALUE_ACTIVE;
+
+	return patched != (record->flipped != 0);
+}
+
+/**
+ * Returns whether the record's machine code already implements its
+ * activation count.
+ */
+static bool
+code_matches_count(const struct patch_record *record)
+{
+	uint64_t activation =
+	    __atomic_load_n(&record_count(record)->activation, __ATOMIC_RELAXED);
+
+	if (record->type == PATCH_RECORD_SWITCH) {
+		return switch_current(record) == activation;
+	}
+
+	if (record->type == PATCH_RECORD_CALL) {
+		return call_current(record) == activation;
+	}
+
+	return code_is_active(record) == (activation > 0);
+}
+
+/**
+ * Returns a record's activation count right after initialisation.
+ */
+static uint64_t
+initial_activation(const struct patch_record *record)
+{
+
+	if (record->type != PATCH_RECORD_FLAG) {
+		return 0;
+	}
+
+	if (record->initial_opcode == DYNAMIC_FLAG_VALUE_ACTIVE) {
+		return (record->flipped != 0) ? 0 : 1;
+	}
+
+	return (record->flipped != 0) ? 1 : 0;
+}
+
+/**
+ * Sets the flag's initial state to that configured in its patch
+ * record, and updates the patch's activation count accordingly.
+ */
+static void
+initial_patch(const struct patch_record *record)
+{
+
+	record_count(record)->activation = initial_activation(record);
+	if (record->type == PATCH_RECORD_SWITCH) {
+		switch_apply(record);
+		return;
+	}
+
+	/* Call trampolines are assembled with their default callee. */
+	if (record->type == PATCH_RECORD_CALL) {
+		return;
+	}
+
+	switch (record->initial_opcode) {
+	case DYNAMIC_FLAG_VALUE_ACTIVE:
+		patch(record);
+		break;
+	case DYNAMIC_FLAG_VALUE_INACTIVE:
+		unpatch(record);
+		break;
+	default:
+		assert((record->initial_opcode == DYNAMIC_FLAG_VALUE_ACTIVE ||
+		    record->initial_opcode == DYNAMIC_FLAG_VALUE_INACTIVE) &&
+		    "Initial opcode/value must be ACTIVE or INACTIVE (JMP REL32 or TEST / 0xF4 or 0)");
+	}
+
+	__builtin___clear_cache(record_hook(record), (char *)record_hook(record) + HOOK_SIZE);
+	return;
+}
+
+/**
+ * Enables a flag.  I.e., switches to the fast path if the record is
+ * `flipped`, and to the slow path otherwise.
+ */
+static void
+activate(const struct patch_record *record)
+{
+
+	if (record->flipped != 0) {
+		unpatch(record);
+	} else {
+		patch(record);
+	}
+
+	__builtin___clear_cache(record_hook(record), (char *)record_hook(record) + HOOK_SIZE);
+	return;
+}
+
+/**
+ * Disables a flag.  I.e., switches to the slow path if the record is
+ * `flipped`, and to the fast path otherwise.
+ */
+static void
+deactivate(const struct patch_record *record)
+{
+
+	if (record->flipped != 0) {
+		patch(record);
+	} else {
+		unpatch(record);
+	}
+
+	__builtin___clear_cache(record_hook(record), (char *)record_hook(record) + HOOK_SIZE);
+	return;
+}
+
+/**
+ * Invokes `cb` on a list of records sorted by hook instruction
+ * address.
+ *
+ * The hook instruction is on writable page(s) when `cb` is called,
+ * and quickly reset to read-only/executable (or, with the alias
+ * backend, writable through the alias mapping).
+ *
+ * This pair of mprotect is slow, so `amortize` batches calls for
+ * contiguous pages, and bridges gaps of up to `coalesce_gap` pages
+ * inside the text span of a module.
+ *
+ * When `sync_core_mode` is enabled, `amortize` also issues a single
+ * core-serialising membarrier once all ranges have been patched.
+ *
+ * Returns 0 on success, and -1 if the backend failed to patch at
+ * least one range.  In that case, some records may not have been
+ * updated; `resync` can reconcile their counts with the code.
+ */
+static int
+amortize(const struct patch_list *records,
+    void (*cb)(const struct patch_record *))
+{
+	uintptr_t first_page = UINTPTR_MAX;
+	uintptr_t last_page = 0;
+	uintptr_t page_size;
+	size_t i, section_begin = 0;
+	int r = 0;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+#define PATCH() do {							\
+		void *begin = (void *)(first_page * page_size);	\
+		size_t size = (1 + last_page - first_page) * page_size; \
+									\
+		if (section_begin >= i) {				\
+			break;						\
+		}							\
+									\
+		if (backend->open(begin, size) != 0) {			\
+			r = -1;						\
+			break;						\
+		}							\
+									\
+		for (size_t j = section_begin; j < i; j++) {		\
+			cb(records->data[j]);				\
+		}							\
+									\
+		if (poke_commit() != 0) {				\
+			r = -1;						\
+		}							\
+									\
+		if (backend->close(begin, size) != 0) {			\
+			r = -1;						\
+		}							\
+	} while (0)
+
+	for (i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+		uintptr_t begin_page = (uintptr_t)record_hook(record) / page_size;
+		uintptr_t end_page = ((uintptr_t)record_hook(record) + HOOK_SIZE - 1) / page_size;
+		/* The initial range is empty, and can always be extended. */
+		bool empty_range = first_page > last_page;
+		/*
+		 * Otherwise, we can extend the current range by up to
+		 * one page in either direction.  If begin/end page
+		 * fall in that extended range, we want to adjoin it
+		 * to the `[first_page, last_page]` range.  Limited
+		 * extension guarantees that we only mprotect adjacent
+		 * pages that we would have mprotect-ed anyway.
+		 *
+		 * There is potential for unsigned overflow in the
+		 * subtraction, but only for the zero page, which is
+		 * usually unmappable. If we do have hook instructions
+		 * on the zero page, the wraparound is defined
+		 * behaviour and will merely result in less
+		 * amortisation, which is still correct.
+		 */
+		bool can_extend = (first_page - 1) <= begin_page &&
+			end_page <= (last_page + 1);
+		/*
+		 * Records are sorted, so gaps are always to the right.
+		 * Bridging them is only safe when the pages in between
+		 * are known to be text.
+		 */
+		bool can_bridge = last_page < begin_page &&
+			begin_page - last_page - 1 <= coalesce_gap &&
+			text_span_covers(first_page, end_page);
+
+		if (empty_range || can_extend || can_bridge) {
+			if (begin_page < first_page) {
+				first_page = begin_page;
+			}
+			if (end_page > last_page) {
+				last_page = end_page;
+			}
+		} else {
+			PATCH();
+			section_begin = i;
+			first_page = begin_page;
+			last_page = end_page;
+		}
+	}
+
+	PATCH();
+#undef PATCH
+
+	/* One barrier for the whole batch, not one per record or range. */
+	if (sync_core_mode != 0 && records->size > 0) {
+		sync_cores();
+	}
+
+	return r;
+}
+
+/**
+ * Returns 0 if `[begin, end)` is covered by executable mappings.
+ *
+ * Patching splits the executable's text mapping, so we may have to
+ * walk more than one mapping.
+ */
+static int
+check_text_mapping(uintptr_t begin, uintptr_t end)
+{
+	FILE *maps;
+	char *line = NULL;
+	size_t line_size = 0;
+	uintptr_t covered = begin;
+
+	maps = fopen("/proc/self/maps", "re");
+	if (maps == NULL) {
+		return -1;
+	}
+
+	while (getline(&line, &line_size, maps) > 0) {
+		unsigned long lo, hi;
+		char perms[5];
+
+		if (sscanf(line, "%lx-%lx %4s", &lo, &hi, perms) != 3) {
+			continue;
+		}
+
+		/* /proc/self/maps lists mappings in ascending order. */
+		if (lo <= covered && covered < hi && perms[2] == 'x') {
+			covered = hi;
+		}
+	}
+
+	free(line);
+	fclose(maps);
+	return (covered >= end) ? 0 : -1;
+}
+
+/**
+ * Returns whether [`address`, `address + size`) is in one of the
+ * loadable segments of `info`.
+ */
+static bool
+module_maps(const struct dl_phdr_info *info, uintptr_t address, size_t size)
+{
+
+	for (size_t i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		uintptr_t begin = info->dlpi_addr + phdr->p_vaddr;
+
+		if (phdr->p_type == PT_LOAD && begin <= address &&
+		    size <= phdr->p_memsz &&
+		    address - begin <= phdr->p_memsz - size) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Returns the NT_GNU_BUILD_ID note mapped for `info`, and the PT_NOTE
+ * segment that holds it in `segment`, or NULL if the object has none.
+ */
+static const ElfW(Nhdr) *
+mapped_build_id(const struct dl_phdr_info *info, const ElfW(Phdr) **segment)
+{
+
+	for (size_t i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		size_t align = (phdr->p_align == 8) ? 8 : 4;
+		uintptr_t it = info->dlpi_addr + phdr->p_vaddr;
+		uintptr_t end = it + phdr->p_filesz;
+
+		if (phdr->p_type != PT_NOTE) {
+			continue;
+		}
+
+		while (end - it >= sizeof(ElfW(Nhdr))) {
+			const ElfW(Nhdr) *note = (const ElfW(Nhdr) *)it;
+			size_t name = (note->n_namesz + align - 1) & -align;
+			size_t desc = (note->n_descsz + align - 1) & -align;
+
+			if (end - it - sizeof(*note) < name + desc) {
+				break;
+			}
+
+			if (note->n_type == NT_GNU_BUILD_ID &&
+			    note->n_namesz == sizeof("GNU") &&
+			    memcmp(note + 1, "GNU", sizeof("GNU")) == 0) {
+				*segment = phdr;
+				return note;
+			}
+
+			it += sizeof(*note) + name + desc;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns whether the file open at `fd` is the object loaded at
+ * `info`, rather than, e.g., a newer build installed over it since:
+ * the file must have the mapped build ID, or, for objects linked
+ * without one, the same bytes in the mapped `records` section.
+ */
+static bool
+module_same_file(const struct dl_phdr_info *info, int fd,
+    const ElfW(Shdr) *records)
+{
+	const ElfW(Phdr) *segment;
+	const ElfW(Nhdr) *note;
+	const void *mapped;
+	void *copy;
+	size_t size;
+	off_t offset;
+	bool same;
+
+	note = mapped_build_id(info, &segment);
+	if (note != NULL) {
+		mapped = note;
+		size = sizeof(*note) + note->n_namesz + note->n_descsz;
+		offset = segment->p_offset + ((uintptr_t)note -
+		    (info->dlpi_addr + segment->p_vaddr));
+	} else {
+		mapped = (const void *)(info->dlpi_addr + records->sh_addr);
+		size = records->sh_size;
+		offset = records->sh_offset;
+	}
+
+	copy = malloc(size);
+	if (copy == NULL) {
+		return false;
+	}
+
+	same = pread(fd, copy, size, offset) == (ssize_t)size &&
+	    memcmp(copy, mapped, size) == 0;
+	free(copy);
+	return same;
+}
+
+/**
+ * Finds the flag sections of the object loaded at `info` in the
+ * section headers of its file, `path`: the dynamic loader doesn't
+ * map section headers.  Returns 0 and fills `module` if the object
+ * has patch records and `path` is still the file that was loaded,
+ * -1 otherwise.
+ */
+static int
+module_read(struct module *module, const struct dl_phdr_info *info,
+    const char *path)
+{
+	ElfW(Ehdr) ehdr;
+	ElfW(Shdr) *shdrs = NULL;
+	const ElfW(Shdr) *strtab;
+	const ElfW(Shdr) *records = NULL;
+	char *strings = NULL;
+	size_t size;
+	int r = -1;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != (ssize_t)sizeof(ehdr) ||
+	    memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+	    ehdr.e_shentsize != sizeof(*shdrs) ||
+	    ehdr.e_shstrndx == SHN_UNDEF || ehdr.e_shstrndx >= ehdr.e_shnum) {
+		goto out;
+	}
+
+	size = ehdr.e_shnum * sizeof(*shdrs);
+	shdrs = malloc(size);
+	if (shdrs == NULL ||
+	    pread(fd, shdrs, size, ehdr.e_shoff) != (ssize_t)size) {
+		goto out;
+	}
+
+	strtab = &shdrs[ehdr.e_shstrndx];
+	strings = calloc(1, strtab->sh_size + 1);
+	if (strings == NULL ||
+	    pread(fd, strings, strtab->sh_size, strtab->sh_offset) !=
+	    (ssize_t)strtab->sh_size) {
+		goto out;
+	}
+
+	for (size_t i = 0; i < ehdr.e_shnum; i++) {
+		const ElfW(Shdr) *shdr = &shdrs[i];
+		const char *name = strings + shdr->sh_name;
+		uintptr_t address = info->dlpi_addr + shdr->sh_addr;
+
+		/* Don't trust a file that doesn't match the mappings. */
+		if (shdr->sh_name >= strtab->sh_size ||
+		    (shdr->sh_flags & SHF_ALLOC) == 0 ||
+		    strncmp(name, "dynamic_flag_", strlen("dynamic_flag_")) != 0) {
+			continue;
+		}
+
+		if (!module_maps(info, address, shdr->sh_size)) {
+			goto out;
+		}
+
+		if (strcmp(name, "dynamic_flag_list") == 0) {
+			if (shdr->sh_size % sizeof(struct patch_record) != 0) {
+				goto out;
+			}
+
+			records = shdr;
+			module->start = (const struct patch_record *)address;
+			module->end = module->start +
+			    shdr->sh_size / sizeof(struct patch_record);
+		} else if (strcmp(name, "dynamic_flag_init") == 0) {
+			module->init_start = (const int32_t *)address;
+			module->init_end = module->init_start +
+			    shdr->sh_size / sizeof(int32_t);
+		} else if (strcmp(name, "dynamic_flag_meta") == 0 &&
+		    shdr->sh_size >= sizeof(uint64_t)) {
+			module->sorted = *(const volatile uint64_t *)address ==
+			    DYNAMIC_FLAG_SORTED_MAGIC;
+		}
+	}
+
+	if (module->start < module->end &&
+	    module_same_file(info, fd, records)) {
+		r = 0;
+	}
+
+out:
+	free(strings);
+	free(shdrs);
+	close(fd);
+	return r;
+}
+
+/**
+ * Modules found by `modules_scan`, and the loader's counters of
+ * loaded and unloaded objects at that time.
+ */
+struct module_scan {
+	struct module *data;
+	size_t size;
+	unsigned long long adds;
+	unsigned long long subs;
+};
+
+static int
+module_discover(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct module_scan *scan = data;
+	struct module module = { NULL };
+	const char *path = info->dlpi_name;
+
+	(void)size;
+	scan->adds = info->dlpi_adds;
+	scan->subs = info->dlpi_subs;
+
+	/* We know our own records from the linker's symbols. */
+	if (module_maps(info, (uintptr_t)__start_dynamic_flag_list, 1)) {
+		return 0;
+	}
+
+	/* The main program is the only object without a path. */
+	if (path == NULL || path[0] == '\0') {
+		path = "/proc/self/exe";
+	}
+
+	if (module_read(&module, info, path) != 0) {
+		return 0;
+	}
+
+	scan->data = realloc(scan->data,
+	    (scan->size + 1) * sizeof(*scan->data));
+	assert(scan->data != NULL);
+	scan->data[scan->size++] = module;
+	return 0;
+}
+
+static int
+cmp_modules(const void *x, const void *y)
+{
+	const struct module *a = x;
+	const struct module *b = y;
+
+	if (a->start == b->start) {
+		return 0;
+	}
+
+	return ((uintptr_t)a->start < (uintptr_t)b->start) ? -1 : 1;
+}
+
+/**
+ * Finds patch records in this library's module, and in all other
+ * loaded objects, and stores their modules in `scan`, sorted by
+ * address.  The modules don't have counts yet.
+ */
+static void
+modules_scan(struct module_scan *scan)
+{
+
+	*scan = (struct module_scan) { NULL };
+	scan->data = calloc(1, sizeof(*scan->data));
+	assert(scan->data != NULL);
+	scan->data[0] = (struct module) {
+		.start = __start_dynamic_flag_list,
+		.end = __stop_dynamic_flag_list,
+		.init_start = __start_dynamic_flag_init,
+		.init_end = __stop_dynamic_flag_init,
+		.sorted = (sorted_marker == DYNAMIC_FLAG_SORTED_MAGIC),
+	};
+	scan->size = 1;
+
+	dl_iterate_phdr(module_discover, scan);
+	qsort(scan->data, scan->size, sizeof(*scan->data), cmp_modules);
+	return;
+}
+
+/**
+ * Numbers the records of all modules, in address order, and caches
+ * whether they're all sorted.
+ */
+static void
+modules_index(void)
+{
+
+	presorted = true;
+	modules.records = 0;
+	for (size_t i = 0; i < modules.size; i++) {
+		struct module *module = &modules.data[i];
+
+		module->base = modules.records;
+		modules.records += module->end - module->start;
+		presorted = presorted && module->sorted;
+	}
+
+	return;
+}
+
+/**
+ * Finds patch records in all loaded objects, and allocates their
+ * counts.  Also registers for the membarrier that lets flag
+ * operations enter `modules` with a compiler barrier only.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+modules_init(void)
+{
+	struct module_scan scan;
+
+	if (register_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED,
+	    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED) == 0) {
+		__atomic_store_n(&modules_poll.light, true, __ATOMIC_RELAXED);
+	}
+
+	modules_scan(&scan);
+	for (size_t i = 0; i < scan.size; i++) {
+		struct module *module = &scan.data[i];
+
+		module->counts = calloc(module->end - module->start,
+		    sizeof(*module->counts));
+		assert(module->counts != NULL);
+	}
+
+	modules.data = scan.data;
+	modules.size = scan.size;
+	modules.adds = scan.adds;
+	modules.subs = scan.subs;
+	modules_index();
+	return;
+}
+
+/**
+ * Sets the text span of `module` to the pages between its lowest and
+ * highest hook if they're all executable.
+ */
+static void
+text_span_set(struct module *module)
+{
+	uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t begin = UINTPTR_MAX;
+	uintptr_t end = 0;
+
+	module->text_first = UINTPTR_MAX;
+	module->text_last = 0;
+	for (const struct patch_record *record = module->start;
+	     record < module->end; record++) {
+		uintptr_t hook = (uintptr_t)record_hook(record);
+
+		if (hook < begin) {
+			begin = hook;
+		}
+
+		if (hook + HOOK_SIZE > end) {
+			end = hook + HOOK_SIZE;
+		}
+	}
+
+	if (begin >= end || check_text_mapping(begin, end) != 0) {
+		return;
+	}
+
+	module->text_first = begin / page_size;
+	module->text_last = (end - 1) / page_size;
+	return;
+}
+
+/**
+ * Sets the text span of each module.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+text_span_init(void)
+{
+
+	for (size_t i = 0; i < modules.size; i++) {
+		text_span_set(&modules.data[i]);
+	}
+
+	return;
+}
+
+/**
+ * Returns whether pages `first` to `last` are all in the text span
+ * of a module.
+ */
+static bool
+text_span_covers(uintptr_t first, uintptr_t last)
+{
+
+	for (size_t i = 0; i < modules.size; i++) {
+		if (modules.data[i].text_first <= first &&
+		    last <= modules.data[i].text_last) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Replaces the text pages that contain hook instructions with a
+ * shared mapping of a memfd that holds a copy of the same bytes,
+ * and maps a second writable view of that memfd.
+ *
+ * Other threads may execute code in these pages while we remap
+ * them; that's safe because the new mapping has the same contents,
+ * and `patch_lock` guarantees no one writes to the text pages
+ * between the copy and the remap.
+ *
+ * Must be called with the patch lock held.
+ */
+static int
+alias_map_init(void)
+{
+	uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t begin = UINTPTR_MAX;
+	uintptr_t end = 0;
+	uint8_t *alias, *text;
+	size_t size, copied;
+	int fd;
+
+	if (alias_map.alias != NULL) {
+		return 0;
+	}
+
+	/* A single mapping can only alias the text of one module. */
+	if (modules.size != 1) {
+		return -1;
+	}
+
+	for (const struct patch_record *record = modules.data[0].start;
+	     record < modules.data[0].end; record++) {
+		uintptr_t hook = (uintptr_t)record_hook(record);
+
+		if (hook < begin) {
+			begin = hook;
+		}
+
+		if (hook + HOOK_SIZE > end) {
+			end = hook + HOOK_SIZE;
+		}
+	}
+
+	begin = begin / page_size * page_size;
+	end = (end + page_size - 1) / page_size * page_size;
+	size = end - begin;
+	if (begin >= end || check_text_mapping(begin, end) != 0) {
+		return -1;
+	}
+
+	fd = memfd_create("dynamic_flag_text", MFD_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (ftruncate(fd, size) != 0) {
+		goto fail;
+	}
+
+	for (copied = 0; copied < size; ) {
+		ssize_t r;
+
+		r = pwrite(fd, (const void *)(begin + copied), size - copied,
+		    copied);
+		if (r <= 0) {
+			goto fail;
+		}
+
+		copied += r;
+	}
+
+	alias = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (alias == MAP_FAILED) {
+		goto fail;
+	}
+
+	text = mmap((void *)begin, size, PROT_READ | PROT_EXEC,
+	    MAP_SHARED | MAP_FIXED, fd, 0);
+	if (text == MAP_FAILED) {
+		munmap(alias, size);
+		goto fail;
+	}
+
+	assert(text == (void *)begin);
+	close(fd);
+
+	alias_map.text = text;
+	alias_map.alias = alias;
+	alias_map.size = size;
+	return 0;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+/**
+ * Resets the activation count of records whose machine code doesn't
+ * match their count after a failed `amortize`: failed activations
+ * go back to 0, and failed deactivations to 1.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+resync(const struct patch_list *records)
+{
+
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+		struct patch_count *count = record_count(record);
+		bool active = count->activation > 0;
+
+		if (record->type == PATCH_RECORD_SWITCH) {
+			count->activation = switch_current(record);
+			continue;
+		}
+
+		if (record->type == PATCH_RECORD_CALL) {
+			count->activation = call_current(record);
+			continue;
+		}
+
+		if (code_is_active(record) != active) {
+			__atomic_store_n(&count->activation,
+			    active ? 0 : 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	return;
+}
+
+/**
+ * Returns 0 if `backend` can patch the page that contains `record`'s
+ * hook instruction, without actually modifying that instruction.
+ */
+static int
+probe_backend(const struct patch_backend *candidate,
+    const struct patch_record *record)
+{
+	uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	uint8_t *field = hook_field(record);
+	void *page = (void *)((uintptr_t)field & -page_size);
+	const struct patch_backend *old = backend;
+	int r;
+
+	backend = candidate;
+	r = backend->open(page, page_size);
+	if (r == 0) {
+		backend->write(field, *field);
+		r = backend->close(page, page_size);
+	}
+
+	backend = old;
+	return r;
+}
+
+/**
+ * Opens `/proc/self/mem` for the proc_mem backend.
+ *
+ * Must be called with the patch lock held.
+ */
+static int
+proc_mem_init(void)
+{
+	int fd;
+
+	if (proc_mem.fd >= 0) {
+		return 0;
+	}
+
+	proc_mem.buf = malloc(sysconf(_SC_PAGESIZE));
+	if (proc_mem.buf == NULL) {
+		return -1;
+	}
+
+	fd = open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		free(proc_mem.buf);
+		proc_mem.buf = NULL;
+		return -1;
+	}
+
+	proc_mem.fd = fd;
+	if (probe_backend(&proc_mem_backend, modules.data[0].start) != 0) {
+		close(fd);
+		free(proc_mem.buf);
+		proc_mem.fd = -1;
+		proc_mem.buf = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Picks the first backend that works, in order: mprotect, proc_mem.
+ * Falls back to the "none" backend, which fails all patches.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+detect_backend(void)
+{
+
+	if (probe_backend(&mprotect_backend, modules.data[0].start) == 0) {
+		backend = &mprotect_backend;
+	} else if (proc_mem_init() == 0) {
+		backend = &proc_mem_backend;
+	} else {
+		backend = &none_backend;
+	}
+
+	return;
+}
+
+/**
+ * Compiles `pattern` as a POSIX extended regular expression that's
+ * implicitly anchored at the first character of the string (at the
+ * first character of the flag name)
+ */
+static int
+compile_regex(regex_t *regex, const char *pattern)
+{
+	char *to_free = NULL;
+	int r;
+
+	if (pattern != NULL && pattern[0] != '^') {
+		r = asprintf(&to_free, "^%s", pattern);
+		if (r < 0)
+			return r;
+		pattern = to_free;
+	}
+
+	r = regcomp(regex, pattern, REG_EXTENDED | REG_NOSUB);
+	free(to_free);
+	return r;
+}
+
+/**
+ * A compiled flag name pattern.  Most patterns are literal prefixes
+ * (e.g., `request_tracing:`), optionally followed by `.*` or `$`:
+ * we match these with string comparisons and binary search in the
+ * name index, and only fall back to POSIX regexes for other patterns.
+ */
+struct matcher {
+	bool is_regex;
+	/* If true, the literal must match the whole name (`$`). */
+	bool exact;
+	const char *literal;
+	size_t length;
+	regex_t regex;
+};
+
+/**
+ * Compiles `pattern` (implicitly anchored at the first character
+ * of the flag name) into `matcher`.  A NULL pattern matches every
+ * name.
+ */
+static int
+matcher_compile(struct matcher *matcher, const char *pattern)
+{
+	size_t length;
+
+	*matcher = (struct matcher) { .literal = "" };
+	if (pattern == NULL) {
+		return 0;
+	}
+
+	if (pattern[0] == '^') {
+		pattern++;
+	}
+
+	length = strcspn(pattern, ".[]()*+?{}|^$\\");
+	matcher->literal = pattern;
+	matcher->length = length;
+	if (strcmp(pattern + length, "") == 0 ||
+	    strcmp(pattern + length, ".*") == 0 ||
+	    strcmp(pattern + length, ".*$") == 0) {
+		return 0;
+	}
+
+	if (strcmp(pattern + length, "$") == 0) {
+		matcher->exact = true;
+		return 0;
+	}
+
+	matcher->is_regex = true;
+	return compile_regex(&matcher->regex, pattern);
+}
+
+static bool
+matcher_match(const struct matcher *matcher, const char *name)
+{
+
+	if (matcher->is_regex) {
+		return regexec(&matcher->regex, name, 0, NULL, 0) != REG_NOMATCH;
+	}
+
+	if (strncmp(name, matcher->literal, matcher->length) != 0) {
+		return false;
+	}
+
+	return matcher->exact == false || name[matcher->length] == '\0';
+}
+
+static void
+matcher_destroy(struct matcher *matcher)
+{
+
+	if (matcher->is_regex) {
+		regfree(&matcher->regex);
+	}
+
+	return;
+}
+
+static uint64_t
+hash_name(const char *key, size_t length)
+{
+	/* FNV-1a. */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (uint8_t)key[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Maximum number of patterns in the pattern cache. */
+#define PATTERN_CACHE_SIZE 64
+
+/* Larger record sets aren't worth caching: patching them dominates. */
+#define PATTERN_CACHE_MAX_RECORDS 1024
+
+/**
+ * A pattern cache entry: the records that match `pattern` in the
+ * list that starts at `start` (NULL for all records), in the order
+ * `find_records{,_kind}` would have returned them.  Entries are
+ * immutable once published, except for `referenced`.
+ */
+struct pattern_cache_entry {
+	const int32_t *start;
+	const char *pattern;
+	size_t size;
+	bool sorted;
+	/* Set by hits, cleared as the eviction hand passes. */
+	bool referenced;
+	/* Next evicted entry that some reader may still hold. */
+	struct pattern_cache_entry *retired;
+	const struct patch_record *records[];
+};
+
+/**
+ * Bounded cache from patterns to their matching records, for
+ * programs that repeatedly flip the same few patterns.
+ *
+ * Lookups are lock-free: they find candidate `entries` by `hashes`,
+ * publish the entry they read in their thread's `cache_entry` hazard
+ * pointer, and check that it's still in its slot before reading it.
+ * Writers (`pattern_cache_put` and `pattern_cache_flush`) serialise
+ * on `lock`, evict with the CLOCK algorithm (a `referenced` bit per
+ * entry rather than a shared LRU clock), and only free evicted
+ * entries that no hazard pointer holds; the others wait in `retired`.
+ * Threads count their hits and misses in their `thread_state`.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct pattern_cache_entry *entries[PATTERN_CACHE_SIZE];
+	uint64_t hashes[PATTERN_CACHE_SIZE];
+	size_t hand;
+	struct pattern_cache_entry *retired;
+} pattern_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t
+pattern_cache_hash(const int32_t *start, const char *pattern)
+{
+
+	return hash_name(pattern, strlen(pattern)) ^ (uintptr_t)start;
+}
+
+/**
+ * Copies the records cached for (`start`, `pattern`) to `acc`, if
+ * any.  Returns whether the pattern was cached.
+ *
+ * Must be called between `modules_enter` and `modules_exit`.
+ */
+static bool
+pattern_cache_get(const int32_t *start, const char *pattern,
+    struct patch_list *acc)
+{
+	uint64_t hash = pattern_cache_hash(start, pattern);
+	bool found = false;
+
+	assert(thread_state.registered);
+	for (size_t i = 0; i < PATTERN_CACHE_SIZE && !found; i++) {
+		struct pattern_cache_entry *entry;
+
+		if (__atomic_load_n(&pattern_cache.hashes[i],
+		    __ATOMIC_RELAXED) != hash) {
+			continue;
+		}
+
+		entry = __atomic_load_n(&pattern_cache.entries[i],
+		    __ATOMIC_RELAXED);
+		if (entry == NULL) {
+			continue;
+		}
+
+		/* Pairs with the hazard scan in `pattern_cache_retire`. */
+		__atomic_store_n(&thread_state.cache_entry, entry,
+		    __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&pattern_cache.entries[i],
+		    __ATOMIC_SEQ_CST) != entry ||
+		    entry->start != start ||
+		    strcmp(entry->pattern, pattern) != 0) {
+			continue;
+		}
+
+		memcpy(acc->data, entry->records,
+		    entry->size * sizeof(entry->records[0]));
+		acc->size = entry->size;
+		acc->sorted = entry->sorted;
+		if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&entry->referenced, true,
+			    __ATOMIC_RELAXED);
+		}
+
+		found = true;
+	}
+
+	__atomic_store_n(&thread_state.cache_entry, NULL, __ATOMIC_RELEASE);
+	if (found) {
+		__atomic_store_n(&thread_state.cache_hits,
+		    thread_state.cache_hits + 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(&thread_state.cache_misses,
+		    thread_state.cache_misses + 1, __ATOMIC_RELAXED);
+	}
+
+	return found;
+}
+
+/**
+ * Returns whether any thread's hazard pointer holds `entry`.
+ */
+static bool
+pattern_cache_held(const struct pattern_cache_entry *entry)
+{
+	bool held = false;
+
+	pthread_mutex_lock(&threads.lock);
+	for (const struct thread_state *it = threads.list; it != NULL;
+	     it = it->next) {
+		if (__atomic_load_n(&it->cache_entry, __ATOMIC_SEQ_CST) ==
+		    entry) {
+			held = true;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&threads.lock);
+	return held;
+}
+
+/**
+ * Retires the evicted `victim` (if any), and frees the retired
+ * entries that no reader holds anymore.
+ *
+ * Must be called with `pattern_cache.lock` held.
+ */
+static void
+pattern_cache_retire(struct pattern_cache_entry *victim)
+{
+	struct pattern_cache_entry **link = &pattern_cache.retired;
+
+	if (victim != NULL) {
+		victim->retired = pattern_cache.retired;
+		pattern_cache.retired = victim;
+	}
+
+	while (*link != NULL) {
+		struct pattern_cache_entry *entry = *link;
+
+		if (pattern_cache_held(entry)) {
+			link = &entry->retired;
+			continue;
+		}
+
+		*link = entry->retired;
+		free(entry);
+	}
+
+	return;
+}
+
+/**
+ * Caches the records in `acc` for (`start`, `pattern`), evicting an
+ * entry that wasn't referenced since the hand last passed it, if
+ * necessary.
+ */
+static void
+pattern_cache_put(const int32_t *start, const char *pattern,
+    const struct patch_list *acc)
+{
+	struct pattern_cache_entry *entry;
+	struct pattern_cache_entry *victim;
+	size_t length = strlen(pattern) + 1;
+	size_t records = acc->size * sizeof(acc->data[0]);
+	size_t slot;
+
+	if (acc->size > PATTERN_CACHE_MAX_RECORDS) {
+		return;
+	}
+
+	entry = malloc(sizeof(*entry) + records + length);
+	if (entry == NULL) {
+		return;
+	}
+
+	memcpy(entry->records, acc->data, records);
+	memcpy((char *)entry->records + records, pattern, length);
+	entry->start = start;
+	entry->pattern = (const char *)entry->records + records;
+	entry->size = acc->size;
+	entry->sorted = acc->sorted;
+	entry->referenced = false;
+	entry->retired = NULL;
+
+	pthread_mutex_lock(&pattern_cache.lock);
+	for (;;) {
+		slot = pattern_cache.hand;
+		pattern_cache.hand = (slot + 1) % PATTERN_CACHE_SIZE;
+		victim = pattern_cache.entries[slot];
+		if (victim == NULL ||
+		    !__atomic_exchange_n(&victim->referenced, false,
+		    __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	__atomic_store_n(&pattern_cache.hashes[slot],
+	    pattern_cache_hash(start, pattern), __ATOMIC_RELAXED);
+	__atomic_store_n(&pattern_cache.entries[slot], entry, __ATOMIC_SEQ_CST);
+	pattern_cache_retire(victim);
+	pthread_mutex_unlock(&pattern_cache.lock);
+	return;
+}
+
+/**
+ * Empties the pattern cache, when modules are loaded or unloaded.
+ * Readers are drained then, so no hazard pointer holds any entry.
+ */
+static void
+pattern_cache_flush(void)
+{
+
+	pthread_mutex_lock(&pattern_cache.lock);
+	for (size_t i = 0; i < PATTERN_CACHE_SIZE; i++) {
+		struct pattern_cache_entry *entry = pattern_cache.entries[i];
+
+		__atomic_store_n(&pattern_cache.entries[i], NULL,
+		    __ATOMIC_RELAXED);
+		free(entry);
+	}
+
+	pattern_cache_retire(NULL);
+	assert(pattern_cache.retired == NULL);
+	pthread_mutex_unlock(&pattern_cache.lock);
+	return;
+}
+
+/**
+ * Pushes the records in `names.by_name[begin, end)` whose name matches
+ * `matcher` to `acc`, sorted by hook.  `begin` and `end` must be run
+ * boundaries: each distinct name is only matched once, however many
+ * sites share it.
+ */
+static void
+names_match_range(const struct matcher *matcher, size_t begin, size_t end,
+    struct patch_list *acc)
+{
+
+	for (size_t i = begin, j; i < end; i = j) {
+		j = names.run_end[i];
+		if (!matcher_match(matcher, record_name(names.by_name[i]))) {
+			continue;
+		}
+
+		for (size_t k = i; k < j; k++) {
+			patch_list_push(acc, names.by_name[k]);
+		}
+	}
+
+	qsort(acc->data, acc->size, sizeof(acc->data[0]), cmp_patches);
+	acc->sorted = true;
+	return;
+}
+
+/**
+ * Stores patch records that match `pattern` in `acc`.
+ */
+static int
+find_records(const char *pattern, struct patch_list *acc)
+{
+	struct matcher matcher;
+	size_t n = modules.records;
+	size_t begin, end;
+
+	if (pattern != NULL && pattern_cache_get(NULL, pattern, acc)) {
+		return 0;
+	}
+
+	if (matcher_compile(&matcher, pattern) != 0) {
+		return -1;
+	}
+
+	if (matcher.is_regex) {
+		names_match_range(&matcher, 0, n, acc);
+		matcher_destroy(&matcher);
+		goto out;
+	}
+
+	/* Names with a literal prefix are contiguous in the name index. */
+	begin = names_lower_bound(matcher.literal, matcher.length);
+	end = names_prefix_end(begin, matcher.literal, matcher.length);
+	names_match_range(&matcher, begin, end, acc);
+
+out:
+	if (pattern != NULL) {
+		pattern_cache_put(NULL, pattern, acc);
+	}
+
+	return 0;
+}
+
+/**
+ * Stores patch records of the kind of the
+ * `__{start,stop}_dynamic_flag_${KIND}_list` array that match
+ * `pattern` in `acc`.  With several modules, that's records from the
+ * kind lists of all modules, not only the caller's.
+ */
+static int
+find_records_kind(const int32_t *start, const int32_t *end, const char *pattern,
+    struct patch_list *acc)
+{
+	struct matcher matcher;
+	size_t n = end - start;
+
+	if (pattern != NULL && pattern_cache_get(start, pattern, acc)) {
+		return 0;
+	}
+
+	if (matcher_compile(&matcher, pattern) != 0) {
+		return -1;
+	}
+
+	if ((matcher.is_regex || modules.size > 1) && n > 0) {
+		/*
+		 * All names in the kind share the "kind:" prefix of the
+		 * first record, so they're contiguous in the name index,
+		 * for all modules.
+		 */
+		const struct patch_record *first = relative_pointer(&start[0]);
+		const char *kind = record_name(first);
+		size_t length = strchr(kind, ':') + 1 - kind;
+		size_t begin = names_lower_bound(kind, length);
+
+		names_match_range(&matcher, begin,
+		    names_prefix_end(begin, kind, length), acc);
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			const struct patch_record *record =
+			    relative_pointer(&start[i]);
+
+			if (matcher_match(&matcher, record_name(record))) {
+				patch_list_push(acc, record);
+			}
+		}
+
+		acc->sorted = presorted;
+	}
+
+	matcher_destroy(&matcher);
+	if (pattern != NULL) {
+		pattern_cache_put(start, pattern, acc);
+	}
+
+	return 0;
+}
+
+/**
+ * Returns the name index slot for `key[0 ... length)`, or, if there is
+ * none, the empty slot where it would go.
+ */
+static struct name_slot *
+names_probe(const char *key, size_t length)
+{
+	uint64_t hash = hash_name(key, length);
+	size_t mask = names.capacity - 1;
+
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		struct name_slot *slot = &names.slots[i];
+
+		if (slot->key == NULL) {
+			return slot;
+		}
+
+		if (slot->hash == hash && slot->length == length &&
+		    memcmp(slot->key, key, length) == 0) {
+			return slot;
+		}
+	}
+}
+
+static void
+names_insert(const char *key, size_t length, size_t begin, size_t end)
+{
+	struct name_slot *slot = names_probe(key, length);
+
+	assert(slot->key == NULL && "Name ranges must be unique.");
+	*slot = (struct name_slot) {
+		.hash = hash_name(key, length),
+		.key = key,
+		.length = length,
+		.begin = begin,
+		.end = end,
+	};
+
+	return;
+}
+
+/**
+ * Returns the length of the `kind:name` prefix of a record's name.
+ */
+static size_t
+short_name_length(const struct patch_record *record)
+{
+	const char *at = strchr(record_name(record), '@');
+
+	return (at == NULL) ? strlen(record_name(record)) : (size_t)(at - record_name(record));
+}
+
+static int
+cmp_patches_name(const void *x, const void *y)
+{
+	const struct patch_record *const *a = x;
+	const struct patch_record *const *b = y;
+	int r;
+
+	r = strcmp(record_name((*a)), record_name((*b)));
+	if (r != 0) {
+		return r;
+	}
+
+	if (record_hook((*a)) == record_hook((*b))) {
+		return 0;
+	}
+
+	return (record_hook((*a)) < record_hook((*b))) ? -1 : 1;
+}
+
+/**
+ * Builds the name index: sorts all records by name, and maps each
+ * full name and each `kind:name` prefix to its range of records.
+ *
+ * Records with the same `kind:name` prefix are contiguous once
+ * sorted by full name, since they all start with `kind:name@`.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+names_init(void)
+{
+	size_t n = modules.records;
+	size_t capacity = 16;
+
+	names.by_name = calloc(n + 1, sizeof(*names.by_name));
+	names.run_end = calloc(n + 1, sizeof(*names.run_end));
+	assert(names.by_name != NULL && names.run_end != NULL);
+	for (size_t i = 0; i < modules.size; i++) {
+		const struct module *module = &modules.data[i];
+
+		for (size_t j = 0; j < (size_t)(module->end - module->start);
+		     j++) {
+			names.by_name[module->base + j] = &module->start[j];
+		}
+	}
+
+	qsort(names.by_name, n, sizeof(*names.by_name), cmp_patches_name);
+
+	/* At most 2 keys per record, with a load factor <= 1/2. */
+	while (capacity < 4 * n) {
+		capacity *= 2;
+	}
+
+	names.slots = calloc(capacity, sizeof(*names.slots));
+	assert(names.slots != NULL);
+	names.capacity = capacity;
+
+	for (size_t i = 0, j; i < n; i = j) {
+		const char *name = record_name(names.by_name[i]);
+
+		for (j = i + 1; j < n; j++) {
+			if (strcmp(record_name(names.by_name[j]), name) != 0) {
+				break;
+			}
+		}
+
+		names.run_end[i] = j;
+		names_insert(name, strlen(name), i, j);
+	}
+
+	for (size_t i = 0, j; i < n; i = j) {
+		const char *name = record_name(names.by_name[i]);
+		size_t length = short_name_length(names.by_name[i]);
+
+		for (j = i + 1; j < n; j++) {
+			const struct patch_record *other = names.by_name[j];
+
+			if (short_name_length(other) != length ||
+			    memcmp(record_name(other), name, length) != 0) {
+				break;
+			}
+		}
+
+		names_insert(name, length, i, j);
+	}
+
+	__atomic_store_n(&names.ready, true, __ATOMIC_RELEASE);
+	return;
+}
+
+/**
+ * Returns the name index slot for `name`, a full flag name or a
+ * `kind:name` prefix, or NULL if no flag has that name.
+ */
+static const struct name_slot *
+names_find(const char *name)
+{
+	const struct name_slot *slot;
+
+	if (__atomic_load_n(&names.ready, __ATOMIC_ACQUIRE) == false) {
+		dynamic_flag_init_lib();
+	}
+
+	slot = names_probe(name, strlen(name));
+	return (slot->key == NULL) ? NULL : slot;
+}
+
+/**
+ * Returns the index of the first record in `names.by_name` whose name
+ * compares greater than or equal to `prefix[0 ... length)`.
+ */
+static size_t
+names_lower_bound(const char *prefix, size_t length)
+{
+	size_t lo = 0;
+	size_t hi = modules.records;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (strncmp(record_name(names.by_name[mid]), prefix, length) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/**
+ * Returns the end of the run of records from `names.by_name[begin]`
+ * whose names start with `prefix[0 ... length)`.  `begin` must be a
+ * run boundary.
+ */
+static size_t
+names_prefix_end(size_t begin, const char *prefix, size_t length)
+{
+	size_t end;
+
+	for (end = begin; end < modules.records; end = names.run_end[end]) {
+		if (strncmp(record_name(names.by_name[end]), prefix,
+		    length) != 0) {
+			break;
+		}
+	}
+
+	return end;
+}
+
+/**
+ * Stores the patch records named `name` in `acc`.
+ */
+static void
+find_records_exact(const char *name, struct patch_list *acc)
+{
+	const struct name_slot *slot = names_find(name);
+
+	if (slot == NULL) {
+		return;
+	}
+
+	for (size_t i = slot->begin; i < slot->end; i++) {
+		patch_list_push(acc, names.by_name[i]);
+	}
+
+	return;
+}
+
+/**
+ * Compares `patch_record`s by `hook` address.
+ */
+static int
+cmp_patches(const void *x, const void *y)
+{
+	const struct patch_record *const *a = x;
+	const struct patch_record *const *b = y;
+
+	if (record_hook((*a)) == record_hook((*b))) {
+		return 0;
+	}
+
+	return (record_hook((*a)) < record_hook((*b))) ? -1 : 1;
+}
+
+/**
+ * Sorts `records` by hook address, unless they're already sorted
+ * (e.g., collected in section order from sections that
+ * `dynamic_flag_sort` sorted).
+ */
+static void
+sort_records(struct patch_list *records)
+{
+
+	if (records->sorted) {
+		return;
+	}
+
+	qsort(records->data, records->size,
+	    sizeof(struct patch_record *), cmp_patches);
+	records->sorted = true;
+	return;
+}
+
+/**
+ * Initializes the flags' states.
+ *
+ * Hooks are assembled in their DEFAULT state, which usually matches
+ * the INITIAL state: we only patch the hooks listed in each module's
+ * `dynamic_flag_init`, and leave the other pages untouched.
+ */
+static void
+init_all(void)
+{
+	struct patch_list *acc;
+
+	acc = patch_list_create();
+	for (size_t i = 0; i < modules.size; i++) {
+		const struct module *module = &modules.data[i];
+
+		for (const struct patch_record *record = module->start;
+		     record < module->end; record++) {
+			module->counts[record - module->start].activation =
+			    initial_activation(record);
+		}
+
+		for (const int32_t *it = module->init_start;
+		     it < module->init_end; it++) {
+			patch_list_push(acc, relative_pointer(it));
+		}
+	}
+
+	acc->sorted = presorted;
+	sort_records(acc);
+	if (amortize(acc, initial_patch) != 0) {
+		resync(acc);
+	}
+
+	patch_list_destroy(acc);
+	return;
+}
+
+/**
+ * Pushes `record` to `to_patch`, or, if we're in a transaction, to
+ * the transaction's pending list (at most once).
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+defer_or_push(struct patch_list *to_patch, const struct patch_record *record)
+{
+	struct patch_count *count = record_count(record);
+
+	if (txn.pending == NULL) {
+		patch_list_push(to_patch, record);
+		return;
+	}
+
+	if (count->pending == false) {
+		count->pending = true;
+		patch_list_push(txn.pending, record);
+	}
+
+	return;
+}
+
+/**
+ * Switches a flag to the state that matches its activation count.
+ */
+static void
+reconcile(const struct patch_record *record)
+{
+	struct patch_count *count = record_count(record);
+
+	count->deadline = 0;
+	if (record->type == PATCH_RECORD_SWITCH) {
+		switch_apply(record);
+	} else if (record->type == PATCH_RECORD_CALL) {
+		call_apply(record);
+	} else if (count->activation > 0) {
+		activate(record);
+	} else {
+		deactivate(record);
+	}
+
+	return;
+}
+
+/**
+ * Returns the state for the kind whose list starts at `start`, or
+ * NULL if there is none yet.  Kinds are identified by name, since
+ * each module has its own list for the same kind.
+ */
+static struct kind_state *
+kind_find(const int32_t *start)
+{
+	const char *name = record_name(relative_pointer(start));
+
+	for (struct kind_state *kind = __atomic_load_n(&kinds, __ATOMIC_ACQUIRE);
+	     kind != NULL; kind = kind->next) {
+		if (strncmp(name, kind->prefix, kind->length) == 0) {
+			return kind;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the state for the kind of the list [`start`, `end`), and
+ * creates it if necessary.
+ *
+ * Must be called with the patch lock held.
+ */
+static struct kind_state *
+kind_get(const int32_t *start, const int32_t *end)
+{
+	struct kind_state *kind;
+	const char *name;
+
+	kind = kind_find(start);
+	if (kind != NULL) {
+		return kind;
+	}
+
+	name = record_name(relative_pointer(start));
+	kind = calloc(1, sizeof(*kind));
+	assert(kind != NULL);
+	kind->length = strchr(name, ':') + 1 - name;
+	/* The module that holds `name` may be unloaded. */
+	kind->prefix = strndup(name, kind->length);
+	assert(kind->prefix != NULL);
+	kind->records = patch_list_create_capacity(modules.records);
+	find_records_kind(start, end, NULL, kind->records);
+	kind->next = kinds;
+	__atomic_store_n(&kinds, kind, __ATOMIC_RELEASE);
+	return kind;
+}
+
+/**
+ * Sets the back pointer of all flags in `kind` to `value`.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+kind_set_refs(struct kind_state *kind, struct kind_state *value)
+{
+
+	for (size_t i = 0; i < kind->records->size; i++) {
+		const struct patch_record *record = kind->records->data[i];
+
+		if (record->type == PATCH_RECORD_FLAG) {
+			struct patch_count *count = record_count(record);
+
+			__atomic_store_n(&count->kind, value,
+			    __ATOMIC_RELEASE);
+		}
+	}
+
+	return;
+}
+
+/**
+ * Folds the pending activations of `kind` into the count of each of
+ * its flags, and disengages the kind.  The rule log only sees these
+ * activations now: they never brought a flag count to zero, so they
+ * commute with everything logged since the kind was engaged.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+kind_materialise(struct kind_state *kind)
+{
+	uint64_t pending;
+
+	pending = __atomic_exchange_n(&kind->count, 0, __ATOMIC_ACQ_REL);
+	if (pending > 1) {
+		rules_push(RULE_ACTIVATE, pending - 1, kind->prefix, NULL);
+	}
+
+	for (size_t i = 0; i < kind->records->size; i++) {
+		const struct patch_record *record = kind->records->data[i];
+
+		if (record->type == PATCH_RECORD_FLAG && pending > 1) {
+			__atomic_fetch_add(&record_count(record)->activation,
+			    pending - 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	kind_set_refs(kind, NULL);
+	return;
+}
+
+/**
+ * Returns the number of activations that `kind` (may be NULL) holds
+ * on behalf of its flags, in addition to the one in their own count.
+ */
+static uint64_t
+kind_pending(const struct kind_state *kind)
+{
+	uint64_t count;
+
+	if (kind == NULL) {
+		return 0;
+	}
+
+	count = __atomic_load_n(&kind->count, __ATOMIC_RELAXED);
+	return (count > 1) ? count - 1 : 0;
+}
+
+/**
+ * Increments the activation count of a flag without taking the patch
+ * lock, if the flag is unhooked or already active.
+ *
+ * Returns false if the flag may have to be patched: the caller must
+ * then retry with the patch lock held.
+ *
+ * When the patch lock is held, an activation count only goes from 0
+ * to 1 once the flag is active, and from 1 to 0 before the flag is
+ * deactivated, so a positive count always means active code (outside
+ * transactions).
+ */
+static bool
+activate_fast(const struct patch_record *record)
+{
+	struct patch_count *count = record_count(record);
+	uint64_t activation;
+
+	if (__atomic_load_n(&count->unhook, __ATOMIC_RELAXED) > 0) {
+		return true;
+	}
+
+	activation = __atomic_load_n(&count->activation, __ATOMIC_ACQUIRE);
+	do {
+		if (activation == 0) {
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&count->activation,
+	    &activation, activation + 1, true,
+	    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	fast_updates_note();
+	return true;
+}
+
+/**
+ * Decrements the activation count of a flag without taking the patch
+ * lock, unless the decrement would deactivate the flag; see
+ * `activate_fast`.
+ */
+static bool
+deactivate_fast(const struct patch_record *record)
+{
+	struct patch_count *count = record_count(record);
+	uint64_t activation;
+
+	activation = __atomic_load_n(&count->activation, __ATOMIC_RELAXED);
+	do {
+		/* Counts saturate at 0. */
+		if (activation == 0) {
+			return true;
+		}
+
+		if (activation == 1) {
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&count->activation,
+	    &activation, activation - 1, true,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	fast_updates_note();
+	return true;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Counts one deactivation for `grace` (at most one per call to
+ * `deactivate_locked`), and adapts its grace period to the rate of
+ * deactivations.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+grace_note_flip(struct grace_policy *grace, uint64_t now)
+{
+	uint64_t limit, elapsed;
+
+	if (grace->generation == linger.generation) {
+		return;
+	}
+
+	grace->generation = linger.generation;
+	if (adaptive_grace.threshold == 0) {
+		grace->current = grace->base;
+		return;
+	}
+
+	elapsed = (now - grace->window_start) / NSEC_PER_SEC;
+	if (elapsed > 0) {
+		/* Seconds after the last window had no deactivation. */
+		if (grace->window_flips > adaptive_grace.threshold / 2) {
+			elapsed--;
+		}
+
+		grace->current = (elapsed < 64) ? grace->current >> elapsed : 0;
+		if (grace->current < grace->base) {
+			grace->current = grace->base;
+		}
+
+		grace->window_start = now;
+		grace->window_flips = 0;
+	}
+
+	if (++grace->window_flips <= adaptive_grace.threshold) {
+		return;
+	}
+
+	limit = (adaptive_grace.max > grace->base) ?
+	    adaptive_grace.max : grace->base;
+	grace->current = (grace->current > limit / 2) ?
+	    limit : 2 * grace->current;
+	grace->window_start = now;
+	grace->window_flips = 0;
+	return;
+}
+
+/**
+ * Leaves `record`, whose count just dropped to zero, active until its
+ * grace period expires.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+linger_push(const struct patch_record *record, uint64_t now)
+{
+	struct patch_count *count = record_count(record);
+
+	grace_note_flip(count->grace, now);
+	count->deadline = now + count->grace->current;
+	if (count->deadline < linger.next_deadline) {
+		linger.next_deadline = count->deadline;
+	}
+
+	if (count->lingering == false) {
+		count->lingering = true;
+		patch_list_push(linger.records, record);
+	}
+
+	return;
+}
+
+/**
+ * Deactivates flags whose grace period expired before `now`.
+ *
+ * Must be called with the patch lock held.
+ *
+ * Returns the number of deactivated flags, or -1 on failure.
+ */
+static ssize_t
+linger_sweep(uint64_t now)
+{
+	struct patch_list *records = linger.records;
+	struct patch_list *expired = linger.expired;
+	size_t kept = 0;
+	ssize_t r;
+
+	if (records == NULL || now < linger.next_deadline ||
+	    txn.pending != NULL) {
+		return 0;
+	}
+
+	expired->size = 0;
+	expired->sorted = false;
+	linger.next_deadline = UINT64_MAX;
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+		struct patch_count *count = record_count(record);
+
+		if (count->deadline == 0 || count->deadline <= now) {
+			if (count->deadline != 0) {
+				patch_list_push(expired, record);
+			}
+
+			count->deadline = 0;
+			count->lingering = false;
+			continue;
+		}
+
+		if (count->deadline < linger.next_deadline) {
+			linger.next_deadline = count->deadline;
+		}
+
+		records->data[kept++] = record;
+	}
+
+	records->size = kept;
+	sort_records(expired);
+	r = expired->size;
+	if (amortize(expired, deactivate) != 0) {
+		resync(expired);
+		r = -1;
+	}
+
+	return r;
+}
+
+/**
+ * Sweeps expired grace periods if any flag is lingering.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+linger_poll(void)
+{
+
+	if (linger.records != NULL && linger.records->size > 0) {
+		linger_sweep(now_ns());
+	}
+
+	return;
+}
+
+/**
+ * Sets the grace period of `grace` to `grace_ns`, and attaches the
+ * flags in `records` to `grace` (or detaches them, for a zero period).
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+grace_policy_set(struct grace_policy *grace,
+    const struct patch_list *records, uint64_t grace_ns)
+{
+
+	if (grace_ns > 0 && linger.records == NULL) {
+		linger.records = patch_list_create();
+		linger.expired = patch_list_create();
+	}
+
+	grace->base = grace_ns;
+	grace->current = grace_ns;
+	grace->window_flips = 0;
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+		struct patch_count *count = record_count(record);
+
+		if (record->type != PATCH_RECORD_FLAG) {
+			continue;
+		}
+
+		if (grace_ns > 0) {
+			count->grace = grace;
+		} else if (count->grace == grace) {
+			count->grace = NULL;
+			/* Expire any pending grace period right away. */
+			if (count->deadline != 0) {
+				count->deadline = 1;
+				linger.next_deadline = 1;
+			}
+		}
+	}
+
+	return;
+}
+
+/**
+ * Increments the count of the flags in `to_patch` that
+ * `activate_fast` couldn't, and leaves in `to_patch` the flags that
+ * must be patched (and then passed to `activate_publish`).
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+activate_prepare(struct patch_list *to_patch)
+{
+	size_t n;
+
+	/* Filter the remaining records in place. */
+	n = to_patch->size;
+	to_patch->size = 0;
+	for (size_t i = 0; i < n; i++) {
+		const struct patch_record *record = to_patch->data[i];
+		struct patch_count *count = record_count(record);
+		uint64_t *activation = &count->activation;
+
+		if (count->unhook > 0) {
+			continue;
+		}
+
+		/*
+		 * Outside transactions, counts stay at 0 until the flag
+		 * is patched.
+		 */
+		if (txn.pending == NULL &&
+		    __atomic_load_n(activation, __ATOMIC_RELAXED) == 0) {
+			/* Still active in its grace period. */
+			if (count->deadline != 0) {
+				count->deadline = 0;
+				__atomic_store_n(activation, 1,
+				    __ATOMIC_RELEASE);
+				continue;
+			}
+
+			patch_list_push(to_patch, record);
+		} else if (__atomic_fetch_add(activation, 1,
+		    __ATOMIC_RELAXED) == 0) {
+			count->deadline = 0;
+			defer_or_push(to_patch, record);
+		}
+	}
+
+	return;
+}
+
+/**
+ * Sets the count of the flags that `activate_prepare` left in
+ * `patched` to 1, once they're active.
+ */
+static void
+activate_publish(const struct patch_list *patched)
+{
+
+	for (size_t i = 0; i < patched->size; i++) {
+		struct patch_count *count = record_count(patched->data[i]);
+
+		__atomic_store_n(&count->activation, 1,
+		    __ATOMIC_RELEASE);
+	}
+
+	return;
+}
+
+/**
+ * Activates the flags in `to_patch` that `activate_fast` couldn't,
+ * and leaves in `to_patch` the flags that had to be patched.
+ *
+ * Must be called with the patch lock held.
+ */
+static ssize_t
+activate_locked(struct patch_list *to_patch)
+{
+	ssize_t to_patch_count;
+
+	activate_prepare(to_patch);
+	to_patch_count = to_patch->size;
+	if (amortize(to_patch, activate) != 0) {
+		/* Sets the count of flags that were patched to 1. */
+		resync(to_patch);
+		to_patch_count = -1;
+	} else {
+		activate_publish(to_patch);
+	}
+
+	linger_poll();
+	return to_patch_count;
+}
+
+/**
+ * Increments by one the activation count of all flags in `records`,
+ * which must be sorted, and patches the flags that became active.
+ *
+ * `records` may be shared with other threads (e.g., a group's), so
+ * the flags that need the patch lock go to a list of our own.
+ *
+ * Logs the operation in the rule log if `log` is non-NULL: under the
+ * patch lock, after the counts it updated, if it took the lock, and
+ * in its interned target otherwise.
+ */
+static ssize_t
+activate_list(const struct patch_list *records, const struct rule_log *log)
+{
+	struct patch_list *to_patch;
+	ssize_t to_patch_count;
+
+	to_patch = patch_list_create();
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+
+		if (record->type == PATCH_RECORD_FLAG &&
+		    !activate_fast(record)) {
+			patch_list_push(to_patch, record);
+		}
+	}
+
+	if (to_patch->size == 0) {
+		patch_list_destroy(to_patch);
+		if (log != NULL) {
+			rules_note(true, log->kind, log->pattern);
+		}
+
+		return 0;
+	}
+
+	lock();
+	to_patch_count = activate_locked(to_patch);
+	if (to_patch_count >= 0 && log != NULL) {
+		rules_push(RULE_ACTIVATE, 1, log->kind, log->pattern);
+	}
+
+	unlock();
+	patch_list_destroy(to_patch);
+	return to_patch_count;
+}
+
+/**
+ * Increments by one the activation count of all flags in `records`,
+ * and logs the operation if `log` is non-NULL, like `activate_list`.
+ */
+static ssize_t
+activate_all(struct patch_list *records, const struct rule_log *log)
+{
+
+	sort_records(records);
+	return activate_list(records, log);
+}
+
+/**
+ * Decrements the count of the flags in `to_patch` that
+ * `deactivate_fast` couldn't, and leaves in `to_patch` the flags that
+ * must be patched.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+deactivate_prepare(struct patch_list *to_patch)
+{
+	uint64_t now = 0;
+	size_t n;
+
+	linger.generation++;
+	n = to_patch->size;
+	to_patch->size = 0;
+	for (size_t i = 0; i < n; i++) {
+		const struct patch_record *record = to_patch->data[i];
+		struct patch_count *count = record_count(record);
+		uint64_t *activation = &count->activation;
+		uint64_t current;
+
+		if (count->kind != NULL) {
+			kind_materialise(count->kind);
+		}
+
+		/* `activate_fast` may still increment positive counts. */
+		current = __atomic_load_n(activation, __ATOMIC_RELAXED);
+		do {
+			if (current == 0) {
+				break;
+			}
+		} while (!__atomic_compare_exchange_n(activation, &current,
+		    current - 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+		if (current != 1) {
+			continue;
+		}
+
+		if (count->grace != NULL && txn.pending == NULL) {
+			if (now == 0) {
+				now = now_ns();
+			}
+
+			linger_push(record, now);
+			continue;
+		}
+
+		defer_or_push(to_patch, record);
+	}
+
+	return;
+}
+
+/**
+ * Deactivates the flags in `to_patch` that `deactivate_fast`
+ * couldn't, like `activate_locked`.
+ *
+ * Must be called with the patch lock held.
+ */
+static ssize_t
+deactivate_locked(struct patch_list *to_patch)
+{
+	ssize_t to_patch_count;
+
+	deactivate_prepare(to_patch);
+	to_patch_count = to_patch->size;
+	if (amortize(to_patch, deactivate) != 0) {
+		resync(to_patch);
+		to_patch_count = -1;
+	}
+
+	linger_poll();
+	return to_patch_count;
+}
+
+/**
+ * Decrements by one the activation count of all flags in `records`,
+ * like `activate_list`.
+ */
+static ssize_t
+deactivate_list(const struct patch_list *records, const struct rule_log *log)
+{
+	struct patch_list *to_patch;
+	ssize_t to_patch_count;
+
+	to_patch = patch_list_create();
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+
+		if (record->type == PATCH_RECORD_FLAG &&
+		    !deactivate_fast(record)) {
+			patch_list_push(to_patch, record);
+		}
+	}
+
+	if (to_patch->size == 0) {
+		patch_list_destroy(to_patch);
+		if (log != NULL) {
+			rules_note(false, log->kind, log->pattern);
+		}
+
+		return 0;
+	}
+
+	lock();
+	to_patch_count = deactivate_locked(to_patch);
+	if (to_patch_count >= 0 && log != NULL) {
+		rules_push(RULE_DEACTIVATE, 1, log->kind, log->pattern);
+	}
+
+	unlock();
+	patch_list_destroy(to_patch);
+	return to_patch_count;
+}
+
+/**
+ * Decrements by one the activation count of all flags in `records`,
+ * and logs the operation if `log` is non-NULL, like `activate_list`.
+ */
+static ssize_t
+deactivate_all(struct patch_list *records, const struct rule_log *log)
+{
+
+	sort_records(records);
+	return deactivate_list(records, log);
+}
+
+/**
+ * Increments the count of an engaged kind without taking the patch
+ * lock.  Returns false if the kind isn't engaged.
+ */
+static bool
+kind_activate_fast(struct kind_state *kind)
+{
+	uint64_t count;
+
+	count = __atomic_load_n(&kind->count, __ATOMIC_ACQUIRE);
+	do {
+		if (count == 0) {
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&kind->count, &count,
+	    count + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	fast_updates_note();
+	return true;
+}
+
+/**
+ * Decrements the count of an engaged kind without taking the patch
+ * lock.  Returns false if the kind isn't engaged, or if the decrement
+ * would disengage it.
+ */
+static bool
+kind_deactivate_fast(struct kind_state *kind)
+{
+	uint64_t count;
+
+	count = __atomic_load_n(&kind->count, __ATOMIC_RELAXED);
+	do {
+		if (count < 2) {
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&kind->count, &count,
+	    count - 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	fast_updates_note();
+	return true;
+}
+
+/**
+ * Activates all flags in the kind list [`start`, `end`).  Only the
+ * first of nested activations updates each flag, and is logged in the
+ * rule log; `kind_materialise` logs the others.
+ */
+static ssize_t
+activate_kind_all(const int32_t *start, const int32_t *end)
+{
+	struct kind_state *kind = kind_find(start);
+	struct patch_list *records;
+	struct patch_list *to_patch;
+	bool engage = true;
+	ssize_t r;
+
+	if (kind != NULL && kind_activate_fast(kind)) {
+		return kind->records->size;
+	}
+
+	records = patch_list_create();
+	find_records_kind(start, end, NULL, records);
+	r = records->size;
+	sort_records(records);
+	to_patch = patch_list_create();
+
+	lock();
+	kind = kind_get(start, end);
+	if (kind_activate_fast(kind)) {
+		goto out;
+	}
+
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+		struct patch_count *count = record_count(record);
+
+		if (record->type != PATCH_RECORD_FLAG) {
+			continue;
+		}
+
+		/* Unhooked flags must skip activations: go one at a time. */
+		if (count->unhook > 0) {
+			engage = false;
+		}
+
+		if (!activate_fast(record)) {
+			patch_list_push(to_patch, record);
+		}
+	}
+
+	if (activate_locked(to_patch) < 0) {
+		r = -1;
+		goto out;
+	}
+
+	if (engage) {
+		kind_set_refs(kind, kind);
+		__atomic_store_n(&kind->count, 1, __ATOMIC_RELEASE);
+	}
+
+	rules_push(RULE_ACTIVATE, 1, kind->prefix, NULL);
+
+out:
+	unlock();
+	patch_list_destroy(to_patch);
+	patch_list_destroy(records);
+	return r;
+}
+
+/**
+ * Deactivates all flags in the kind list [`start`, `end`).
+ */
+static ssize_t
+deactivate_kind_all(const int32_t *start, const int32_t *end)
+{
+	struct kind_state *kind = kind_find(start);
+	struct patch_list *records;
+	struct patch_list *to_patch;
+	ssize_t r;
+
+	if (kind != NULL && kind_deactivate_fast(kind)) {
+		return kind->records->size;
+	}
+
+	records = patch_list_create();
+	find_records_kind(start, end, NULL, records);
+	r = records->size;
+	sort_records(records);
+	to_patch = patch_list_create();
+
+	lock();
+	kind = kind_find(start);
+	if (kind != NULL) {
+		uint64_t count;
+
+		count = __atomic_load_n(&kind->count, __ATOMIC_RELAXED);
+		do {
+			if (count == 0) {
+				break;
+			}
+		} while (!__atomic_compare_exchange_n(&kind->count, &count,
+		    count - 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+		if (count > 1) {
+			goto out;
+		}
+
+		/* Disengaged: drop the kind's activation from each flag. */
+		if (count == 1) {
+			kind_set_refs(kind, NULL);
+		}
+	}
+
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+
+		if (record->type == PATCH_RECORD_FLAG &&
+		    !deactivate_fast(record)) {
+			patch_list_push(to_patch, record);
+		}
+	}
+
+	if (deactivate_locked(to_patch) < 0) {
+		r = -1;
+		goto out;
+	}
+
+	rules_push(RULE_DEACTIVATE, 1, record_name(relative_pointer(start)),
+	    NULL);
+
+out:
+	unlock();
+	patch_list_destroy(to_patch);
+	patch_list_destroy(records);
+	return r;
+}
+
+/**
+ * Selects case `which` for all DF_SWITCH records in `records` with
+ * more than `which` cases.  Unhooked switches only accept case 0.
+ *
+ * Returns the number of switches with more than `which` cases, or
+ * -1 if we failed to patch some of them.
+ */
+static ssize_t
+select_all(struct patch_list *records, size_t which)
+{
+	struct patch_list *to_patch;
+	ssize_t matched = 0;
+
+	sort_records(records);
+
+	to_patch = patch_list_create();
+	lock();
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+		struct patch_count *count = record_count(record);
+
+		if (record->type != PATCH_RECORD_SWITCH ||
+		    which >= record->cases) {
+			continue;
+		}
+
+		matched++;
+		if ((which != 0 && count->unhook > 0) ||
+		    count->activation == which) {
+			continue;
+		}
+
+		count->activation = which;
+		defer_or_push(to_patch, record);
+	}
+
+	if (amortize(to_patch, switch_apply) != 0) {
+		resync(to_patch);
+		matched = -1;
+	}
+
+	unlock();
+
+	patch_list_destroy(to_patch);
+	return matched;
+}
+
+/**
+ * Retargets all DF_CALL records in `records` to `fn`, or to their
+ * default callee if `fn` is NULL.  Unhooked call sites only accept
+ * their default.
+ *
+ * Returns the number of DF_CALL records in `records`, or -1 if `fn`
+ * is out of range for some of them, or if we failed to patch some.
+ */
+static ssize_t
+set_call_all(struct patch_list *records, void *fn)
+{
+	struct patch_list *to_patch;
+	ssize_t matched = 0;
+
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+
+		if (record->type == PATCH_RECORD_CALL && fn != NULL &&
+		    call_in_range(record, fn) == false) {
+			return -1;
+		}
+	}
+
+	sort_records(records);
+
+	to_patch = patch_list_create();
+	lock();
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+		struct patch_count *count = record_count(record);
+		uint64_t target;
+
+		if (record->type != PATCH_RECORD_CALL) {
+			continue;
+		}
+
+		matched++;
+		target = (fn == call_default(record)) ? 0 : (uintptr_t)fn;
+		if ((target != 0 && count->unhook > 0) ||
+		    count->activation == target) {
+			continue;
+		}
+
+		count->activation = target;
+		defer_or_push(to_patch, record);
+	}
+
+	if (amortize(to_patch, call_apply) != 0) {
+		resync(to_patch);
+		matched = -1;
+	}
+
+	unlock();
+
+	patch_list_destroy(to_patch);
+	return matched;
+}
+
+/**
+ * Decrements by one the unhook count of all flags in `records`, which
+ * match `regex`.
+ */
+static size_t
+rehook_all(struct patch_list *records, const char *regex)
+{
+
+	lock();
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+		struct patch_count *count = record_count(record);
+
+		if (count->unhook > 0) {
+			__atomic_fetch_sub(&count->unhook, 1,
+			    __ATOMIC_RELAXED);
+		}
+	}
+
+	rules_push(RULE_REHOOK, 1, NULL, regex);
+	unlock();
+
+	return records->size;
+}
+
+/**
+ * Increments by one the unhook count of all flags in `records`, which
+ * match `regex`.
+ */
+static size_t
+unhook_all(struct patch_list *records, const char *regex)
+{
+
+	lock();
+	for (size_t i = 0; i < records->size; i++) {
+		const struct patch_record *record = records->data[i];
+		struct patch_count *count = record_count(record);
+
+		if (count->kind != NULL) {
+			kind_materialise(count->kind);
+		}
+
+		__atomic_fetch_add(&count->unhook, 1,
+		    __ATOMIC_RELAXED);
+	}
+
+	rules_push(RULE_UNHOOK, 1, NULL, regex);
+	unlock();
+
+	return records->size;
+}
+
+/**
+ * The net effect of a sequence of activations and deactivations on
+ * one flag.  Counts saturate at zero, so the sequence maps a count
+ * `c` to `max(c + delta, floor)`, or to `max(c - downs, 0)` if the
+ * flag is unhooked and skips activations.
+ *
+ * Unhook counts fold the same way, with unhooks as activations and
+ * rehooks as deactivations; nothing skips them.
+ */
+struct count_fold {
+	int64_t delta;
+	int64_t floor;
+	uint64_t downs;
+};
+
+/**
+ * Appends `n` activations (if `up`) or deactivations to `fold`.
+ */
+static void
+count_fold_push(struct count_fold *fold, bool up, uint64_t n)
+{
+
+	if (up) {
+		fold->delta += n;
+		fold->floor += n;
+		return;
+	}
+
+	fold->delta -= n;
+	fold->downs += n;
+	fold->floor = (fold->floor > (int64_t)n) ? fold->floor - (int64_t)n : 0;
+	return;
+}
+
+/**
+ * Returns the count that `fold` yields for a flag with count
+ * `current`, which skips activations if `unhooked`.
+ */
+static uint64_t
+count_fold_apply(const struct count_fold *fold, bool unhooked,
+    uint64_t current)
+{
+	int64_t target;
+
+	if (unhooked) {
+		return (current > fold->downs) ? current - fold->downs : 0;
+	}
+
+	target = (int64_t)current + fold->delta;
+	return (target > fold->floor) ? (uint64_t)target : (uint64_t)fold->floor;
+}
+
+/**
+ * Returns whether applying `a` then `b` to a hooked flag's count has
+ * the same effect as `b` then `a`.  (Unhooked flags only see
+ * decrements, which always commute.)
+ */
+static bool
+count_fold_commutes(const struct count_fold *a, const struct count_fold *b)
+{
+	int64_t base = a->delta + b->delta;
+	int64_t ab = a->floor + b->delta;
+	int64_t ba = b->floor + a->delta;
+
+	/* `a` then `b` maps `c` to `max(c + base, ab)`, and vice versa. */
+	ab = (ab > b->floor) ? ab : b->floor;
+	ba = (ba > a->floor) ? ba : a->floor;
+	return ((ab > base) ? ab : base) == ((ba > base) ? ba : base);
+}
+
+/* Whether `fold` only decrements, and ignores unhooks. */
+static bool
+count_fold_only_down(const struct count_fold *fold)
+{
+
+	return fold->delta + (int64_t)fold->downs == 0;
+}
+
+/* Buckets of the rule target table. */
+#define RULE_TARGET_BUCKETS 256
+
+/* Maximum number of interned rule targets. */
+#define RULE_TARGETS_MAX 1024
+
+/**
+ * The flags that logged operations apply to: those that match
+ * `matcher`, in the kind `kind` ("KIND:") or, if `kind` is NULL, in
+ * all kinds.  All names it matches start with `prefix[0 ... length)`.
+ *
+ * Targets are interned in `rule_targets`, so that repeated operations
+ * on a target neither allocate nor recompile its pattern.  Like a
+ * kind's count (see `kind_materialise`), `ups` and `downs` count the
+ * lock-free activations and deactivations of an interned target that
+ * the rule log doesn't have yet.  Targets created once the table is
+ * full are private to their log entries, and freed with the last;
+ * their lock-free operations take the patch lock to log themselves.
+ */
+struct rule_target {
+	struct rule_target *next;
+	uint64_t hash;
+	char *kind;
+	size_t kind_length;
+	/* Owns the pattern that `matcher` points into. */
+	char *pattern;
+	struct matcher matcher;
+	const char *prefix;
+	size_t length;
+	/* Whether the kind and the pattern can't match the same name. */
+	bool empty;
+	bool interned;
+	/* Number of rule log entries for this target. */
+	size_t entries;
+	uint64_t ups;
+	uint64_t downs;
+};
+
+/**
+ * Interned rule targets, by hash.  Lookups are lock-free, and insert
+ * with a compare-and-swap on their bucket; only
+ * `dynamic_flag_poll_modules` unlinks targets, once it drained flag
+ * operations.  `pending` is set whenever some target has `ups` or
+ * `downs`.
+ */
+static struct {
+	struct rule_target *buckets[RULE_TARGET_BUCKETS];
+	size_t size;
+	bool pending;
+} rule_targets;
+
+/**
+ * The net effect of consecutive operations on the flags of `target`:
+ * on their unhook counts if `hook`, and on their activation counts
+ * otherwise.
+ */
+struct rule {
+	bool hook;
+	struct count_fold fold;
+	struct rule_target *target;
+};
+
+/**
+ * The rule log: successful activations, deactivations, unhooks and
+ * rehooks by pattern, in order, so that we can give modules loaded
+ * later the state they'd have if they had been loaded from the start.
+ *
+ * `rules_append` compacts the log by target (kind and pattern): a new
+ * operation moves back past the entries it commutes with, and folds
+ * into the last entry for the same target and counter; entries that
+ * fold to the identity are dropped.  Programs that keep flipping the
+ * same flags thus keep a bounded log, however they interleave
+ * patterns.  Entries whose targets can't share a flag (their literal
+ * prefixes differ) always commute.
+ *
+ * Operations that patch code append their entries under the patch
+ * lock, right after their count updates, so the log orders them like
+ * the counts.  Lock-free operations only count themselves in their
+ * interned target, and the next operation that takes the patch lock
+ * (or `dynamic_flag_poll_modules`) folds them into the log: they
+ * never brought a flag count to zero, so they commute with everything
+ * logged since.
+ *
+ * Protected by the patch lock.
+ */
+static struct {
+	struct rule *data;
+	size_t size;
+	size_t capacity;
+} rules;
+
+/**
+ * Sets the prefix that all names `target` matches start with: the
+ * longer of its kind and of its pattern's literal prefix.  Returns
+ * false if the two disagree, and `target` can't match any name.
+ */
+static bool
+rule_set_prefix(struct rule_target *target)
+{
+	const char *literal = "";
+	size_t length = 0;
+	size_t common;
+
+	if (target->pattern != NULL) {
+		literal = target->pattern + (target->pattern[0] == '^');
+		length = strcspn(literal, ".[]()*+?{}|^$\\");
+		/* A regex may alternate, or make its last literal optional. */
+		if (strchr(literal, '|') != NULL) {
+			length = 0;
+		} else if (length > 0 && (literal[length] == '?' ||
+		    literal[length] == '*' || literal[length] == '{')) {
+			length--;
+		}
+	}
+
+	common = (length < target->kind_length) ? length : target->kind_length;
+	if (common > 0 && memcmp(literal, target->kind, common) != 0) {
+		return false;
+	}
+
+	if (length >= target->kind_length) {
+		target->prefix = literal;
+		target->length = length;
+	} else {
+		target->prefix = target->kind;
+		target->length = target->kind_length;
+	}
+
+	return true;
+}
+
+/* Length of the "KIND:" prefix of the flag name `kind`, or 0 if NULL. */
+static size_t
+rule_kind_length(const char *kind)
+{
+
+	return (kind == NULL) ? 0 : (size_t)(strchr(kind, ':') + 1 - kind);
+}
+
+static uint64_t
+rule_target_hash(const char *kind, const char *pattern)
+{
+	uint64_t hash = hash_name("", 0);
+
+	if (kind != NULL) {
+		hash = hash_name(kind, rule_kind_length(kind));
+	}
+
+	if (pattern != NULL) {
+		hash = hash * 31 + hash_name(pattern, strlen(pattern)) + 1;
+	}
+
+	return hash;
+}
+
+static bool
+rule_target_is(const struct rule_target *target, uint64_t hash,
+    const char *kind, const char *pattern)
+{
+	size_t kind_length = rule_kind_length(kind);
+
+	if (target->hash != hash || target->kind_length != kind_length ||
+	    (target->pattern == NULL) != (pattern == NULL)) {
+		return false;
+	}
+
+	return (kind_length == 0 ||
+	    memcmp(target->kind, kind, kind_length) == 0) &&
+	    (pattern == NULL || strcmp(target->pattern, pattern) == 0);
+}
+
+static void
+rule_target_destroy(struct rule_target *target)
+{
+
+	if (!target->empty) {
+		matcher_destroy(&target->matcher);
+	}
+
+	free(target->kind);
+	free(target->pattern);
+	free(target);
+	return;
+}
+
+/**
+ * Creates the target for `kind` (the name of a flag in the kind the
+ * operations are restricted to, or NULL) and `pattern`, which must
+ * compile.
+ */
+static struct rule_target *
+rule_target_create(uint64_t hash, const char *kind, const char *pattern)
+{
+	struct rule_target *target;
+
+	target = calloc(1, sizeof(*target));
+	assert(target != NULL);
+	target->hash = hash;
+	target->kind_length = rule_kind_length(kind);
+	if (kind != NULL) {
+		target->kind = strndup(kind, target->kind_length);
+		assert(target->kind != NULL);
+	}
+
+	if (pattern != NULL) {
+		target->pattern = strdup(pattern);
+		assert(target->pattern != NULL);
+	}
+
+	target->empty = !rule_set_prefix(target);
+	if (!target->empty &&
+	    matcher_compile(&target->matcher, target->pattern) != 0) {
+		target->empty = true;
+	}
+
+	return target;
+}
+
+/**
+ * Returns the interned target for `kind` and `pattern`, and interns
+ * it if necessary.  Returns NULL if the table is full.
+ */
+static struct rule_target *
+rule_target_intern(const char *kind, const char *pattern)
+{
+	uint64_t hash = rule_target_hash(kind, pattern);
+	struct rule_target **bucket =
+	    &rule_targets.buckets[hash % RULE_TARGET_BUCKETS];
+	struct rule_target *head, *target = NULL;
+
+	head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+	for (;;) {
+		for (struct rule_target *it = head; it != NULL; it = it->next) {
+			if (rule_target_is(it, hash, kind, pattern)) {
+				if (target != NULL) {
+					rule_target_destroy(target);
+					__atomic_fetch_sub(&rule_targets.size, 1,
+					    __ATOMIC_RELAXED);
+				}
+
+				return it;
+			}
+		}
+
+		if (target == NULL) {
+			if (__atomic_fetch_add(&rule_targets.size, 1,
+			    __ATOMIC_RELAXED) >= RULE_TARGETS_MAX) {
+				__atomic_fetch_sub(&rule_targets.size, 1,
+				    __ATOMIC_RELAXED);
+				return NULL;
+			}
+
+			target = rule_target_create(hash, kind, pattern);
+			target->interned = true;
+		}
+
+		/* On failure, `head` is the new head: look again. */
+		target->next = head;
+		if (__atomic_compare_exchange_n(bucket, &head, target, false,
+		    __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			return target;
+		}
+	}
+}
+
+/**
+ * Frees `target` if it's private and no log entry needs it anymore.
+ */
+static void
+rule_target_release(struct rule_target *target)
+{
+
+	if (!target->interned && target->entries == 0) {
+		rule_target_destroy(target);
+	}
+
+	return;
+}
+
+/* Whether some name may match both `a` and `b`. */
+static bool
+rule_overlaps(const struct rule *a, const struct rule *b)
+{
+	size_t length = (a->target->length < b->target->length) ?
+	    a->target->length : b->target->length;
+
+	return memcmp(a->target->prefix, b->target->prefix, length) == 0;
+}
+
+static bool
+rule_same_target(const struct rule *a, const struct rule *b)
+{
+
+	return a->target == b->target ||
+	    rule_target_is(a->target, b->target->hash, b->target->kind,
+	    b->target->pattern);
+}
+
+/**
+ * Returns whether applying `a` then `b` to a flag has the same
+ * effect as `b` then `a`.  Activations depend on unhook counts, so
+ * only pure deactivations commute with unhooks and rehooks.
+ */
+static bool
+rule_commutes(const struct rule *a, const struct rule *b)
+{
+
+	if (a->hook != b->hook) {
+		return count_fold_only_down(a->hook ? &b->fold : &a->fold);
+	}
+
+	return count_fold_commutes(&a->fold, &b->fold);
+}
+
+/**
+ * Returns whether `rules.data[i]` has no effect.  Unhooked flags only
+ * see the `downs` of activation folds, so these only matter if an
+ * earlier entry may unhook the same flags.
+ */
+static bool
+rules_is_identity(size_t i)
+{
+	const struct rule *rule = &rules.data[i];
+
+	if (rule->fold.delta != 0 || rule->fold.floor != 0) {
+		return false;
+	}
+
+	if (rule->hook || rule->fold.downs == 0) {
+		return true;
+	}
+
+	for (size_t j = 0; j < i; j++) {
+		if (rules.data[j].hook && rule_overlaps(&rules.data[j], rule)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Appends `n` times `op` on the flags of `target` to the rule log, and
+ * releases `target`.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+rules_append(enum rule_op op, uint64_t n, struct rule_target *target)
+{
+	struct rule rule = {
+		.hook = (op == RULE_UNHOOK || op == RULE_REHOOK),
+		.target = target,
+	};
+	size_t i;
+
+	/* The operation can't have matched any flag. */
+	if (target->empty) {
+		goto out;
+	}
+
+	count_fold_push(&rule.fold, op == RULE_ACTIVATE || op == RULE_UNHOOK,
+	    n);
+	for (i = rules.size; i-- > 0;) {
+		struct rule *prev = &rules.data[i];
+		bool same = rule_same_target(prev, &rule);
+
+		if (!rule_overlaps(prev, &rule)) {
+			continue;
+		}
+
+		if (same && prev->hook == rule.hook) {
+			count_fold_push(&prev->fold,
+			    op == RULE_ACTIVATE || op == RULE_UNHOOK, n);
+			if (rules_is_identity(i)) {
+				struct rule_target *dropped = prev->target;
+
+				memmove(prev, prev + 1,
+				    (rules.size - i - 1) * sizeof(*prev));
+				rules.size--;
+				dropped->entries--;
+				if (dropped != target) {
+					rule_target_release(dropped);
+				}
+			}
+
+			goto out;
+		}
+
+		/* The target's own unhooks are still in effect. */
+		if (same && op == RULE_ACTIVATE && prev->fold.floor > 0) {
+			goto out;
+		}
+
+		if (!rule_commutes(prev, &rule)) {
+			break;
+		}
+	}
+
+	if (rules.size == rules.capacity) {
+		rules.capacity = (rules.capacity > 0) ? 2 * rules.capacity : 16;
+		rules.data = realloc(rules.data,
+		    rules.capacity * sizeof(*rules.data));
+		assert(rules.data != NULL);
+	}
+
+	rules.data[rules.size++] = rule;
+	target->entries++;
+
+out:
+	rule_target_release(target);
+	return;
+}
+
+/**
+ * Appends the lock-free operations counted in interned targets to
+ * the rule log: each target's activations, then its deactivations.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+rules_materialise(void)
+{
+
+	/* Pairs with `rules_note`, so that no count goes unnoticed. */
+	if (!__atomic_exchange_n(&rule_targets.pending, false,
+	    __ATOMIC_SEQ_CST)) {
+		return;
+	}
+
+	for (size_t i = 0; i < RULE_TARGET_BUCKETS; i++) {
+		struct rule_target *it = __atomic_load_n(
+		    &rule_targets.buckets[i], __ATOMIC_ACQUIRE);
+
+		for (; it != NULL; it = it->next) {
+			uint64_t ups, downs;
+
+			ups = __atomic_exchange_n(&it->ups, 0, __ATOMIC_SEQ_CST);
+			downs = __atomic_exchange_n(&it->downs, 0,
+			    __ATOMIC_SEQ_CST);
+			if (ups > 0) {
+				rules_append(RULE_ACTIVATE, ups, it);
+			}
+
+			if (downs > 0) {
+				rules_append(RULE_DEACTIVATE, downs, it);
+			}
+		}
+	}
+
+	return;
+}
+
+/**
+ * Appends `n` times `op` on the flags that match `pattern` to the rule
+ * log.  `kind` is NULL, or the name of a flag in the kind the
+ * operation is restricted to.
+ *
+ * Must be called with the patch lock held.
+ */
+static void
+rules_push(enum rule_op op, uint64_t n, const char *kind, const char *pattern)
+{
+	struct rule_target *target;
+
+	rules_materialise();
+	target = rule_target_intern(kind, pattern);
+	if (target == NULL) {
+		target = rule_target_create(rule_target_hash(kind, pattern),
+		    kind, pattern);
+	}
+
+	rules_append(op, n, target);
+	return;
+}
+
+/**
+ * Counts an activation (if `up`) or deactivation of the flags that
+ * match `pattern` (restricted to the kind of the flag `kind` if
+ * non-NULL), which didn't take the patch lock, in its interned target.
+ * Takes the patch lock to log it directly if the table is full.
+ */
+static void
+rules_note(bool up, const char *kind, const char *pattern)
+{
+	struct rule_target *target;
+
+	target = rule_target_intern(kind, pattern);
+	if (target == NULL) {
+		lock();
+		rules_push(up ? RULE_ACTIVATE : RULE_DEACTIVATE, 1, kind,
+		    pattern);
+		unlock();
+		return;
+	}
+
+	if (target->empty) {
+		return;
+	}
+
+	__atomic_fetch_add(up ? &target->ups : &target->downs, 1,
+	    __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&rule_targets.pending, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&rule_targets.pending, true,
+		    __ATOMIC_SEQ_CST);
+	}
+
+	return;
+}
+
+/**
+ * Unlinks and frees the interned targets without log entries, after
+ * `rules_materialise`.
+ *
+ * Must be called while no flag operation is running, with the patch
+ * lock held.
+ */
+static void
+rule_targets_reclaim(void)
+{
+
+	for (size_t i = 0; i < RULE_TARGET_BUCKETS; i++) {
+		struct rule_target **link = &rule_targets.buckets[i];
+
+		while (*link != NULL) {
+			struct rule_target *target = *link;
+
+			if (target->entries > 0) {
+				link = &target->next;
+				continue;
+			}
+
+			*link = target->next;
+			rule_targets.size--;
+			rule_target_destroy(target);
+		}
+	}
+
+	return;
+}
+
+/**
+ * Applies `rule` to `record`, in a module that was just loaded.
+ */
+static void
+rule_apply(const struct rule *rule, const struct module *module,
+    const struct patch_record *record)
+{
+	struct patch_count *count = &module->counts[record - module->start];
+
+	if (rule->hook) {
+		count->unhook = count_fold_apply(&rule->fold, false,
+		    count->unhook);
+	} else if (record->type == PATCH_RECORD_FLAG) {
+		count->activation = count_fold_apply(&rule->fold,
+		    count->unhook > 0, count->activation);
+	}
+
+	return;
+}
+
+/**
+ * Sets the counts of the records in `module`, which was just loaded,
+ * to what the rule log yields for them, and pushes the records whose
+ * machine code doesn't match these counts to `to_patch`.
+ *
+ * Each rule only looks at the names that start with its prefix, in the
+ * name index, or at the module's records if there are fewer of them.
+ *
+ * Must be called while no flag operation is running, with the patch
+ * lock held, and with the name index up to date.
+ */
+static void
+rules_replay(const struct module *module, struct patch_list *to_patch)
+{
+	size_t n = module->end - module->start;
+
+	for (size_t i = 0; i < n; i++) {
+		module->counts[i].activation =
+		    initial_activation(&module->start[i]);
+	}
+
+	for (size_t i = 0; i < rules.size; i++) {
+		const struct rule *rule = &rules.data[i];
+		const struct rule_target *target = rule->target;
+		size_t begin = names_lower_bound(target->prefix,
+		    target->length);
+		size_t end = names_prefix_end(begin, target->prefix,
+		    target->length);
+
+		if (end - begin > n) {
+			for (size_t j = 0; j < n; j++) {
+				const char *name = record_name(&module->start[j]);
+
+				if (strncmp(name, target->prefix,
+				    target->length) == 0 &&
+				    (target->kind == NULL || strncmp(name,
+				    target->kind, target->kind_length) == 0) &&
+				    matcher_match(&target->matcher, name)) {
+					rule_apply(rule, module, &module->start[j]);
+				}
+			}
+
+			continue;
+		}
+
+		for (size_t j = begin, k; j < end; j = k) {
+			const char *name = record_name(names.by_name[j]);
+
+			k = names.run_end[j];
+			if ((target->kind != NULL && strncmp(name,
+			    target->kind, target->kind_length) != 0) ||
+			    !matcher_match(&target->matcher, name)) {
+				continue;
+			}
+
+			for (size_t l = j; l < k; l++) {
+				const struct patch_record *record = names.by_name[l];
+
+				if (module->start <= record && record < module->end) {
+					rule_apply(rule, module, record);
+				}
+			}
+		}
+	}
+
+	for (const struct patch_record *record = module->start;
+	     record < module->end; record++) {
+		struct patch_count *count = &module->counts[record - module->start];
+		const char *name = record_name(record);
+		bool flag = (record->type == PATCH_RECORD_FLAG);
+
+		for (struct kind_state *kind = kinds; kind != NULL;
+		     kind = kind->next) {
+			if (flag && kind->grace.base > 0 &&
+			    strncmp(name, kind->prefix, kind->length) == 0) {
+				count->grace = &kind->grace;
+			}
+		}
+
+		if (flag && code_is_active(record) != (count->activation > 0)) {
+			patch_list_push(to_patch, record);
+		}
+	}
+
+	/* Switches and calls only need their initial patch. */
+	for (const int32_t *it = module->init_start; it < module->init_end;
+	     it++) {
+		const struct patch_record *record = relative_pointer(it);
+
+		if (record->type != PATCH_RECORD_FLAG) {
+			patch_list_push(to_patch, record);
+		}
+	}
+
+	return;
+}
+
+ssize_t
+dynamic_flag_activate(const char *regex)
+{
+	struct patch_list *acc;
+	int r;
+
+	modules_enter();
+	acc = patch_list_create();
+	r = find_records(regex, acc);
+	if (r != 0) {
+		goto out;
+	}
+
+	r = (activate_all(acc, &(struct rule_log) { NULL, regex }) < 0) ?
+	    -1 : (ssize_t)acc->size;
+
+out:
+	patch_list_destroy(acc);
+	modules_exit();
+	return r;
+}
+
+ssize_t
+dynamic_flag_deactivate(const char *regex)
+{
+	struct patch_list *acc;
+	int r;
+
+	modules_enter();
+	acc = patch_list_create();
+	r = find_records(regex, acc);
+	if (r != 0) {
+		goto out;
+	}
+
+	r = (deactivate_all(acc, &(struct rule_log) { NULL, regex }) < 0) ?
+	    -1 : (ssize_t)acc->size;
+
+out:
+	patch_list_destroy(acc);
+	modules_exit();
+	return r;
+}
+
+ssize_t
+dynamic_flag_unhook(const char *regex)
+{
+	struct patch_list *acc;
+	int r;
+
+	modules_enter();
+	acc = patch_list_create();
+	r = find_records(regex, acc);
+	if (r != 0) {
+		goto out;
+	}
+
+	unhook_all(acc, regex);
+	r = acc->size;
+
+out:
+	patch_list_destroy(acc);
+	modules_exit();
+	return r;
+}
+
+ssize_t
+dynamic_flag_rehook(const char *regex)
+{
+	struct patch_list *acc;
+	int r;
+
+	modules_enter();
+	acc = patch_list_create();
+	r = find_records(regex, acc);
+	if (r != 0) {
+		goto out;
+	}
+
+	rehook_all(acc, regex);
+	r = acc->size;
+
+out:
+	patch_list_destroy(acc);
+	modules_exit();
+	return r;
+}
+
+void
+dynamic_flag_txn_begin(void)
+{
+
+	/* Modules can't change until the transaction commits. */
+	modules_enter();
+	if (txn_owner_depth++ > 0) {
+		return;
+	}
+
+	/* Acquire the lock for real before marking this thread as owner. */
+	txn_owner_depth = 0;
+	lock();
+	txn_owner_depth = 1;
+
+	assert(txn.pending == NULL);
+	txn.pending = patch_list_create();
+	/* Readers only wait for individual operations. */
+	counts_write_end();
 	return;
 }
 
-#if DYNAMIC_FLAG_IMPLEMENTATION_STYLE == 1
-#define HOOK_SIZE 3 /* REX byte + mov imm8 */
-
-/**
- * Switches to the flag's slow path by updating a non-zero value in
- * the `MOV` instruction's immediate field.
- */
-static __attribute__((noinline)) void
-patch(const struct patch_record *record)
+ssize_t
+dynamic_flag_txn_commit(void)
 {
-	uint8_t *address = record->hook;
-	/* +1 to get the immediate field after the MOV opcode. */
-	uint8_t *field = address + 1;
+	struct patch_list *pending;
+	size_t kept = 0;
+	ssize_t r;
+
+	assert(txn_owner_depth > 0 && "Commit without matching begin.");
+	if (--txn_owner_depth > 0) {
+		modules_exit();
+		return 0;
+	}
+
+	counts_write_begin();
+	pending = txn.pending;
+	txn.pending = NULL;
 
 	/*
-	 * F4 is HLT, 0x0 is ADD [AL], AL.  Neither is a MOV opcode.
-	 * Any mismatch must mean we have a 3-byte REX MOV, and we
-	 * have to go forward one more byte.
+	 * Records whose count crossed zero and came back already have
+	 * the right code: only rewrite the others.
 	 */
-	if (field[0] != DYNAMIC_FLAG_VALUE_ACTIVE &&
-	    field[0] != DYNAMIC_FLAG_VALUE_INACTIVE) {
-		field++;
+	for (size_t i = 0; i < pending->size; i++) {
+		const struct patch_record *record = pending->data[i];
+		struct patch_count *count = record_count(record);
+
+		count->pending = false;
+		count->deadline = 0;
+		if (!code_matches_count(record)) {
+			pending->data[kept++] = record;
+		}
 	}
 
-	assert((field[0] == DYNAMIC_FLAG_VALUE_ACTIVE) ||
-	    (field[0] == DYNAMIC_FLAG_VALUE_INACTIVE));
-	update_byte(field, DYNAMIC_FLAG_VALUE_ACTIVE);
-	return;
+	pending->size = kept;
+	qsort(pending->data, pending->size,
+	    sizeof(struct patch_record *), cmp_patches);
+	r = pending->size;
+	if (amortize(pending, reconcile) != 0) {
+		resync(pending);
+		r = -1;
+	}
+
+	unlock();
+
+	patch_list_destroy(pending);
+	modules_exit();
+	return r;
 }
 
-/**
- * Switches to the flag's fast path by updating a zero value in the
- * `MOV` instruction's immediate field.
- */
-static __attribute__((noinline))  void
-unpatch(const struct patch_record *record)
+ssize_t
+dynamic_flag_select(const char *regex, unsigned int which)
 {
-	uint8_t *address = record->hook;
-	uint8_t *field = address + 1;
+	struct patch_list *acc;
+	ssize_t r;
 
-	if (field[0] != DYNAMIC_FLAG_VALUE_ACTIVE &&
-	    field[0] != DYNAMIC_FLAG_VALUE_INACTIVE) {
-		field++;
+	modules_enter();
+	acc = patch_list_create();
+	r = find_records(regex, acc);
+	if (r != 0) {
+		goto out;
 	}
 
-	assert((field[0] == DYNAMIC_FLAG_VALUE_ACTIVE) ||
-	    (field[0] == DYNAMIC_FLAG_VALUE_INACTIVE));
-	update_byte(field, DYNAMIC_FLAG_VALUE_INACTIVE);
-	return;
+	r = select_all(acc, which);
+
+out:
+	patch_list_destroy(acc);
+	modules_exit();
+	return r;
 }
-#elif DYNAMIC_FLAG_IMPLEMENTATION_STYLE == 2
-#define HOOK_SIZE 5  /* jmp rel32 or testl %eax, imm. */
 
-/**
- * Switches to the flag's slow path by setting the opcode to `jmp rel`.
- */
-static __attribute__((noinline))  void
-patch(const struct patch_record *record)
+ssize_t
+dynamic_flag_set_call(const char *regex, void *fn)
 {
-	uint8_t *address = record->hook;
-	void *dst = record->destination;
-	int32_t *target = (int32_t *)(address + 1);
-	intptr_t offset = (uint8_t *)dst - (address + 5); /* IP offset from end of instruction. */
+	struct patch_list *acc;
+	ssize_t r;
 
-	assert((*address == 0xe9 || *address == 0xa9) &&
-	    "Target should be a jmp rel or a testl $..., %eax");
-	assert((offset == (intptr_t)*target) &&
-	    "Target's offset should match with the hook destination.");
+	modules_enter();
+	acc = patch_list_create();
+	r = find_records(regex, acc);
+	if (r != 0) {
+		goto out;
+	}
 
-	update_byte(address, 0xe9); /* jmp rel */
-	return;
+	r = set_call_all(acc, fn);
+
+out:
+	patch_list_destroy(acc);
+	modules_exit();
+	return r;
+}
+
+ssize_t
+dynamic_flag_activate_exact(const char *name)
+{
+	struct patch_list *acc;
+	ssize_t r;
+
+	modules_enter();
+	acc = patch_list_create();
+	find_records_exact(name, acc);
+	r = (activate_all(acc, NULL) < 0) ? -1 : (ssize_t)acc->size;
+	patch_list_destroy(acc);
+	modules_exit();
+	return r;
+}
+
+ssize_t
+dynamic_flag_deactivate_exact(const char *name)
+{
+	struct patch_list *acc;
+	ssize_t r;
+
+	modules_enter();
+	acc = patch_list_create();
+	find_records_exact(name, acc);
+	r = (deactivate_all(acc, NULL) < 0) ? -1 : (ssize_t)acc->size;
+	patch_list_destroy(acc);
+	modules_exit();
+	return r;
+}
+
+int
+dynamic_flag_is_active(const char *name)
+{
+	const struct name_slot *slot;
+	int r = 0;
+
+	modules_enter();
+	slot = names_find(name);
+	if (slot == NULL) {
+		r = -1;
+		goto out;
+	}
+
+	for (size_t i = slot->begin; i < slot->end; i++) {
+		struct patch_count *count = record_count(names.by_name[i]);
+
+		if (__atomic_load_n(&count->activation,
+		    __ATOMIC_RELAXED) > 0) {
+			r = 1;
+			break;
+		}
+	}
+
+out:
+	modules_exit();
+	return r;
 }
 
 /**
- * Switches to the flag's fast path by setting the opcode to `test`.
+ * A pre-resolved set of flags, sorted by hook address.  Flips only
+ * allocate scratch space once per thread (see `patch_list_create`).
  */
-static __attribute__((noinline)) void
-unpatch(const struct patch_record *record)
+struct dynamic_flag_group {
+	struct patch_list *records;
+	struct grace_policy grace;
+	/* Next in `groups`. */
+	struct dynamic_flag_group *next;
+};
+
+/*
+ * All live groups, so we can drop the records of unloaded modules.
+ * Protected by the patch lock.
+ */
+static struct dynamic_flag_group *groups = NULL;
+
+/**
+ * Wraps the records in `acc` in a new group.
+ */
+static struct dynamic_flag_group *
+group_create(struct patch_list *acc)
 {
-	uint8_t *address = record->hook;
-	void *dst = record->destination;
-	int32_t *target = (int32_t *)(address + 1);
-	intptr_t offset = (uint8_t *)dst - (address + 5);
+	struct dynamic_flag_group *group;
 
-	assert((*address == 0xe9 || *address == 0xa9) &&
-	    "Target should be a jmp rel or a testl $..., %eax");
-	assert((offset == (intptr_t)*target) &&
-	    "Target's offset should match with the hook destination.");
+	sort_records(acc);
 
-	update_byte(address, 0xa9); /* testl $..., %eax */
+	group = calloc(1, sizeof(*group));
+	if (group == NULL) {
+		return NULL;
+	}
+
+	group->records = patch_list_create_capacity(acc->size);
+	memcpy(group->records->data, acc->data, acc->size * sizeof(acc->data[0]));
+	group->records->size = acc->size;
+	group->records->sorted = true;
+
+	lock();
+	group->next = groups;
+	groups = group;
+	unlock();
+	return group;
+}
+
+struct dynamic_flag_group *
+dynamic_flag_group_create(const char *regex)
+{
+	struct dynamic_flag_group *group = NULL;
+	struct patch_list *acc;
+
+	dynamic_flag_init_lib();
+	modules_enter();
+	acc = patch_list_create();
+	if (find_records(regex, acc) == 0) {
+		group = group_create(acc);
+	}
+
+	patch_list_destroy(acc);
+	modules_exit();
+	return group;
+}
+
+ssize_t
+dynamic_flag_group_activate(struct dynamic_flag_group *group)
+{
+	ssize_t r;
+
+	modules_enter();
+	r = (activate_list(group->records, NULL) < 0) ?
+	    -1 : (ssize_t)group->records->size;
+	modules_exit();
+	return r;
+}
+
+ssize_t
+dynamic_flag_group_deactivate(struct dynamic_flag_group *group)
+{
+	ssize_t r;
+
+	modules_enter();
+	r = (deactivate_list(group->records, NULL) < 0) ?
+	    -1 : (ssize_t)group->records->size;
+	modules_exit();
+	return r;
+}
+
+int
+dynamic_flag_group_set_grace_period(struct dynamic_flag_group *group,
+    uint64_t grace_ns)
+{
+
+	modules_enter();
+	lock();
+	grace_policy_set(&group->grace, group->records, grace_ns);
+	linger_poll();
+	unlock();
+	modules_exit();
+	return 0;
+}
+
+void
+dynamic_flag_group_destroy(struct dynamic_flag_group *group)
+{
+
+	struct dynamic_flag_group **link;
+
+	if (group == NULL) {
+		return;
+	}
+
+	modules_enter();
+	lock();
+	if (group->grace.base > 0) {
+		grace_policy_set(&group->grace, group->records, 0);
+		linger_poll();
+	}
+
+	for (link = &groups; *link != group; link = &(*link)->next) {
+		continue;
+	}
+
+	*link = group->next;
+	unlock();
+	modules_exit();
+
+	patch_list_destroy(group->records);
+	free(group);
 	return;
 }
-#endif
 
 /**
- * Sets the flag's initial state to that configured in its patch
- * record, and updates the patch's activation count accordingly.
+ * Removes the records of the `n` modules in `removed` from `list`,
+ * without dereferencing them: their module is already unmapped.
  */
 static void
-initial_patch(const struct patch_record *record)
+patch_list_drop(struct patch_list *list, const struct module *removed,
+    size_t n)
 {
-	size_t i;
+	size_t kept = 0;
 
-	i = record - __start_dynamic_flag_list;
+	for (size_t i = 0; i < list->size; i++) {
+		const struct patch_record *record = list->data[i];
+		bool dropped = false;
 
-	assert(i < counts.size && "Hook out of bounds?!");
+		for (size_t j = 0; j < n; j++) {
+			if ((uintptr_t)removed[j].start <= (uintptr_t)record &&
+			    (uintptr_t)record < (uintptr_t)removed[j].end) {
+				dropped = true;
+				break;
+			}
+		}
 
-	switch (record->initial_opcode) {
-	case DYNAMIC_FLAG_VALUE_ACTIVE:
-		counts.data[i].activation = (record->flipped != 0) ? 0 : 1;
-		patch(record);
-		break;
-	case DYNAMIC_FLAG_VALUE_INACTIVE:
-		counts.data[i].activation = (record->flipped != 0) ? 1 : 0;
-		unpatch(record);
-		break;
-	default:
-		assert((record->initial_opcode == DYNAMIC_FLAG_VALUE_ACTIVE ||
-		    record->initial_opcode == DYNAMIC_FLAG_VALUE_INACTIVE) &&
-		    "Initial opcode/value must be ACTIVE or INACTIVE (JMP REL32 or TEST / 0xF4 or 0)");
+		if (!dropped) {
+			list->data[kept++] = record;
+		}
 	}
 
-	__builtin___clear_cache(record->hook, (char *)record->hook + HOOK_SIZE);
+	list->size = kept;
 	return;
 }
 
 /**
- * Enables a flag.  I.e., switches to the fast path if the record is
- * `flipped`, and to the slow path otherwise.
+ * Forgets everything we know about the `n` unloaded modules in
+ * `removed`, and disengages all kinds.
+ *
+ * Must be called with `modules_poll.lock` held and its readers
+ * drained (see `dynamic_flag_poll_modules`), and the patch lock held.
  */
 static void
-activate(const struct patch_record *record)
+modules_forget(const struct module *removed, size_t n)
 {
 
-	if (record->flipped != 0) {
-		unpatch(record);
-	} else {
-		patch(record);
+	for (struct kind_state *kind = kinds; kind != NULL; kind = kind->next) {
+		patch_list_drop(kind->records, removed, n);
+		/* New records can't point back to the kind. */
+		if (__atomic_load_n(&kind->count, __ATOMIC_RELAXED) > 0) {
+			kind_materialise(kind);
+		}
+	}
+
+	for (struct dynamic_flag_group *group = groups; group != NULL;
+	     group = group->next) {
+		patch_list_drop(group->records, removed, n);
+	}
+
+	if (linger.records != NULL) {
+		patch_list_drop(linger.records, removed, n);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		free(removed[i].counts);
 	}
 
-	__builtin___clear_cache(record->hook, (char *)record->hook + HOOK_SIZE);
 	return;
 }
 
 /**
- * Disables a flag.  I.e., switches to the slow path if the record is
- * `flipped`, and to the fast path otherwise.
+ * Rebuilds the state derived from `modules` once modules were loaded
+ * or unloaded: the name index, kinds, and scratch space.
+ *
+ * Must be called with `modules_poll.lock` held and its readers
+ * drained (see `dynamic_flag_poll_modules`), and the patch lock held.
  */
 static void
-deactivate(const struct patch_record *record)
+modules_reindex(void)
 {
 
-	if (record->flipped != 0) {
-		patch(record);
-	} else {
-		unpatch(record);
+	modules_index();
+	pattern_cache_flush();
+
+	free(names.by_name);
+	free(names.run_end);
+	free(names.slots);
+	names_init();
+
+	for (struct kind_state *kind = kinds; kind != NULL; kind = kind->next) {
+		struct matcher all;
+		size_t begin = names_lower_bound(kind->prefix, kind->length);
+
+		kind->records = patch_list_refit(kind->records);
+		kind->records->size = 0;
+		matcher_compile(&all, NULL);
+		names_match_range(&all, begin,
+		    names_prefix_end(begin, kind->prefix, kind->length),
+		    kind->records);
+	}
+
+	if (linger.records != NULL) {
+		linger.records = patch_list_refit(linger.records);
+		linger.expired = patch_list_refit(linger.expired);
+	}
+
+	poke_init();
+
+	/* The alias mapping only covers the text of one module. */
+	if (backend == &alias_backend && modules.size > 1) {
+		detect_backend();
 	}
 
-	__builtin___clear_cache(record->hook, (char *)record->hook + HOOK_SIZE);
 	return;
 }
 
 /**
- * Invokes `cb` on a list of records sorted by hook instruction
- * address.
- *
- * The hook instruction is on writable page(s) when `cb` is called,
- * and quickly reset to read-only/executable.
+ * Updates `modules` with the objects loaded or unloaded since we last
+ * scanned them.  Flags in new modules get the state the rule log
+ * yields for them, in one `amortize` pass.
  *
- * This pair of mprotect is slow, so `amortize` batches calls for
- * contiguous pages.
+ * Must be called with `modules_poll.lock` held and its readers
+ * drained (see `dynamic_flag_poll_modules`), and the patch lock held.
  */
 static void
-amortize(const struct patch_list *records,
-    void (*cb)(const struct patch_record *))
+modules_update(void)
 {
-	uintptr_t first_page = UINTPTR_MAX;
-	uintptr_t last_page = 0;
-	uintptr_t page_size;
-	size_t i, section_begin = 0;
+	struct module_scan scan;
+	struct module *removed;
+	struct patch_list *to_patch;
+	size_t n_removed = 0;
+	bool added = false;
+
+	modules_scan(&scan);
+	modules.adds = scan.adds;
+	modules.subs = scan.subs;
+
+	/* Modules that are still loaded keep their state. */
+	removed = calloc(modules.size, sizeof(*removed));
+	assert(removed != NULL);
+	for (size_t i = 0, j = 0; i < modules.size; i++) {
+		const struct module *module = &modules.data[i];
+
+		while (j < scan.size &&
+		    (uintptr_t)scan.data[j].start < (uintptr_t)module->start) {
+			j++;
+		}
 
-	page_size = sysconf(_SC_PAGESIZE);
+		if (j < scan.size && scan.data[j].start == module->start &&
+		    scan.data[j].end == module->end) {
+			scan.data[j] = *module;
+		} else {
+			removed[n_removed++] = *module;
+		}
+	}
 
-#define PATCH() do {							\
-		if (section_begin < i) {				\
-			mprotect((void *)(first_page * page_size),	\
-			    (1 + last_page - first_page) * page_size,	\
-			    PROT_READ | PROT_WRITE | PROT_EXEC);	\
-			for (size_t j = section_begin; j < i; j++) {	\
-				cb(records->data[j]);				\
-			}						\
-									\
-			mprotect((void *)(first_page * page_size),	\
-			    (1 + last_page - first_page) * page_size,	\
-			    PROT_READ | PROT_EXEC);			\
-		}							\
-	} while (0)
+	for (size_t i = 0; i < scan.size; i++) {
+		added = added || scan.data[i].counts == NULL;
+	}
 
-	for (i = 0; i < records->size; i++) {
-		const struct patch_record *record = records->data[i];
-		uintptr_t begin_page = (uintptr_t)record->hook / page_size;
-		uintptr_t end_page = ((uintptr_t)record->hook + HOOK_SIZE - 1) / page_size;
-		/* The initial range is empty, and can always be extended. */
-		bool empty_range = first_page > last_page;
-		/*
-		 * Otherwise, we can extend the current range by up to
-		 * one page in either direction.  If begin/end page
-		 * fall in that extended range, we want to adjoin it
-		 * to the `[first_page, last_page]` range.  Limited
-		 * extension guarantees that we only mprotect adjacent
-		 * pages that we would have mprotect-ed anyway.
-		 *
-		 * There is potential for unsigned overflow in the
-		 * subtraction, but only for the zero page, which is
-		 * usually unmappable. If we do have hook instructions
-		 * on the zero page, the wraparound is defined
-		 * behaviour and will merely result in less
-		 * amortisation, which is still correct.
-		 */
-		bool can_extend = (first_page - 1) <= begin_page &&
-			end_page <= (last_page + 1);
+	if (n_removed == 0 && !added) {
+		free(removed);
+		free(scan.data);
+		return;
+	}
 
-		if (empty_range || can_extend) {
-			if (begin_page < first_page) {
-				first_page = begin_page;
-			}
-			if (end_page > last_page) {
-				last_page = end_page;
-			}
-		} else {
-			PATCH();
-			section_begin = i;
-			first_page = begin_page;
-			last_page = end_page;
+	modules_forget(removed, n_removed);
+	free(removed);
+	free(modules.data);
+	modules.data = scan.data;
+	modules.size = scan.size;
+	modules_reindex();
+	rules_materialise();
+
+	to_patch = patch_list_create();
+	for (size_t i = 0; i < modules.size; i++) {
+		struct module *module = &modules.data[i];
+
+		if (module->counts != NULL) {
+			continue;
 		}
+
+		module->counts = calloc(module->end - module->start,
+		    sizeof(*module->counts));
+		assert(module->counts != NULL);
+		text_span_set(module);
+		rules_replay(module, to_patch);
 	}
 
-	PATCH();
+	rule_targets_reclaim();
+
+	sort_records(to_patch);
+	if (amortize(to_patch, reconcile) != 0) {
+		resync(to_patch);
+	}
+
+	patch_list_destroy(to_patch);
 	return;
 }
 
+static int
+module_counters(struct dl_phdr_info *info, size_t size, void *data)
+{
+	unsigned long long *counters = data;
+
+	(void)size;
+	counters[0] = info->dlpi_adds;
+	counters[1] = info->dlpi_subs;
+	return 1;
+}
+
 /**
- * Compiles `pattern` as a POSIX extended regular expression that's
- * implicitly anchored at the first character of the string (at the
- * first character of the flag name)
+ * Returns whether objects were loaded or unloaded since we last
+ * scanned modules.  Always false before initialisation.
+ *
+ * `dl_iterate_phdr` takes the loader lock, so only
+ * `dynamic_flag_poll_modules` checks.
  */
-static int
-compile_regex(regex_t *regex, const char *pattern)
+static bool
+modules_stale(void)
 {
-	char *to_free = NULL;
-	int r;
+	unsigned long long counters[2] = { 0, 0 };
 
-	if (pattern != NULL && pattern[0] != '^') {
-		r = asprintf(&to_free, "^%s", pattern);
-		if (r < 0)
-			return r;
-		pattern = to_free;
+	if (__atomic_load_n(&names.ready, __ATOMIC_ACQUIRE) == false) {
+		return false;
 	}
 
-	r = regcomp(regex, pattern, REG_EXTENDED | REG_NOSUB);
-	free(to_free);
-	return r;
+	dl_iterate_phdr(module_counters, counters);
+	return counters[0] != __atomic_load_n(&modules.adds, __ATOMIC_RELAXED) ||
+	    counters[1] != __atomic_load_n(&modules.subs, __ATOMIC_RELAXED);
 }
 
 /**
- * Stores patch records that match `pattern` in `acc`.
+ * Marks this thread as reading `modules`, after waiting for any
+ * update in progress.  No-op if this thread is already reading.
+ *
+ * Flag operations call this before they look up records, and
+ * `modules_exit` when they're done with them.
  */
-static int
-find_records(const char *pattern, struct patch_list *acc)
+static void
+modules_enter(void)
 {
-	regex_t regex;
-	size_t n = __stop_dynamic_flag_list - __start_dynamic_flag_list;
 
-	if (compile_regex(&regex, pattern) != 0) {
-		return -1;
+	if (modules_depth++ > 0) {
+		return;
 	}
 
-	for (size_t i = 0; i < n; i++) {
-		const struct patch_record *record = __start_dynamic_flag_list + i;
+	if (__builtin_expect(thread_state.registered == false, 0)) {
+		thread_state_register();
+	}
+
+	for (;;) {
+		__atomic_store_n(&thread_state.reading, true, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&modules_poll.light, __ATOMIC_RELAXED)) {
+			__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		} else {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		}
 
-		if (regexec(&regex, record->name_doc, 0, NULL, 0) != REG_NOMATCH) {
-			patch_list_push(acc, record);
+		if (__builtin_expect(__atomic_load_n(&modules_poll.pending,
+		    __ATOMIC_ACQUIRE) == false, 1)) {
+			break;
 		}
+
+		/* Back off until the update is done. */
+		__atomic_store_n(&thread_state.reading, false,
+		    __ATOMIC_RELEASE);
+		pthread_mutex_lock(&modules_poll.lock);
+		pthread_mutex_unlock(&modules_poll.lock);
 	}
 
-	regfree(&regex);
-	return 0;
+	return;
 }
 
-/**
- * Stores patch records in the
- * `__{start,stop}_dynamic_flag_${KIND}_list` array that match
- * `pattern` in `acc`.
- */
-static int
-find_records_kind(const void **start, const void **end, const char *pattern,
-    struct patch_list *acc)
+static void
+modules_exit(void)
 {
-	regex_t regex;
-	size_t n = end - start;
 
-	if (pattern != NULL && compile_regex(&regex, pattern) != 0) {
-		return -1;
+	if (--modules_depth > 0) {
+		return;
 	}
 
-	for (size_t i = 0; i < n; i++) {
-		const struct patch_record *record = start[i];
+	__atomic_store_n(&thread_state.reading, false, __ATOMIC_RELEASE);
+	return;
+}
 
-		if (pattern == NULL ||
-		    regexec(&regex, record->name_doc, 0, NULL, 0) != REG_NOMATCH) {
-			patch_list_push(acc, record);
+/**
+ * Returns whether any thread is between `modules_enter` and
+ * `modules_exit`.  Doesn't hold `threads.lock` across calls, since
+ * readers may need it (e.g., for `dynamic_flag_generation`).
+ */
+static bool
+modules_readers_active(void)
+{
+	bool active = false;
+
+	pthread_mutex_lock(&threads.lock);
+	for (const struct thread_state *it = threads.list; it != NULL;
+	     it = it->next) {
+		if (__atomic_load_n(&it->reading, __ATOMIC_ACQUIRE)) {
+			active = true;
+			break;
 		}
 	}
 
-	if (pattern != NULL) {
-		regfree(&regex);
-	}
-
-	return 0;
+	pthread_mutex_unlock(&threads.lock);
+	return active;
 }
 
-/**
- * Compares `patch_record`s by `hook` address.
- */
-static int
-cmp_patches(const void *x, const void *y)
+void
+dynamic_flag_poll_modules(void)
 {
-	const struct patch_record *const *a = x;
-	const struct patch_record *const *b = y;
 
-	if ((*a)->hook == (*b)->hook) {
-		return 0;
+	/* Operations in a transaction hold onto `modules`. */
+	if (modules_depth > 0 || !modules_stale()) {
+		return;
+	}
+
+	pthread_mutex_lock(&modules_poll.lock);
+	__atomic_store_n(&modules_poll.pending, true, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&modules_poll.light, __ATOMIC_RELAXED)) {
+		syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+	} else {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+
+	while (modules_readers_active()) {
+		sched_yield();
 	}
 
-	return ((*a)->hook < (*b)->hook) ? -1 : 1;
+	lock();
+	modules_update();
+	unlock();
+	__atomic_store_n(&modules_poll.pending, false, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&modules_poll.lock);
+	return;
 }
 
 /**
- * Initializes the flags' states.
+ * Flips a flag's machine code, for lists that mix activations and
+ * deactivations.
  */
 static void
-init_all(void)
+toggle(const struct patch_record *record)
 {
-	struct patch_list *acc;
-	int r;
 
-	acc = patch_list_create();
-	r = find_records("", acc);
-	assert(r == 0 && "dynamic_flag init failed.");
+	if (code_is_active(record)) {
+		deactivate(record);
+	} else {
+		activate(record);
+	}
 
-	qsort(acc->data, acc->size, sizeof(acc->data[0]), cmp_patches);
-	amortize(acc, initial_patch);
-	patch_list_destroy(acc);
 	return;
 }
 
 /**
- * Increments by one the activation count of all flags in `records`.
+ * An asynchronous activation or deactivation request.
  */
-static size_t
-activate_all(struct patch_list *records)
-{
-	struct patch_list *to_patch;
-	size_t to_patch_count;
+struct async_request {
+	struct async_request *next;
+	bool activate;
+	/* NULL or points to `storage`. */
+	const char *regex;
+	char storage[];
+};
 
-	qsort(records->data, records->size,
-	    sizeof(struct patch_record *), cmp_patches);
+/**
+ * The net effect of a sequence of requests on one flag.
+ */
+struct async_fold {
+	struct count_fold counts;
+	/* Set once the flag is in `touched`. */
+	bool seen;
+};
 
-	to_patch = patch_list_create();
-	lock();
-	for (size_t i = 0; i < records->size; i++) {
-		const struct patch_record *record = records->data[i];
-		size_t offset = record - __start_dynamic_flag_list;
+/**
+ * Asynchronous requests go through a lock-free stack: producers push
+ * with a CAS, and the patcher thread pops the whole stack at once,
+ * and reverses it to apply requests in the order they were queued.
+ *
+ * `queued` counts requests before they're pushed, and `applied`
+ * (protected by `lock`) counts requests the patcher is done with, so
+ * `dynamic_flag_flush` waits until `applied` catches up with `queued`.
+ *
+ * The remaining fields are scratch space for the patcher thread.
+ */
+static struct {
+	struct async_request *head;
+	uint64_t queued;
+	sem_t wakeup;
+	pthread_once_t once;
+	int start_error;
+
+	pthread_mutex_t lock;
+	pthread_cond_t applied_cond;
+	uint64_t applied;
+	uint64_t failed;
+
+	struct async_fold *fold;
+	struct patch_list *matches;
+	struct patch_list *touched;
+	struct patch_list *up;
+	struct patch_list *down;
+	struct patch_list *to_patch;
+} async = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.applied_cond = PTHREAD_COND_INITIALIZER,
+};
 
-		if (counts.data[offset].unhook > 0) {
+/**
+ * Applies `requests`, in order, to each flag count, and patches all
+ * flags that cross zero in one `amortize` pass.
+ *
+ * Returns the number of requests that failed.
+ */
+static uint64_t
+async_apply(const struct async_request *requests)
+{
+	struct patch_list *touched = async.touched;
+	struct patch_list *up = async.up;
+	struct patch_list *down = async.down;
+	struct patch_list *to_patch = async.to_patch;
+	uint64_t failed = 0;
+
+	touched->size = 0;
+	for (const struct async_request *it = requests; it != NULL;
+	     it = it->next) {
+		async.matches->size = 0;
+		if (find_records(it->regex, async.matches) != 0) {
+			failed++;
 			continue;
 		}
 
-		if (counts.data[offset].activation++ == 0) {
-			patch_list_push(to_patch, record);
+		for (size_t i = 0; i < async.matches->size; i++) {
+			const struct patch_record *record =
+			    async.matches->data[i];
+			struct async_fold *fold =
+			    &async.fold[record_index(record)];
+
+			if (record->type != PATCH_RECORD_FLAG) {
+				continue;
+			}
+
+			if (fold->seen == false) {
+				fold->seen = true;
+				patch_list_push(touched, record);
+			}
+
+			count_fold_push(&fold->counts, it->activate, 1);
 		}
 	}
 
-	amortize(to_patch, activate);
-	unlock();
+	up->size = 0;
+	down->size = 0;
+	lock();
+	/* Requests whose pattern doesn't compile log nothing. */
+	for (const struct async_request *it = requests; it != NULL;
+	     it = it->next) {
+		rules_push(it->activate ? RULE_ACTIVATE : RULE_DEACTIVATE, 1,
+		    NULL, it->regex);
+	}
 
-	to_patch_count = to_patch->size;
-	patch_list_destroy(to_patch);
-	return to_patch_count;
-}
+	/*
+	 * Move positive counts straight to their target, except for
+	 * counts that must cross zero: those that end at zero stop at 1,
+	 * for `deactivate_prepare`, and those that start at zero are
+	 * left to `activate_prepare`.  `counts.delta` becomes the target
+	 * count of flags in `up`.
+	 */
+	for (size_t i = 0; i < touched->size; i++) {
+		const struct patch_record *record = touched->data[i];
+		struct patch_count *count = record_count(record);
+		struct async_fold *fold = &async.fold[record_index(record)];
+		uint64_t *activation = &count->activation;
+		uint64_t current, target;
+
+		if (count->kind != NULL && fold->counts.downs > 0) {
+			kind_materialise(count->kind);
+		}
 
-/**
- * Decrements by one the activation count of all flags in `records`.
- */
-static size_t
-deactivate_all(struct patch_list *records)
-{
-	struct patch_list *to_patch;
-	size_t to_patch_count;
+		/* `activate_fast` may still increment positive counts. */
+		current = __atomic_load_n(activation, __ATOMIC_RELAXED);
+		do {
+			target = count_fold_apply(&fold->counts,
+			    count->unhook > 0, current);
+			if (current == 0) {
+				if (target > 0) {
+					fold->counts.delta = target;
+					patch_list_push(up, record);
+				}
+
+				break;
+			}
 
-	qsort(records->data, records->size,
-	    sizeof(struct patch_record *), cmp_patches);
+			if (target == 0) {
+				target = 1;
+			}
+		} while (!__atomic_compare_exchange_n(activation, &current,
+		    target, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-	to_patch = patch_list_create();
-	lock();
-	for (size_t i = 0; i < records->size; i++) {
-		const struct patch_record *record = records->data[i];
-		size_t offset = record - __start_dynamic_flag_list;
+		if (current > 0 && count_fold_apply(&fold->counts,
+		    count->unhook > 0, current) == 0) {
+			patch_list_push(down, record);
+		}
+	}
 
-		if (counts.data[offset].activation > 0 &&
-		    --counts.data[offset].activation == 0) {
-			patch_list_push(to_patch, record);
+	memcpy(to_patch->data, up->data, up->size * sizeof(up->data[0]));
+	to_patch->size = up->size;
+	activate_prepare(to_patch);
+	deactivate_prepare(down);
+	for (size_t i = 0; i < down->size; i++) {
+		patch_list_push(to_patch, down->data[i]);
+	}
+
+	to_patch->sorted = false;
+	sort_records(to_patch);
+	if (amortize(to_patch, toggle) != 0) {
+		resync(to_patch);
+		failed++;
+	} else {
+		for (size_t i = 0; i < to_patch->size; i++) {
+			struct patch_count *count = record_count(to_patch->data[i]);
+
+			if (code_is_active(to_patch->data[i])) {
+				__atomic_store_n(&count->activation,
+				    1, __ATOMIC_RELEASE);
+			}
 		}
 	}
 
-	amortize(to_patch, deactivate);
+	/* Now apply the remaining increments. */
+	for (size_t i = 0; i < up->size; i++) {
+		struct patch_count *count = record_count(up->data[i]);
+		struct async_fold *fold = &async.fold[record_index(up->data[i])];
+		uint64_t *activation = &count->activation;
+
+		if (fold->counts.delta > 1 &&
+		    __atomic_load_n(activation, __ATOMIC_RELAXED) > 0) {
+			__atomic_fetch_add(activation, fold->counts.delta - 1,
+			    __ATOMIC_RELAXED);
+		}
+	}
+
+	linger_poll();
 	unlock();
 
-	to_patch_count = to_patch->size;
-	patch_list_destroy(to_patch);
-	return to_patch_count;
+	for (size_t i = 0; i < touched->size; i++) {
+		async.fold[record_index(touched->data[i])] =
+		    (struct async_fold) { 0 };
+	}
+
+	return failed;
 }
 
 /**
- * Decrements by one the unhook count of all flags in `records`.
+ * Sizes the patcher thread's scratch space for the current number of
+ * records.
+ *
+ * Must be called between `modules_enter` and `modules_exit`.
  */
-static size_t
-rehook_all(struct patch_list *records)
+static void
+async_scratch_init(void)
 {
+	struct patch_list **lists[] = {
+		&async.matches, &async.touched, &async.up, &async.down,
+		&async.to_patch,
+	};
 
-	lock();
-	for (size_t i = 0; i < records->size; i++) {
-		const struct patch_record *record = records->data[i];
-		size_t offset = record - __start_dynamic_flag_list;
+	if (async.matches != NULL &&
+	    async.matches->capacity == modules.records) {
+		return;
+	}
+
+	free(async.fold);
+	async.fold = calloc(modules.records, sizeof(async.fold[0]));
+	assert(async.fold != NULL);
+	for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+		patch_list_destroy(*lists[i]);
+		*lists[i] = patch_list_create();
+	}
+
+	return;
+}
+
+static void *
+async_patcher(void *arg)
+{
 
-		if (counts.data[offset].unhook > 0) {
-			counts.data[offset].unhook--;
+	for (;;) {
+		struct async_request *batch = NULL;
+		struct async_request *head;
+		uint64_t failed;
+		uint64_t n = 0;
+
+		if (sem_wait(&async.wakeup) != 0) {
+			continue;
 		}
-	}
 
-	unlock();
+		head = __atomic_exchange_n(&async.head, NULL,
+		    __ATOMIC_ACQUIRE);
+		if (head == NULL) {
+			continue;
+		}
 
-	return records->size;
-}
+		/* The stack is newest first. */
+		while (head != NULL) {
+			struct async_request *next = head->next;
 
-/**
- * Increments by one the unhook count of all flags in `records`.
- */
-static size_t
-unhook_all(struct patch_list *records)
-{
+			head->next = batch;
+			batch = head;
+			head = next;
+		}
 
-	lock();
-	for (size_t i = 0; i < records->size; i++) {
-		const struct patch_record *record = records->data[i];
-		size_t offset = record - __start_dynamic_flag_list;
+		modules_enter();
+		async_scratch_init();
+		failed = async_apply(batch);
+		modules_exit();
+		while (batch != NULL) {
+			struct async_request *next = batch->next;
 
-		counts.data[offset].unhook++;
-	}
+			free(batch);
+			batch = next;
+			n++;
+		}
 
-	unlock();
+		pthread_mutex_lock(&async.lock);
+		async.applied += n;
+		async.failed += failed;
+		pthread_cond_broadcast(&async.applied_cond);
+		pthread_mutex_unlock(&async.lock);
+	}
 
-	return records->size;
+	return arg;
 }
 
-ssize_t
-dynamic_flag_activate(const char *regex)
+static void
+async_start(void)
 {
-	struct patch_list *acc;
-	int r;
+	pthread_attr_t attr;
+	pthread_t thread;
 
-	acc = patch_list_create();
-	r = find_records(regex, acc);
-	if (r != 0) {
-		goto out;
+	dynamic_flag_init_lib();
+	if (sem_init(&async.wakeup, 0, 0) != 0) {
+		async.start_error = -1;
+		return;
 	}
 
-	activate_all(acc);
-	r = acc->size;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, async_patcher, NULL) != 0) {
+		async.start_error = -1;
+	}
 
-out:
-	patch_list_destroy(acc);
-	return r;
+	pthread_attr_destroy(&attr);
+	return;
 }
 
-ssize_t
-dynamic_flag_deactivate(const char *regex)
+/**
+ * Queues an activation or deactivation request for the patcher
+ * thread, and starts the thread if necessary.
+ */
+static int
+async_push(const char *regex, bool activate)
 {
-	struct patch_list *acc;
-	int r;
+	struct async_request *request;
+	size_t length = (regex != NULL) ? strlen(regex) + 1 : 0;
 
-	acc = patch_list_create();
-	r = find_records(regex, acc);
-	if (r != 0) {
-		goto out;
+	pthread_once(&async.once, async_start);
+	if (async.start_error != 0) {
+		return -1;
 	}
 
-	deactivate_all(acc);
-	r = acc->size;
+	request = malloc(sizeof(*request) + length);
+	if (request == NULL) {
+		return -1;
+	}
 
-out:
-	patch_list_destroy(acc);
-	return r;
+	request->activate = activate;
+	request->regex = NULL;
+	if (regex != NULL) {
+		memcpy(request->storage, regex, length);
+		request->regex = request->storage;
+	}
+
+	__atomic_fetch_add(&async.queued, 1, __ATOMIC_SEQ_CST);
+	request->next = __atomic_load_n(&async.head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&async.head, &request->next,
+	    request, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		continue;
+	}
+
+	sem_post(&async.wakeup);
+	return 0;
 }
 
-ssize_t
-dynamic_flag_unhook(const char *regex)
+int
+dynamic_flag_activate_async(const char *regex)
 {
-	struct patch_list *acc;
-	int r;
 
-	acc = patch_list_create();
-	r = find_records(regex, acc);
-	if (r != 0) {
-		goto out;
-	}
+	return async_push(regex, true);
+}
 
-	unhook_all(acc);
-	r = acc->size;
+int
+dynamic_flag_deactivate_async(const char *regex)
+{
 
-out:
-	patch_list_destroy(acc);
-	return r;
+	return async_push(regex, false);
 }
 
-ssize_t
-dynamic_flag_rehook(const char *regex)
+int
+dynamic_flag_flush(void)
 {
-	struct patch_list *acc;
+	uint64_t target;
 	int r;
 
-	acc = patch_list_create();
-	r = find_records(regex, acc);
-	if (r != 0) {
-		goto out;
+	assert(txn_owner_depth == 0 &&
+	    "dynamic_flag_flush must not be called in a transaction");
+
+	target = __atomic_load_n(&async.queued, __ATOMIC_SEQ_CST);
+	if (target == 0) {
+		return 0;
 	}
 
-	rehook_all(acc);
-	r = acc->size;
+	pthread_mutex_lock(&async.lock);
+	while (async.applied < target) {
+		pthread_cond_wait(&async.applied_cond, &async.lock);
+	}
 
-out:
-	patch_list_destroy(acc);
+	r = (async.failed > 0) ? -1 : 0;
+	async.failed = 0;
+	pthread_mutex_unlock(&async.lock);
 	return r;
 }
 
@@ -810,8 +6549,8 @@ cmp_patches_alpha(const void *x, const void *y)
 {
 	const struct patch_record *const *a = x;
 	const struct patch_record *const *b = y;
-	const char *a_name = (*a)->name_doc;
-	const char *b_name = (*b)->name_doc;
+	const char *a_name = record_name((*a));
+	const char *b_name = record_name((*b));
 	const char *a_colon, *b_colon;
 	unsigned long long a_line, b_line;
 	ssize_t colon_idx;
@@ -835,11 +6574,8 @@ cmp_patches_alpha(const void *x, const void *y)
 
 	/* Same kind, name, file.  Show longer docstrings first. */
 	{
-		const char *a_doc;
-		const char *b_doc;
-
-		a_doc = a_colon + strlen(a_colon) + 1;
-		b_doc = b_colon + strlen(b_colon) + 1;
+		const char *a_doc = record_doc(*a);
+		const char *b_doc = record_doc(*b);
 
 		/* Only check if one has a docstring. */
 		if (a_doc[0] != '\0' || b_doc[0] != '\0') {
@@ -874,13 +6610,69 @@ cmp_patches_alpha(const void *x, const void *y)
 	return 0;
 }
 
+/**
+ * Fills `state` for `record`.  Callers should read counts between
+ * `counts_read_begin` and `counts_read_retry`.
+ */
+static void
+record_state(const struct patch_record *record,
+    struct dynamic_flag_state *state)
+{
+	const struct patch_count *count = record_count(record);
+
+	*state = (struct dynamic_flag_state) {
+		.name = record_name(record),
+		.doc = record_doc(record),
+
+		.activation = __atomic_load_n(&count->activation,
+		    __ATOMIC_RELAXED),
+		.unhook = __atomic_load_n(&count->unhook, __ATOMIC_RELAXED),
+
+		.hook = record_hook(record),
+		.destination = record_destination(record),
+		.cases = record->cases,
+	};
+
+	if (record->type == PATCH_RECORD_FLAG) {
+		state->activation += kind_pending(__atomic_load_n(
+		    &count->kind, __ATOMIC_ACQUIRE));
+	}
+
+	if (record->type == PATCH_RECORD_CALL) {
+		state->destination = call_default(record);
+		state->target = (const void *)(uintptr_t)state->activation;
+		state->activation = (state->activation != 0) ? 1 : 0;
+	}
+
+	return;
+}
+
+uint64_t
+dynamic_flag_generation(void)
+{
+	uint64_t r;
+
+	pthread_mutex_lock(&threads.lock);
+	r = threads.retired;
+	for (const struct thread_state *it = threads.list; it != NULL;
+	     it = it->next) {
+		r += __atomic_load_n(&it->fast_updates, __ATOMIC_ACQUIRE);
+	}
+
+	pthread_mutex_unlock(&threads.lock);
+	return r + (__atomic_load_n(&counts_seq, __ATOMIC_ACQUIRE) >> 1);
+}
+
 ssize_t
 dynamic_flag_list_state(const char *regex,
     ssize_t (*cb)(void *ctx, const struct dynamic_flag_state *), void *ctx)
 {
+	struct dynamic_flag_state *states = NULL;
 	struct patch_list *acc;
+	uint64_t seq;
 	ssize_t r;
 
+	modules_enter();
 	acc = patch_list_create();
 	r = find_records(regex, acc);
 	if (r != 0) {
@@ -890,28 +6682,26 @@ dynamic_flag_list_state(const char *regex,
 	qsort(acc->data, acc->size,
 	    sizeof(struct patch_record *), cmp_patches_alpha);
 
-	for (size_t i = 0; i < acc->size; i++) {
-		struct dynamic_flag_state state;
-		const struct patch_record *record = acc->data[i];
-		size_t record_idx = record - __start_dynamic_flag_list;
-
-		state = (struct dynamic_flag_state) {
-			.name = record->name_doc,
-			.doc = record->name_doc + 1 + strlen(record->name_doc),
-
-			/* Yeah, this is racy. */
-			.activation = counts.data[record_idx].activation,
-			.unhook = counts.data[record_idx].unhook,
+	states = calloc(acc->size, sizeof(*states));
+	if (states == NULL) {
+		r = -1;
+		goto out;
+	}
 
-			.hook = record->hook,
-			.destination = record->destination,
-		};
+	/* Snapshot all counts first: callbacks may be slow. */
+	do {
+		seq = counts_read_begin();
+		for (size_t i = 0; i < acc->size; i++) {
+			record_state(acc->data[i], &states[i]);
+		}
+	} while (counts_read_retry(seq));
 
+	for (size_t i = 0; i < acc->size; i++) {
 		if (i > 0 &&
-		    strcmp(acc->data[i - 1]->name_doc, acc->data[i]->name_doc) == 0)
-			state.duplicate = 1;
+		    strcmp(record_name(acc->data[i - 1]), record_name(acc->data[i])) == 0)
+			states[i].duplicate = 1;
 
-		r = cb(ctx, &state);
+		r = cb(ctx, &states[i]);
 		if (r != 0)
 			goto out;
 	}
@@ -919,7 +6709,9 @@ dynamic_flag_list_state(const char *regex,
 	r = acc->size;
 
 out:
+	free(states);
 	patch_list_destroy(acc);
+	modules_exit();
 	return r;
 }
 
@@ -933,7 +6725,19 @@ dynamic_flag_list_fprintf_cb(void *ctx, const struct dynamic_flag_state *state)
 	if (state->duplicate == true)
 		return 0;
 
-	if (state->activation > 0) {
+	if (state->cases > 0) {
+		int r;
+
+		r = snprintf(activation, sizeof(activation),
+		    "case %" PRIu64 "/%u", state->activation, state->cases);
+		assert((size_t)r < sizeof(activation));
+	} else if (state->target != NULL) {
+		int r;
+
+		r = snprintf(activation, sizeof(activation), "calls %p",
+		    state->target);
+		assert((size_t)r < sizeof(activation));
+	} else if (state->activation > 0) {
 		int r;
 
 		r = snprintf(activation, sizeof(activation), "%" PRIu64 "",
@@ -955,11 +6759,19 @@ dynamic_flag_list_fprintf_cb(void *ctx, const struct dynamic_flag_state *state)
 }
 
 ssize_t
-dynamic_flag_activate_kind_inner(const void **start, const void **end,
+dynamic_flag_activate_kind_inner(const int32_t *start, const int32_t *end,
     const char *regex)
 {
-	struct patch_list *acc;
-	int r;
+	const char *kind = record_name(relative_pointer(start));
+	struct patch_list *acc = NULL;
+	ssize_t r;
+
+	modules_enter();
+	if (regex == NULL) {
+		/* Only logs the updates that don't go through the kind. */
+		r = activate_kind_all(start, end);
+		goto out;
+	}
 
 	acc = patch_list_create();
 	r = find_records_kind(start, end, regex, acc);
@@ -967,44 +6779,183 @@ dynamic_flag_activate_kind_inner(const void **start, const void **end,
 		goto out;
 	}
 
-	activate_all(acc);
-	r = acc->size;
+	r = (activate_all(acc, &(struct rule_log) { kind, regex }) < 0) ?
+	    -1 : (ssize_t)acc->size;
 
 out:
+
 	patch_list_destroy(acc);
+	modules_exit();
 	return r;
 }
 
 ssize_t
-dynamic_flag_deactivate_kind_inner(const void **start, const void **end,
+dynamic_flag_deactivate_kind_inner(const int32_t *start, const int32_t *end,
     const char *regex)
+{
+	const char *kind = record_name(relative_pointer(start));
+	struct patch_list *acc = NULL;
+	ssize_t r;
+
+	modules_enter();
+	if (regex == NULL) {
+		/* Only logs the updates that don't go through the kind. */
+		r = deactivate_kind_all(start, end);
+		goto out;
+	}
+
+	acc = patch_list_create();
+	r = find_records_kind(start, end, regex, acc);
+	if (r != 0) {
+		goto out;
+	}
+
+	r = (deactivate_all(acc, &(struct rule_log) { kind, regex }) < 0) ?
+	    -1 : (ssize_t)acc->size;
+
+out:
+
+	patch_list_destroy(acc);
+	modules_exit();
+	return r;
+}
+
+ssize_t
+dynamic_flag_select_kind_inner(const int32_t *start, const int32_t *end,
+    const char *regex, unsigned int which)
 {
 	struct patch_list *acc;
-	int r;
+	ssize_t r;
 
+	modules_enter();
 	acc = patch_list_create();
 	r = find_records_kind(start, end, regex, acc);
 	if (r != 0) {
 		goto out;
 	}
 
-	deactivate_all(acc);
-	r = acc->size;
+	r = select_all(acc, which);
+
+out:
+	patch_list_destroy(acc);
+	modules_exit();
+	return r;
+}
+
+ssize_t
+dynamic_flag_set_call_kind_inner(const int32_t *start, const int32_t *end,
+    const char *regex, void *fn)
+{
+	struct patch_list *acc;
+	ssize_t r;
+
+	modules_enter();
+	acc = patch_list_create();
+	r = find_records_kind(start, end, regex, acc);
+	if (r != 0) {
+		goto out;
+	}
+
+	r = set_call_all(acc, fn);
 
 out:
 	patch_list_destroy(acc);
+	modules_exit();
 	return r;
 }
 
+struct dynamic_flag_group *
+dynamic_flag_group_create_kind_inner(const int32_t *start, const int32_t *end,
+    const char *regex)
+{
+	struct dynamic_flag_group *group = NULL;
+	struct patch_list *acc;
+
+	dynamic_flag_init_lib();
+	modules_enter();
+	acc = patch_list_create();
+	if (find_records_kind(start, end, regex, acc) == 0) {
+		group = group_create(acc);
+	}
+
+	patch_list_destroy(acc);
+	modules_exit();
+	return group;
+}
+
+int
+dynamic_flag_set_grace_period_kind_inner(const int32_t *start,
+    const int32_t *end, uint64_t grace_ns)
+{
+	struct patch_list *acc;
+
+	modules_enter();
+	acc = patch_list_create();
+	find_records_kind(start, end, NULL, acc);
+
+	lock();
+	grace_policy_set(&kind_get(start, end)->grace, acc, grace_ns);
+	linger_poll();
+	unlock();
+
+	patch_list_destroy(acc);
+	modules_exit();
+	return 0;
+}
+
 void
 dynamic_flag_init_lib(void)
 {
 
+	modules_enter();
 	lock();
 	unlock();
+	modules_exit();
 	return;
 }
 
+int
+dynamic_flag_set_backend(enum dynamic_flag_backend which)
+{
+	int r = 0;
+
+	modules_enter();
+	lock();
+	switch (which) {
+	case DYNAMIC_FLAG_BACKEND_MPROTECT:
+		r = probe_backend(&mprotect_backend, modules.data[0].start);
+		if (r == 0) {
+			backend = &mprotect_backend;
+		}
+		break;
+	case DYNAMIC_FLAG_BACKEND_ALIAS:
+		r = alias_map_init();
+		if (r == 0) {
+			backend = &alias_backend;
+		}
+		break;
+	case DYNAMIC_FLAG_BACKEND_PROC_MEM:
+		r = proc_mem_init();
+		if (r == 0) {
+			backend = &proc_mem_backend;
+		}
+		break;
+	default:
+		r = -1;
+	}
+
+	unlock();
+	modules_exit();
+	return r;
+}
+
+const char *
+dynamic_flag_backend_name(void)
+{
+
+	return backend->name;
+}
+
 void
 dynamic_flag_set_minimal_write_mode(bool is_minimal)
 {
@@ -1012,4 +6963,76 @@ dynamic_flag_set_minimal_write_mode(bool is_minimal)
 	minimal_write_mode = is_minimal;
 	return;
 }
+
+int
+dynamic_flag_set_sync_core_mode(bool sync_core)
+{
+	int r = 0;
+
+	lock();
+	if (sync_core) {
+		r = register_membarrier(
+		    MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE,
+		    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE);
+	}
+
+	if (r == 0) {
+		sync_core_mode = sync_core;
+	}
+
+	unlock();
+	return (r == 0) ? 0 : -1;
+}
+
+void
+dynamic_flag_set_coalesce_gap(size_t pages)
+{
+
+	lock();
+	coalesce_gap = pages;
+	unlock();
+	return;
+}
+
+void
+dynamic_flag_set_adaptive_grace(uint64_t threshold, uint64_t max_grace_ns)
+{
+
+	lock();
+	adaptive_grace.threshold = threshold;
+	adaptive_grace.max = max_grace_ns;
+	unlock();
+	return;
+}
+
+ssize_t
+dynamic_flag_sweep(void)
+{
+	ssize_t r;
+
+	modules_enter();
+	lock();
+	r = linger_sweep(now_ns());
+	unlock();
+	modules_exit();
+	return r;
+}
+
+void
+dynamic_flag_pattern_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+
+	pthread_mutex_lock(&threads.lock);
+	*hits = threads.retired_hits;
+	*misses = threads.retired_misses;
+	for (const struct thread_state *it = threads.list; it != NULL;
+	     it = it->next) {
+		*hits += __atomic_load_n(&it->cache_hits, __ATOMIC_RELAXED);
+		*misses += __atomic_load_n(&it->cache_misses,
+		    __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&threads.lock);
+	return;
+}
 #endif /* DYNAMIC_FLAG_IMPLEMENTATION_STYLE > 0 */
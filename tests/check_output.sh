@@ -0,0 +1,19 @@
+#!/bin/sh
+#
+# Usage: check_output.sh EXPECTED PROGRAM [ARGS...]
+#
+# Runs PROGRAM and compares its standard output with the file
+# EXPECTED.  Flag locations (`@file:line`) depend on the build
+# directory and on the library's sources, so they're ignored.
+
+set -e
+
+expected="$1"
+shift
+tmp="$(mktemp -d)"
+trap 'rm -rf "$tmp"' EXIT
+
+"$@" > "$tmp/output"
+sed 's/@[^ ]*//' "$expected" > "$tmp/expected"
+sed 's/@[^ ]*//' "$tmp/output" > "$tmp/actual"
+diff -u "$tmp/expected" "$tmp/actual"
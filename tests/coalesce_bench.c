@@ -0,0 +1,94 @@
+/*
+ * Measures the cost of flipping a kind of flags with the mprotect
+ * backend, for synthetic layouts of hooks in the text segment, and
+ * for several `dynamic_flag_set_coalesce_gap` settings.
+ *
+ * Usage: dynamic_flag_bench_coalesce [iterations]
+ *
+ * Each layout is a kind of 16 flags, in functions padded with a
+ * fixed number of (skipped) bytes: `dense` packs hooks in the same
+ * page, `sparse` leaves 3 untouched pages between hooks, and `far`
+ * leaves 127.
+ */
+#include "dynamic_flag.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PAGE 4096
+
+#define SITE(KIND, I, GAP)						\
+	__attribute__((__noinline__, __used__)) static int		\
+	site_##KIND##_##I(void)						\
+	{								\
+									\
+		asm volatile("jmp 1f\n\t.skip %c0, 0xcc\n1:" :: "i"(GAP)); \
+		return DF_OPT(KIND, site_##I) ? 1 : 0;			\
+	}
+
+#define SITES(KIND, GAP)						\
+	SITE(KIND, 0, GAP) SITE(KIND, 1, GAP) SITE(KIND, 2, GAP)	\
+	SITE(KIND, 3, GAP) SITE(KIND, 4, GAP) SITE(KIND, 5, GAP)	\
+	SITE(KIND, 6, GAP) SITE(KIND, 7, GAP) SITE(KIND, 8, GAP)	\
+	SITE(KIND, 9, GAP) SITE(KIND, 10, GAP) SITE(KIND, 11, GAP)	\
+	SITE(KIND, 12, GAP) SITE(KIND, 13, GAP) SITE(KIND, 14, GAP)	\
+	SITE(KIND, 15, GAP)
+
+SITES(dense, 64)
+SITES(sparse, 4 * PAGE)
+SITES(far, 128 * PAGE)
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define BENCH(KIND, LABEL, ITERATIONS)					\
+	do {								\
+		uint64_t begin, end;					\
+									\
+		begin = now_ns();					\
+		for (size_t i = 0; i < (ITERATIONS); i++) {		\
+			dynamic_flag_activate_kind(KIND, NULL);		\
+			dynamic_flag_deactivate_kind(KIND, NULL);	\
+		}							\
+									\
+		end = now_ns();						\
+		printf("%-16s %-8s %10.1f ns/flip\n", (LABEL), #KIND,	\
+		    (double)(end - begin) / (2.0 * (ITERATIONS)));	\
+	} while (0)
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		size_t gap;
+	} gaps[] = {
+		{ "adjacent", 0 },
+		{ "gap=64", 64 },
+		{ "whole span", SIZE_MAX },
+	};
+	size_t iterations = (argc > 1) ? strtoull(argv[1], NULL, 10) : 1000;
+
+	dynamic_flag_init_lib();
+	if (dynamic_flag_set_backend(DYNAMIC_FLAG_BACKEND_MPROTECT) != 0) {
+		printf("mprotect backend unavailable\n");
+		return 0;
+	}
+
+	for (size_t i = 0; i < sizeof(gaps) / sizeof(gaps[0]); i++) {
+		dynamic_flag_set_coalesce_gap(gaps[i].gap);
+		BENCH(dense, gaps[i].name, iterations);
+		BENCH(sparse, gaps[i].name, iterations);
+		BENCH(far, gaps[i].name, iterations);
+	}
+
+	return 0;
+}
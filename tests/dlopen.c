@@ -0,0 +1,176 @@
+#include "dynamic_flag.h"
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void *
+load(const char *path, void (**run)(void), void (**dispatch)(void))
+{
+	void *module;
+
+	module = dlopen(path, RTLD_NOW);
+	if (module == NULL) {
+		fprintf(stderr, "dlopen failed: %s\n", dlerror());
+		exit(1);
+	}
+
+	*run = (void (*)(void))dlsym(module, "dlopen_module_run");
+	if (*run == NULL) {
+		fprintf(stderr, "dlsym failed: %s\n", dlerror());
+		exit(1);
+	}
+
+	*dispatch = (void (*)(void))dlsym(module, "dlopen_module_dispatch");
+	if (*dispatch == NULL) {
+		fprintf(stderr, "dlsym failed: %s\n", dlerror());
+		exit(1);
+	}
+
+	return module;
+}
+
+int
+main(int argc, char **argv)
+{
+	void (*run)(void);
+	void (*dispatch)(void);
+	void *module;
+	ssize_t r;
+	uint64_t hits, misses;
+	uint64_t new_hits, new_misses;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s MODULE\n", argv[0]);
+		return 1;
+	}
+
+	printf("Loading the module before init\n");
+	module = load(argv[1], &run, &dispatch);
+	dynamic_flag_init_lib();
+	dynamic_flag_list_state("module:", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	/*
+	 * Expected:
+	 * Loading the module before init
+	 * module:default@tests/dlopen_module.c:14 (1)
+	 * module:feature@tests/dlopen_module.c:10 (off)
+	 * module:unhooked@tests/dlopen_module.c:18 (off)
+	 * module:default
+	 */
+	run();
+
+	printf("\nActivating module:feature\n");
+	r = dynamic_flag_activate("module:feature");
+	printf("activation matched %zd\n", r);
+	/*
+	 * Expected:
+	 * Activating module:feature
+	 * activation matched 1
+	 * module:feature
+	 * module:default
+	 */
+	run();
+	dynamic_flag_deactivate("module:feature");
+
+	printf("\nSelecting case 2, calling dlopen_module_cube\n");
+	r = dynamic_flag_select("dispatch:impl", 2);
+	printf("selection matched %zd\n", r);
+	r = dynamic_flag_set_call("dispatch:call",
+	    dlsym(module, "dlopen_module_cube"));
+	printf("retargeting matched %zd\n", r);
+	/*
+	 * Expected:
+	 * Selecting case 2, calling dlopen_module_cube
+	 * selection matched 1
+	 * retargeting matched 1
+	 * dispatch:impl case 2
+	 * dispatch:call 27
+	 */
+	dispatch();
+
+	printf("\nRestoring the defaults\n");
+	dynamic_flag_select("dispatch:impl", 0);
+	dynamic_flag_set_call("dispatch:call", NULL);
+	/*
+	 * Expected:
+	 * Restoring the defaults
+	 * dispatch:impl case 0
+	 * dispatch:call 9
+	 */
+	dispatch();
+
+	printf("\nUnloading the module\n");
+	dlclose(module);
+	dynamic_flag_poll_modules();
+	r = dynamic_flag_list_state("module:", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	printf("listed %zd flags\n", r);
+	printf("activation matched %zd\n",
+	    dynamic_flag_activate("module:feature"));
+	dynamic_flag_deactivate("module:default");
+	dynamic_flag_unhook("module:unhooked");
+	dynamic_flag_activate("module:unhooked");
+	/*
+	 * Expected:
+	 * Unloading the module
+	 * listed 0 flags
+	 * activation matched 0
+	 */
+
+	printf("\nReloading the module\n");
+	module = load(argv[1], &run, &dispatch);
+	/*
+	 * Expected:
+	 * Reloading the module
+	 * module:default
+	 */
+	run();
+
+	printf("\nPolling modules\n");
+	dynamic_flag_poll_modules();
+	dynamic_flag_list_state("module:", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	/*
+	 * The module's flags replay the calls made while it was unloaded,
+	 * as if it had been loaded first.
+	 *
+	 * Expected:
+	 * Polling modules
+	 * module:default@tests/dlopen_module.c:14 (off)
+	 * module:feature@tests/dlopen_module.c:10 (1)
+	 * module:unhooked@tests/dlopen_module.c:18 (off, unhook=1)
+	 * module:feature
+	 */
+	run();
+
+	printf("\nPattern cache after polling\n");
+	dynamic_flag_pattern_cache_stats(&hits, &misses);
+	r = dynamic_flag_deactivate("module:feature");
+	dynamic_flag_pattern_cache_stats(&new_hits, &new_misses);
+	printf("deactivation matched %zd: %llu hits, %llu misses\n", r,
+	    (unsigned long long)(new_hits - hits),
+	    (unsigned long long)(new_misses - misses));
+	/*
+	 * Polling flushed the cached match for module:feature.
+	 *
+	 * Expected:
+	 * Pattern cache after polling
+	 * deactivation matched 1: 0 hits, 1 misses
+	 */
+	run();
+
+	printf("\nUnloading the module again\n");
+	dlclose(module);
+	dynamic_flag_poll_modules();
+	r = dynamic_flag_list_state("module:", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	printf("listed %zd flags\n", r);
+	/*
+	 * Expected:
+	 * Unloading the module again
+	 * listed 0 flags
+	 */
+	return 0;
+}
@@ -0,0 +1,62 @@
+#include "dynamic_flag.h"
+
+#include <stdio.h>
+
+/* Loaded by tests/dlopen.c. */
+void
+dlopen_module_run(void)
+{
+
+	if (DF_FEATURE(module, feature)) {
+		printf("module:feature\n");
+	}
+
+	if (DF_DEFAULT(module, default)) {
+		printf("module:default\n");
+	}
+
+	if (DF_FEATURE(module, unhooked)) {
+		printf("module:unhooked\n");
+	}
+
+	return;
+}
+
+int
+dlopen_module_square(int x)
+{
+
+	return x * x;
+}
+
+int
+dlopen_module_cube(int x)
+{
+
+	return x * x * x;
+}
+
+/*
+ * The module is position-independent, so DF_CALL reaches its
+ * default callee through the PLT.
+ */
+void
+dlopen_module_dispatch(void)
+{
+
+	switch (DF_SWITCH(dispatch, impl, 3)) {
+	case 0:
+		printf("dispatch:impl case 0\n");
+		break;
+	case 1:
+		printf("dispatch:impl case 1\n");
+		break;
+	case 2:
+		printf("dispatch:impl case 2\n");
+		break;
+	}
+
+	printf("dispatch:call %d\n", DF_CALL(dispatch, call,
+	    dlopen_module_square, 3));
+	return;
+}
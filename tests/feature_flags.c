@@ -1,8 +1,12 @@
 #include "dynamic_flag.h"
 
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 static __attribute__((noinline, cold)) void run_all_tail(void)
 {
@@ -66,6 +70,100 @@ run_all(void)
 	return;
 }
 
+/* The library's own sections must not collide with this kind's list. */
+static void
+run_init(void)
+{
+
+	if (DF_FEATURE(init, printf)) {
+		printf("init:printf\n");
+	}
+
+	return;
+}
+
+#define FLIPPERS 4
+#define FLIPS 10000
+
+/* Long enough to check that code stays patched before it expires. */
+#define GRACE_PERIOD_NS (200 * 1000 * 1000)
+
+/*
+ * Adaptive grace periods: eight bursts over the threshold double the
+ * base period up to the maximum, and two calm seconds halve it twice,
+ * below the check's delay.
+ */
+#define ADAPTIVE_THRESHOLD 4
+#define ADAPTIVE_BASE_NS (10 * 1000 * 1000)
+#define ADAPTIVE_MAX_NS (400 * 1000 * 1000)
+#define ADAPTIVE_CHECK_NS (150 * 1000 * 1000)
+
+static void *
+flip_regex(void *arg)
+{
+	const char *regex = arg;
+
+	for (size_t i = 0; i < FLIPS; i++) {
+		dynamic_flag_activate(regex);
+		dynamic_flag_deactivate(regex);
+	}
+
+	return NULL;
+}
+
+static void *
+flip_kind(void *arg)
+{
+
+	(void)arg;
+	for (size_t i = 0; i < FLIPS; i++) {
+		dynamic_flag_activate_kind(on, "printf[12]");
+		dynamic_flag_deactivate_kind(on, "printf[12]");
+	}
+
+	return NULL;
+}
+
+/* Flips more distinct patterns than the pattern cache holds. */
+static void *
+flip_churn(void *arg)
+{
+	char pattern[32];
+
+	(void)arg;
+	for (size_t i = 0; i < FLIPS; i++) {
+		snprintf(pattern, sizeof(pattern), "none:churn%zu", i % 256);
+		dynamic_flag_activate(pattern);
+		dynamic_flag_deactivate(pattern);
+	}
+
+	return NULL;
+}
+
+static void *
+flip_group(void *arg)
+{
+	struct dynamic_flag_group *group = arg;
+
+	for (size_t i = 0; i < FLIPS; i++) {
+		dynamic_flag_group_activate(group);
+		dynamic_flag_group_deactivate(group);
+	}
+
+	return NULL;
+}
+
+static volatile sig_atomic_t traps;
+
+static void
+count_trap(int signo)
+{
+
+	(void)signo;
+	traps++;
+	return;
+}
+
 static void
 wrapped_activate(const char *pat)
 {
@@ -87,6 +185,14 @@ wrapped_deactivate(const char *pat)
 int
 main(int argc, char **argv)
 {
+	pthread_t flippers[FLIPPERS];
+	struct dynamic_flag_group *group;
+	uint64_t hits, misses;
+	uint64_t new_hits, new_misses;
+	uint64_t generation;
+
+	/* The library must chain SIGTRAPs that aren't its own to us. */
+	signal(SIGTRAP, count_trap);
 
 	printf("Before init\n");
 	/*
@@ -109,12 +215,18 @@ main(int argc, char **argv)
 		dynamic_flag_set_minimal_write_mode(atoi(argv[1]));
 	}
 
+	if (argc > 2 && dynamic_flag_set_backend(atoi(argv[2])) != 0) {
+		fprintf(stderr, "Failed to set backend %s\n", argv[2]);
+		return 1;
+	}
+
 	printf("\nList all flags\n");
 	/*
 	 * Expected:
 	 * List all flags
 	 * feature_flag:default_off@tests/feature_flags.c:55 (off): DF_FEATURE flags are classic feature flags: off initially and if the dynamic_flag machine can't find them, and the compiler expects them to be disabled
 	 * feature_flag:default_on@tests/feature_flags.c:48 (on)
+	 * init:printf@tests/feature_flags.c:77 (off)
 	 * none:dummy@src/dynamic_flag.c:158 (off): This dummy flag does nothing. It lets the dynamic_flag library compile even when no other flag is defined.
 	 * off:printf1@tests/feature_flags.c:12 (off): DF_OPT flags are usually disabled, but should always be safe to enable
 	 * off:printf2@tests/feature_flags.c:16 (off)
@@ -284,5 +396,436 @@ main(int argc, char **argv)
 	 */
 	run_all();
 
+	printf("\nTransaction\n");
+	dynamic_flag_txn_begin();
+	dynamic_flag_activate("feature_flag:.*");
+	dynamic_flag_unhook("feature_flag:default_on");
+	dynamic_flag_deactivate("feature_flag:.*");
+	dynamic_flag_activate("feature_flag:.*");
+	/*
+	 * Expected:
+	 * Transaction
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf2
+	 */
+	run_all();
+
+	printf("\nCommitted\n");
+	/* feature_flag:default_on crossed zero and came back: no patch. */
+	printf("patched: %zd\n", dynamic_flag_txn_commit());
+	dynamic_flag_rehook("feature_flag:default_on");
+	/*
+	 * Expected:
+	 * Committed
+	 * patched: 1
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nActivating untouched:printf1 exactly\n");
+	dynamic_flag_activate_exact("untouched:printf1");
+	printf("untouched:printf1 is active: %d\n",
+	    dynamic_flag_is_active("untouched:printf1"));
+	printf("on:printf1 is active: %d\n",
+	    dynamic_flag_is_active("on:printf1"));
+	printf("no:such_flag is active: %d\n",
+	    dynamic_flag_is_active("no:such_flag"));
+	/*
+	 * Expected:
+	 * Activating untouched:printf1 exactly
+	 * untouched:printf1 is active: 1
+	 * on:printf1 is active: 0
+	 * no:such_flag is active: -1
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	/* Literal prefixes use the name index, and must match like regexes. */
+	printf("\nListing on:printf\n");
+	dynamic_flag_list_state("on:printf", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	printf("\nListing on:print[f]\n");
+	dynamic_flag_list_state("on:print[f]", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	printf("\nListing on:printf1 and (on|off):printf1\n");
+	dynamic_flag_list_state("on:printf1", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	dynamic_flag_list_state("(on|off):printf1",
+	    dynamic_flag_list_fprintf_cb, stdout);
+	/*
+	 * Expected:
+	 * Listing on:printf
+	 * on:printf1@tests/feature_flags.c:48 (off): DF_DEFAULT flags are enabled initially and when the library can't find them.
+	 * on:printf2@tests/feature_flags.c:53 (off): DF_DEFAULT_SLOW flags are enabled like DF_DEFAULT, but instruct the compiler to expect them to be disabled.
+	 * on:printf3@tests/feature_flags.c:59 (1)
+	 *
+	 * Listing on:print[f]
+	 * on:printf1@tests/feature_flags.c:48 (off): DF_DEFAULT flags are enabled initially and when the library can't find them.
+	 * on:printf2@tests/feature_flags.c:53 (off): DF_DEFAULT_SLOW flags are enabled like DF_DEFAULT, but instruct the compiler to expect them to be disabled.
+	 * on:printf3@tests/feature_flags.c:59 (1)
+	 *
+	 * Listing on:printf1 and (on|off):printf1
+	 * on:printf1@tests/feature_flags.c:48 (off): DF_DEFAULT flags are enabled initially and when the library can't find them.
+	 * off:printf1@tests/feature_flags.c:38 (1): DF_OPT flags are usually disabled, but should always be safe to enable
+	 * on:printf1@tests/feature_flags.c:48 (off): DF_DEFAULT flags are enabled initially and when the library can't find them.
+	 */
+
+	printf("\nPattern cache\n");
+	dynamic_flag_pattern_cache_stats(&hits, &misses);
+	dynamic_flag_activate("off:printf2");
+	dynamic_flag_pattern_cache_stats(&new_hits, &new_misses);
+	printf("first activation: %llu hits, %llu misses\n",
+	    (unsigned long long)(new_hits - hits),
+	    (unsigned long long)(new_misses - misses));
+	dynamic_flag_deactivate("off:printf2");
+	dynamic_flag_activate("off:printf2");
+	dynamic_flag_deactivate("off:printf2");
+	dynamic_flag_pattern_cache_stats(&hits, &misses);
+	printf("three more flips: %llu hits, %llu misses\n",
+	    (unsigned long long)(hits - new_hits),
+	    (unsigned long long)(misses - new_misses));
+	/*
+	 * Expected:
+	 * Pattern cache
+	 * first activation: 0 hits, 1 misses
+	 * three more flips: 3 hits, 0 misses
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nActivating group on:printf\n");
+	group = dynamic_flag_group_create("on:printf");
+	printf("group size: %zd\n", dynamic_flag_group_activate(group));
+	dynamic_flag_list_state("on:printf", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	/*
+	 * Expected:
+	 * Activating group on:printf
+	 * group size: 3
+	 * on:printf1@tests/feature_flags.c:48 (1): DF_DEFAULT flags are enabled initially and when the library can't find them.
+	 * on:printf2@tests/feature_flags.c:53 (1): DF_DEFAULT_SLOW flags are enabled like DF_DEFAULT, but instruct the compiler to expect them to be disabled.
+	 * on:printf3@tests/feature_flags.c:59 (2)
+	 * off:printf1
+	 * on:printf1
+	 * on:printf2
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nDeactivating group on:printf\n");
+	dynamic_flag_group_deactivate(group);
+	/*
+	 * Expected:
+	 * Deactivating group on:printf
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	dynamic_flag_group_destroy(group);
+
+	/* Counts must stay exact when the fast path races with patching. */
+	printf("\nFlipping on:printf from %d threads\n", FLIPPERS);
+	for (size_t i = 0; i < FLIPPERS; i++) {
+		pthread_create(&flippers[i], NULL, flip_regex, "on:printf");
+	}
+
+	for (size_t i = 0; i < FLIPPERS; i++) {
+		pthread_join(flippers[i], NULL);
+	}
+
+	dynamic_flag_list_state("on:printf", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	/*
+	 * Expected:
+	 * Flipping on:printf from 4 threads
+	 * on:printf1@tests/feature_flags.c:48 (off): DF_DEFAULT flags are enabled initially and when the library can't find them.
+	 * on:printf2@tests/feature_flags.c:53 (off): DF_DEFAULT_SLOW flags are enabled like DF_DEFAULT, but instruct the compiler to expect them to be disabled.
+	 * on:printf3@tests/feature_flags.c:59 (1)
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	/* Lookups race with evictions from the pattern cache. */
+	printf("\nFlipping on:printf by regex and by kind from %d threads\n",
+	    FLIPPERS);
+	pthread_create(&flippers[0], NULL, flip_regex, "on:print[f][12]");
+	pthread_create(&flippers[1], NULL, flip_regex, "^on:printf");
+	pthread_create(&flippers[2], NULL, flip_kind, NULL);
+	pthread_create(&flippers[3], NULL, flip_churn, NULL);
+	for (size_t i = 0; i < FLIPPERS; i++) {
+		pthread_join(flippers[i], NULL);
+	}
+
+	dynamic_flag_list_state("on:printf", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	/*
+	 * Expected:
+	 * Flipping on:printf by regex and by kind from 4 threads
+	 * on:printf1@tests/feature_flags.c:48 (off): DF_DEFAULT flags are enabled initially and when the library can't find them.
+	 * on:printf2@tests/feature_flags.c:53 (off): DF_DEFAULT_SLOW flags are enabled like DF_DEFAULT, but instruct the compiler to expect them to be disabled.
+	 * on:printf3@tests/feature_flags.c:59 (1)
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	/* Threads share the group's records. */
+	printf("\nFlipping group on:printf from %d threads\n", FLIPPERS);
+	group = dynamic_flag_group_create("on:printf");
+	for (size_t i = 0; i < FLIPPERS; i++) {
+		pthread_create(&flippers[i], NULL, flip_group, group);
+	}
+
+	for (size_t i = 0; i < FLIPPERS; i++) {
+		pthread_join(flippers[i], NULL);
+	}
+
+	dynamic_flag_group_destroy(group);
+	dynamic_flag_list_state("on:printf", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	/*
+	 * Expected:
+	 * Flipping group on:printf from 4 threads
+	 * on:printf1@tests/feature_flags.c:48 (off): DF_DEFAULT flags are enabled initially and when the library can't find them.
+	 * on:printf2@tests/feature_flags.c:53 (off): DF_DEFAULT_SLOW flags are enabled like DF_DEFAULT, but instruct the compiler to expect them to be disabled.
+	 * on:printf3@tests/feature_flags.c:59 (1)
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nActivating off twice, deactivating it once\n");
+	dynamic_flag_activate_kind(off, NULL);
+	dynamic_flag_activate_kind(off, NULL);
+	dynamic_flag_list_state("off:", dynamic_flag_list_fprintf_cb, stdout);
+	dynamic_flag_deactivate_kind(off, NULL);
+	/*
+	 * Expected:
+	 * Activating off twice, deactivating it once
+	 * off:printf1@tests/feature_flags.c:38 (3): DF_OPT flags are usually disabled, but should always be safe to enable
+	 * off:printf2@tests/feature_flags.c:44 (2)
+	 * off:printf1
+	 * off:printf2
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nDeactivating off again\n");
+	dynamic_flag_deactivate_kind(off, NULL);
+	dynamic_flag_list_state("off:", dynamic_flag_list_fprintf_cb, stdout);
+	/*
+	 * Expected:
+	 * Deactivating off again
+	 * off:printf1@tests/feature_flags.c:38 (1): DF_OPT flags are usually disabled, but should always be safe to enable
+	 * off:printf2@tests/feature_flags.c:44 (off)
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nFlipping group off:printf2 with a grace period\n");
+	group = dynamic_flag_group_create("off:printf2");
+	dynamic_flag_group_set_grace_period(group, GRACE_PERIOD_NS);
+	dynamic_flag_group_activate(group);
+	dynamic_flag_group_deactivate(group);
+	printf("off:printf2 is active: %d\n",
+	    dynamic_flag_is_active("off:printf2"));
+	/*
+	 * Expected:
+	 * Flipping group off:printf2 with a grace period
+	 * off:printf2 is active: 0
+	 * off:printf1
+	 * off:printf2
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nSweeping after the grace period\n");
+	nanosleep(&(struct timespec) { .tv_nsec = 2 * GRACE_PERIOD_NS }, NULL);
+	printf("swept: %zd\n", dynamic_flag_sweep());
+	dynamic_flag_group_destroy(group);
+	/*
+	 * Expected:
+	 * Sweeping after the grace period
+	 * swept: 1
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nFlipping group off:printf2 over the adaptive threshold\n");
+	dynamic_flag_set_adaptive_grace(ADAPTIVE_THRESHOLD, ADAPTIVE_MAX_NS);
+	group = dynamic_flag_group_create("off:printf2");
+	dynamic_flag_group_set_grace_period(group, ADAPTIVE_BASE_NS);
+	for (size_t i = 0; i < 8 * (ADAPTIVE_THRESHOLD + 1); i++) {
+		dynamic_flag_group_activate(group);
+		dynamic_flag_group_deactivate(group);
+	}
+
+	nanosleep(&(struct timespec) { .tv_nsec = ADAPTIVE_CHECK_NS }, NULL);
+	printf("swept: %zd\n", dynamic_flag_sweep());
+	/*
+	 * Expected:
+	 * Flipping group off:printf2 over the adaptive threshold
+	 * swept: 0
+	 */
+
+	printf("\nFlipping it again after two calm seconds\n");
+	nanosleep(&(struct timespec) { .tv_sec = 2,
+	    .tv_nsec = ADAPTIVE_BASE_NS }, NULL);
+	printf("swept: %zd\n", dynamic_flag_sweep());
+	dynamic_flag_group_activate(group);
+	dynamic_flag_group_deactivate(group);
+	nanosleep(&(struct timespec) { .tv_nsec = ADAPTIVE_CHECK_NS }, NULL);
+	printf("swept: %zd\n", dynamic_flag_sweep());
+	dynamic_flag_group_destroy(group);
+	dynamic_flag_set_adaptive_grace(0, 0);
+	/*
+	 * Expected:
+	 * Flipping it again after two calm seconds
+	 * swept: 1
+	 * swept: 1
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nQueueing asynchronous flips\n");
+	dynamic_flag_deactivate_async("on:printf2");
+	dynamic_flag_activate_async("on:printf2");
+	dynamic_flag_activate_async("off:printf2");
+	dynamic_flag_deactivate_async("off:printf2");
+	printf("flush: %d\n", dynamic_flag_flush());
+	dynamic_flag_list_state("on:printf2", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	/*
+	 * Expected:
+	 * Queueing asynchronous flips
+	 * flush: 0
+	 * on:printf2@tests/feature_flags.c:53 (1): DF_DEFAULT_SLOW flags are enabled like DF_DEFAULT, but instruct the compiler to expect them to be disabled.
+	 * off:printf1
+	 * on:printf2
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nQueueing an invalid asynchronous flip\n");
+	dynamic_flag_deactivate_async("on:printf2");
+	dynamic_flag_activate_async("on:printf2(");
+	printf("flush failed: %d\n", dynamic_flag_flush() < 0);
+	printf("flush: %d\n", dynamic_flag_flush());
+	/*
+	 * Expected:
+	 * Queueing an invalid asynchronous flip
+	 * flush failed: 1
+	 * flush: 0
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nWatching the generation\n");
+	generation = dynamic_flag_generation();
+	dynamic_flag_list_state("on:printf3", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	printf("unchanged after listing: %d\n",
+	    dynamic_flag_generation() == generation);
+	dynamic_flag_activate("on:printf3");
+	printf("changed after a count bump: %d\n",
+	    dynamic_flag_generation() != generation);
+	generation = dynamic_flag_generation();
+	dynamic_flag_list_state("on:printf3", dynamic_flag_list_fprintf_cb,
+	    stdout);
+	dynamic_flag_deactivate("on:printf3");
+	printf("changed after a count drop: %d\n",
+	    dynamic_flag_generation() != generation);
+	/*
+	 * Expected:
+	 * Watching the generation
+	 * on:printf3@tests/feature_flags.c:59 (1)
+	 * unchanged after listing: 1
+	 * changed after a count bump: 1
+	 * on:printf3@tests/feature_flags.c:59 (2)
+	 * changed after a count drop: 1
+	 */
+
+	printf("\nActivating kind init\n");
+	dynamic_flag_activate_kind(init, NULL);
+	dynamic_flag_list_state("init:", dynamic_flag_list_fprintf_cb, stdout);
+	run_init();
+	dynamic_flag_deactivate_kind(init, NULL);
+	run_init();
+	/*
+	 * Expected:
+	 * Activating kind init
+	 * init:printf@tests/feature_flags.c:77 (1)
+	 * init:printf
+	 * off:printf1
+	 * on:printf3
+	 * untouched:printf1
+	 * untouched:printf2
+	 * feature_flag:default_off
+	 */
+	run_all();
+
+	printf("\nRaising SIGTRAP\n");
+	raise(SIGTRAP);
+	printf("trap handler calls: %d\n", (int)traps);
+	/*
+	 * Expected:
+	 * Raising SIGTRAP
+	 * trap handler calls: 1
+	 */
+
 	return 0;
 }
@@ -0,0 +1,112 @@
+/*
+ * Measures the cost of flipping flags in each patch backend, with
+ * and without the "sync core" mode.
+ *
+ * Usage: dynamic_flag_bench_flip [iterations [spinning threads]]
+ *
+ * Spinning threads evaluate a flag in a loop, so membarriers and TLB
+ * shootdowns have other cores to interrupt.
+ */
+#include "dynamic_flag.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static atomic_bool done;
+
+static void *
+spin(void *arg)
+{
+	uint64_t hits = 0;
+
+	(void)arg;
+	while (atomic_load_explicit(&done, memory_order_relaxed) == false) {
+		if (DF_OPT(bench, spin)) {
+			hits++;
+		}
+	}
+
+	return (void *)(uintptr_t)hits;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+bench(const char *label, size_t iterations)
+{
+	uint64_t begin, end;
+
+	begin = now_ns();
+	for (size_t i = 0; i < iterations; i++) {
+		dynamic_flag_activate_kind(bench, NULL);
+		dynamic_flag_deactivate_kind(bench, NULL);
+	}
+
+	end = now_ns();
+	printf("%-24s %10.1f ns/flip\n", label,
+	    (double)(end - begin) / (2.0 * iterations));
+	return;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		enum dynamic_flag_backend backend;
+	} backends[] = {
+		{ "mprotect", DYNAMIC_FLAG_BACKEND_MPROTECT },
+		{ "proc_mem", DYNAMIC_FLAG_BACKEND_PROC_MEM },
+		{ "alias", DYNAMIC_FLAG_BACKEND_ALIAS },
+	};
+	size_t iterations = (argc > 1) ? strtoull(argv[1], NULL, 10) : 10000;
+	size_t nthreads = (argc > 2) ? strtoull(argv[2], NULL, 10) : 2;
+	pthread_t *threads;
+
+	dynamic_flag_init_lib();
+	threads = calloc(nthreads, sizeof(*threads));
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], NULL, spin, NULL);
+	}
+
+	/* The alias backend can't be undone, so it must come last. */
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		char label[64];
+
+		if (dynamic_flag_set_backend(backends[i].backend) != 0) {
+			printf("%-24s unavailable\n", backends[i].name);
+			continue;
+		}
+
+		dynamic_flag_set_sync_core_mode(false);
+		snprintf(label, sizeof(label), "%s", backends[i].name);
+		bench(label, iterations);
+
+		snprintf(label, sizeof(label), "%s+sync_core", backends[i].name);
+		if (dynamic_flag_set_sync_core_mode(true) != 0) {
+			printf("%-24s unavailable\n", label);
+			continue;
+		}
+
+		bench(label, iterations);
+	}
+
+	atomic_store(&done, true);
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	return 0;
+}
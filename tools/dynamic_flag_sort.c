@@ -0,0 +1,485 @@
+/*
+ * Post-link step that sorts an executable's `dynamic_flag_list`
+ * section by hook address, and marks the executable as sorted for
+ * the dynamic_flag library, which then skips sorting lists of
+ * records at runtime.
+ *
+ * Usage: dynamic_flag_sort INPUT [OUTPUT]
+ *
+ * Sorts INPUT in place if OUTPUT is missing.
+ *
+ * Sorting permutes the patch records, so the tool also rebases their
+ * PC-relative fields, and rewrites every `dynamic_flag_*_list`
+ * section (arrays of PC-relative references to records) to point to
+ * the records' new locations, in ascending order.
+ *
+ * Only 64-bit little-endian ELF files are supported.  Flag metadata
+ * is position-independent and never needs dynamic relocations; when
+ * the tool can't sort a file (e.g., when a relocation applies to flag
+ * metadata anyway), it copies the file unchanged and warns: the
+ * library then sorts at runtime, as usual.
+ */
+#include <elf.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Must match the library's `DYNAMIC_FLAG_SORTED_MAGIC`. */
+#define DYNAMIC_FLAG_SORTED_MAGIC 0x646574726f736664ULL /* "dfsorted" */
+
+/* Size of `struct patch_record`. */
+#define RECORD_SIZE 20
+
+/* Number of PC-relative fields, at the start of `struct patch_record`. */
+#define RECORD_FIELDS 4
+
+/* Offset of the hook field in `struct patch_record`. */
+#define RECORD_HOOK 0
+
+struct image {
+	uint8_t *data;
+	size_t size;
+	Elf64_Ehdr *ehdr;
+	Elf64_Shdr *shdrs;
+	const char *shstrtab;
+};
+
+/* A record, its hook address, and its index in the section. */
+struct record {
+	uint64_t hook;
+	size_t index;
+};
+
+static void __attribute__((__noreturn__, __format__(__printf__, 1, 2)))
+die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "dynamic_flag_sort: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+static void
+read_file(const char *path, struct image *image)
+{
+	struct stat st;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (file == NULL || fstat(fileno(file), &st) != 0) {
+		die("failed to open %s.", path);
+	}
+
+	image->size = st.st_size;
+	image->data = malloc(image->size);
+	if (image->data == NULL ||
+	    fread(image->data, 1, image->size, file) != image->size) {
+		die("failed to read %s.", path);
+	}
+
+	fclose(file);
+	return;
+}
+
+static void
+write_file(const char *path, const struct image *image, mode_t mode)
+{
+	FILE *file;
+
+	file = fopen(path, "wb");
+	if (file == NULL ||
+	    fwrite(image->data, 1, image->size, file) != image->size ||
+	    fclose(file) != 0) {
+		die("failed to write %s.", path);
+	}
+
+	chmod(path, mode & 07777);
+	return;
+}
+
+/**
+ * Returns a description of the reason `image` can't be sorted, or
+ * NULL if it's a supported ELF file.
+ */
+static const char *
+parse_elf(struct image *image)
+{
+	Elf64_Ehdr *ehdr = (Elf64_Ehdr *)image->data;
+
+	if (image->size < sizeof(*ehdr) ||
+	    memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) {
+		return "not an ELF file";
+	}
+
+	if (ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+	    ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+	    ehdr->e_machine != EM_X86_64) {
+		return "not an x86-64 ELF file";
+	}
+
+	if (ehdr->e_shoff == 0 || ehdr->e_shstrndx == SHN_UNDEF ||
+	    ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr) >
+	    image->size) {
+		return "no section headers";
+	}
+
+	image->ehdr = ehdr;
+	image->shdrs = (Elf64_Shdr *)(image->data + ehdr->e_shoff);
+	image->shstrtab = (const char *)image->data +
+	    image->shdrs[ehdr->e_shstrndx].sh_offset;
+	return NULL;
+}
+
+static const char *
+section_name(const struct image *image, const Elf64_Shdr *shdr)
+{
+
+	return image->shstrtab + shdr->sh_name;
+}
+
+static Elf64_Shdr *
+find_section(const struct image *image, const char *name)
+{
+
+	for (size_t i = 0; i < image->ehdr->e_shnum; i++) {
+		if (strcmp(section_name(image, &image->shdrs[i]), name) == 0) {
+			return &image->shdrs[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns whether `shdr` is an array of pointers to records:
+ * `dynamic_flag_${KIND}_list` or `dynamic_flag_init`.
+ */
+static bool
+is_pointer_section(const struct image *image, const Elf64_Shdr *shdr)
+{
+	const char *name = section_name(image, shdr);
+	size_t len = strlen(name);
+
+	if (strcmp(name, "dynamic_flag_init") == 0) {
+		return true;
+	}
+
+	return strncmp(name, "dynamic_flag_", strlen("dynamic_flag_")) == 0 &&
+	    len > strlen("dynamic_flag__list") &&
+	    strcmp(name + len - strlen("_list"), "_list") == 0;
+}
+
+static bool
+in_section(const Elf64_Shdr *shdr, uint64_t address)
+{
+
+	return shdr->sh_addr <= address &&
+	    address - shdr->sh_addr < shdr->sh_size;
+}
+
+static bool
+in_our_sections(const struct image *image, const Elf64_Shdr *list,
+    uint64_t address)
+{
+
+	if (in_section(list, address)) {
+		return true;
+	}
+
+	for (size_t i = 0; i < image->ehdr->e_shnum; i++) {
+		const Elf64_Shdr *shdr = &image->shdrs[i];
+
+		if (shdr != list && is_pointer_section(image, shdr) &&
+		    in_section(shdr, address)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Returns a description of the problem if a dynamic relocation
+ * applies to `list` or pointer sections, NULL otherwise.  PC-relative
+ * metadata shouldn't need any, and we don't know how to move them.
+ */
+static const char *
+check_relocs(const struct image *image, const Elf64_Shdr *list)
+{
+
+	for (size_t i = 0; i < image->ehdr->e_shnum; i++) {
+		const Elf64_Shdr *shdr = &image->shdrs[i];
+		size_t entsize;
+
+		/* Static relocations (from --emit-relocs) target sections. */
+		if ((shdr->sh_flags & SHF_ALLOC) == 0) {
+			continue;
+		}
+
+		if (shdr->sh_type == SHT_RELA) {
+			entsize = sizeof(Elf64_Rela);
+		} else if (shdr->sh_type == SHT_REL) {
+			entsize = sizeof(Elf64_Rel);
+		} else {
+			continue;
+		}
+
+		for (size_t j = 0; j < shdr->sh_size / entsize; j++) {
+			const Elf64_Rel *rel = (const Elf64_Rel *)
+			    (image->data + shdr->sh_offset + j * entsize);
+
+			if (in_our_sections(image, list, rel->r_offset)) {
+				return "dynamic relocation in flag metadata";
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the address that the PC-relative 32-bit word at `address`
+ * in `shdr` points to, or 0 for a null offset.
+ */
+static uint64_t
+read_relative(const struct image *image, const Elf64_Shdr *shdr,
+    uint64_t address)
+{
+	int32_t value;
+
+	memcpy(&value, image->data + shdr->sh_offset +
+	    (address - shdr->sh_addr), sizeof(value));
+	return (value == 0) ? 0 : address + (int64_t)value;
+}
+
+/**
+ * Writes a PC-relative reference to `target` at `address` in `shdr`
+ * (a null offset if `target` is 0).
+ */
+static void
+write_relative(struct image *image, const Elf64_Shdr *shdr,
+    uint64_t address, uint64_t target)
+{
+	int64_t offset = (target == 0) ? 0 : (int64_t)(target - address);
+	int32_t value = (int32_t)offset;
+
+	if (value != offset) {
+		die("relative offset out of range.");
+	}
+
+	memcpy(image->data + shdr->sh_offset + (address - shdr->sh_addr),
+	    &value, sizeof(value));
+	return;
+}
+
+static int
+cmp_records(const void *x, const void *y)
+{
+	const struct record *a = x;
+	const struct record *b = y;
+
+	if (a->hook != b->hook) {
+		return (a->hook < b->hook) ? -1 : 1;
+	}
+
+	return (a->index < b->index) ? -1 : (a->index > b->index);
+}
+
+static int
+cmp_addresses(const void *x, const void *y)
+{
+	const uint64_t *a = x;
+	const uint64_t *b = y;
+
+	if (*a == *b) {
+		return 0;
+	}
+
+	return (*a < *b) ? -1 : 1;
+}
+
+/**
+ * Returns the new address of `address` in `list`, after records
+ * moved according to `new_index`.
+ */
+static uint64_t
+moved_address(const Elf64_Shdr *list, const size_t *new_index,
+    uint64_t address)
+{
+	uint64_t offset = address - list->sh_addr;
+
+	return list->sh_addr + new_index[offset / RECORD_SIZE] * RECORD_SIZE +
+	    offset % RECORD_SIZE;
+}
+
+/**
+ * Rewrites a pointer section after records moved according to
+ * `new_index`, and sorts its entries.
+ */
+static void
+fix_pointer_section(struct image *image, const Elf64_Shdr *list,
+    const size_t *new_index, const Elf64_Shdr *shdr)
+{
+	size_t n = shdr->sh_size / sizeof(int32_t);
+	uint64_t *targets;
+
+	targets = calloc(n + 1, sizeof(*targets));
+	if (targets == NULL) {
+		die("out of memory.");
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t target = read_relative(image, shdr,
+		    shdr->sh_addr + i * sizeof(int32_t));
+
+		if (!in_section(list, target)) {
+			die("%s points outside dynamic_flag_list.",
+			    section_name(image, shdr));
+		}
+
+		targets[i] = moved_address(list, new_index, target);
+	}
+
+	qsort(targets, n, sizeof(*targets), cmp_addresses);
+	for (size_t i = 0; i < n; i++) {
+		write_relative(image, shdr, shdr->sh_addr + i * sizeof(int32_t),
+		    targets[i]);
+	}
+
+	free(targets);
+	return;
+}
+
+/**
+ * Sorts `dynamic_flag_list` in `image`.  Returns NULL on success, and
+ * a description of the problem if `image` can't be sorted.
+ */
+static const char *
+sort_image(struct image *image)
+{
+	Elf64_Shdr *list, *meta;
+	struct record *records;
+	size_t *new_index;
+	uint64_t (*fields)[RECORD_FIELDS];
+	uint8_t *sorted;
+	uint64_t magic = DYNAMIC_FLAG_SORTED_MAGIC;
+	const char *error;
+	size_t n;
+
+	error = parse_elf(image);
+	if (error != NULL) {
+		return error;
+	}
+
+	list = find_section(image, "dynamic_flag_list");
+	meta = find_section(image, "dynamic_flag_meta");
+	if (list == NULL || meta == NULL || meta->sh_size < sizeof(magic)) {
+		return "no dynamic_flag_list or dynamic_flag_meta section";
+	}
+
+	if (list->sh_type != SHT_PROGBITS || meta->sh_type != SHT_PROGBITS ||
+	    list->sh_size % RECORD_SIZE != 0) {
+		return "malformed dynamic_flag_list or dynamic_flag_meta section";
+	}
+
+	error = check_relocs(image, list);
+	if (error != NULL) {
+		return error;
+	}
+
+	n = list->sh_size / RECORD_SIZE;
+	records = calloc(n + 1, sizeof(*records));
+	new_index = calloc(n + 1, sizeof(*new_index));
+	fields = calloc(n + 1, sizeof(*fields));
+	sorted = malloc(list->sh_size + 1);
+	if (records == NULL || new_index == NULL || fields == NULL ||
+	    sorted == NULL) {
+		die("out of memory.");
+	}
+
+	/* Decode all PC-relative fields before moving anything. */
+	for (size_t i = 0; i < n; i++) {
+		uint64_t record = list->sh_addr + i * RECORD_SIZE;
+
+		for (size_t j = 0; j < RECORD_FIELDS; j++) {
+			fields[i][j] = read_relative(image, list,
+			    record + j * sizeof(int32_t));
+		}
+
+		records[i] = (struct record) {
+			.hook = fields[i][RECORD_HOOK / sizeof(int32_t)],
+			.index = i,
+		};
+	}
+
+	qsort(records, n, sizeof(*records), cmp_records);
+	for (size_t i = 0; i < n; i++) {
+		new_index[records[i].index] = i;
+		memcpy(sorted + i * RECORD_SIZE,
+		    image->data + list->sh_offset +
+		    records[i].index * RECORD_SIZE, RECORD_SIZE);
+	}
+
+	memcpy(image->data + list->sh_offset, sorted, list->sh_size);
+	for (size_t i = 0; i < n; i++) {
+		uint64_t record = list->sh_addr + i * RECORD_SIZE;
+
+		for (size_t j = 0; j < RECORD_FIELDS; j++) {
+			write_relative(image, list,
+			    record + j * sizeof(int32_t),
+			    fields[records[i].index][j]);
+		}
+	}
+
+	for (size_t i = 0; i < image->ehdr->e_shnum; i++) {
+		const Elf64_Shdr *shdr = &image->shdrs[i];
+
+		if (shdr != list && is_pointer_section(image, shdr)) {
+			fix_pointer_section(image, list, new_index, shdr);
+		}
+	}
+
+	memcpy(image->data + meta->sh_offset, &magic, sizeof(magic));
+
+	free(sorted);
+	free(fields);
+	free(new_index);
+	free(records);
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct image image = { NULL };
+	const char *error;
+	struct stat st;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s INPUT [OUTPUT]\n", argv[0]);
+		return 1;
+	}
+
+	if (stat(argv[1], &st) != 0) {
+		die("failed to stat %s.", argv[1]);
+	}
+
+	read_file(argv[1], &image);
+	error = sort_image(&image);
+	if (error != NULL) {
+		fprintf(stderr, "dynamic_flag_sort: %s: %s; leaving it unsorted.\n",
+		    argv[1], error);
+		/* sort_image only writes once it's sure it can succeed. */
+	}
+
+	write_file((argc > 2) ? argv[2] : argv[1], &image, st.st_mode);
+	return 0;
+}